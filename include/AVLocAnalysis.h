@@ -0,0 +1,80 @@
+//
+// Single pass analysis layer for the avloc summary ntuple
+//
+// Analyses declare their cuts and are booked on a HitLoop, which reads
+// the ntuple once for all of them. If every analysis is restricted to
+// one fibre and the file is indexed, only those fibres are read. Hits are read in chunks on the
+// calling thread and only kept if they pass the cuts of at least one
+// analysis; the distance is only looked up for those. Each chunk is then
+// handed to the booked analyses, one thread per analysis, so an analysis
+// sees its own hits in file order and needs no locking
+//
+#ifndef __AVLOCANALYSIS_H__
+#define __AVLOCANALYSIS_H__
+
+#include <vector>
+
+#include "include/AVLocNtuple.h"
+
+using namespace std;
+
+// One hit of the summary ntuple
+struct HitRow {
+  int   fibre_nr;
+  int   fibre_sub;
+  int   lcn;
+  float time;  // ns
+  float dist;  // fibre to PMT distance (mm)
+};
+
+class HitAnalysis {
+public:
+  // no cuts
+  HitAnalysis();
+  virtual ~HitAnalysis() {}
+
+  // declared cuts, boundaries included; analyses apply their exact cuts in Fill
+  void SetFibre(int fibre_nr, int fibre_sub = -1);  // -1: any
+  void SetTimeWindow(double time_min, double time_max);  // ns
+  void SetDistWindow(double dist_min, double dist_max);  // mm
+  int GetFibreNr() const { return fFibreNr; }
+  int GetFibreSub() const { return fFibreSub; }
+
+  // true if the hit could pass the cuts, the distance is not looked at
+  bool AcceptFibreTime(const HitRow & hit) const;
+  bool Accept(const HitRow & hit) const;
+
+  // called for every hit inside the declared cuts, in file order, possibly on a worker thread
+  virtual void Fill(const HitRow & hit) = 0;
+  // called once on the thread calling HitLoop::Run after the last hit
+  virtual void Finish() {}
+
+protected:
+  int    fFibreNr, fFibreSub;
+  double fTimeMin, fTimeMax;
+  double fDistMin, fDistMax;
+};
+
+class HitLoop {
+public:
+  // numThreads > 1 enables ROOT thread safety, as analyses may book histograms in Fill
+  HitLoop(HitReader & reader, int numThreads = 1);
+
+  // analyses are not owned and are finished in booking order
+  void Book(HitAnalysis * analysis);
+  // one pass over the ntuple for all booked analyses
+  void Run();
+
+  static const size_t kHitsPerChunk = 1 << 20;
+
+private:
+  // entry ranges to read, in entry order
+  vector<FibreRange> GetEntryRanges() const;
+  void Process(const vector<HitRow> & chunk);
+
+  HitReader & fReader;
+  int fNumThreads;
+  vector<HitAnalysis*> fAnalyses;
+};
+
+#endif
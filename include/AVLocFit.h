@@ -0,0 +1,78 @@
+//
+// AV offset fit of a single fibre
+//
+// FibreFit holds the hit times of one fibre together with the time of
+// flight model they are fitted to, either the tabulated time of flight or
+// the light path calculator. Fits of different fibres write nothing they
+// share, so they can run on separate threads. FitFibre minimises the chisq
+// of the hit times in the AV offset with Minuit
+//
+#ifndef __AVLOCFIT_H__
+#define __AVLOCFIT_H__
+
+#include <vector>
+
+#include <RAT/DU/GroupVelocity.hh>
+#include <RAT/DU/LightPathCalculator.hh>
+
+#include "include/AVLocTools.h"
+#include "include/AVLocTOFTable.h"
+#include "include/AVLocWorkspace.h"
+
+using namespace std;
+
+struct FibreFit {
+  int     fibre;
+  LEDInfo led;
+  // PMT indexed arrays in one allocation, sized from the number of PMTs and reset for each fibre
+  enum { kNumHits, kHitTimes, kHitErrors, kWeights, kNumArrays };
+  PMTArrays pmtArrays;
+  // number of times the PMT is hit, 0 for PMTs left out of the chisq
+  double & numHits(int LCN) { return pmtArrays[kNumHits][LCN]; }
+  // average hit time and its error (ns)
+  double & hitTimes(int LCN) { return pmtArrays[kHitTimes][LCN]; }
+  double & hitErrors(int LCN) { return pmtArrays[kHitErrors][LCN]; }
+  // weight of each PMT in the chisq, only used if weighted (bootstrap replicas), otherwise all are 1
+  double & weights(int LCN) { return pmtArrays[kWeights][LCN]; }
+  bool weighted;
+  // PMT positions for the light path calculator, shared between fits
+  PMTInfo * pmts;
+  // interpolate tofTable instead of calling the light path calculator
+  bool useTOFTable;
+  TOFTable tofTable;
+  // table was not in the table file, tabulated by the fit and written afterwards
+  bool newTable;
+  // the light path calculator is only queried through its const interface and shared between fits
+  const RAT::DU::LightPathCalculator * lp;
+  RAT::DU::GroupVelocity gv;
+  // spectrum averaged group velocities, NULL for the single wavelength model
+  const GroupVelocityTable * vgroup;
+  // limits of the AV offset (mm)
+  double offsetMin;
+  double offsetMax;
+  // fit result
+  double value;
+  double error;
+  int    status;
+  // fitted offsets and errors of the bootstrap replicas
+  vector<double> bootValues;
+  vector<double> bootErrors;
+  // start the fit from the previous value and error (online refits)
+  bool warmStart;
+  // fit result taken from the only partial result holding this fibre, not refitted
+  bool merged;
+
+  // time of flight (ns) to a PMT at the AV offset (mm)
+  // dTrial: if given, filled with the derivative w.r.t. the AV offset
+  double trialFunction(int LCN, double AVOffset, double * dTrial = NULL);
+  // chisq of the hit times at the AV offset par[0]
+  // dChisq: if given, filled with the derivative w.r.t. the AV offset
+  double chisq(const double * par, double * dChisq = NULL);
+};
+
+// fit the AV offset within [offsetMin,offsetMax], filling value, error and status
+// each call has its own minimiser, so this can run on any thread
+// useGradient: give Minuit the analytic derivative instead of letting it use finite differences
+void FitFibre(FibreFit & fit, bool useGradient = false);
+
+#endif
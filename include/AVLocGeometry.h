@@ -0,0 +1,73 @@
+//
+// Packed PMT geometry for AV location
+//
+// PMT positions, directions, unit vectors and flat map coordinates are
+// kept as aligned arrays (struct of arrays), built once from PMTINFO and
+// cached in a binary file next to the ntuple so later jobs do not have
+// to parse the RATDB tables again
+//
+#ifndef __AVLOCGEOMETRY_H__
+#define __AVLOCGEOMETRY_H__
+
+#include <string>
+
+#include "include/AVLocTools.h"
+
+using namespace std;
+
+// arrays start on and are padded to this many bytes
+const int kPMTGeometryAlign = 64;
+
+struct PMTGeometry {
+  int      n_pmts;
+  int      n_padded;  // allocated length of each array, padding is zero
+  double * x_pos;     // PMT bucket position (mm)
+  double * y_pos;
+  double * z_pos;
+  double * x_dir;     // PMT direction as in PMTINFO
+  double * y_dir;
+  double * z_dir;
+  double * x_unit;    // unit vector along the PMT position
+  double * y_unit;
+  double * z_unit;
+  double * x_flat;    // flat map projection, see IcosProject
+  double * y_flat;
+
+  PMTGeometry();
+  ~PMTGeometry();
+  // (re)allocate zeroed arrays for n PMTs
+  void Allocate(int n);
+
+private:
+  PMTGeometry(const PMTGeometry &);
+  PMTGeometry & operator=(const PMTGeometry &);
+  double * fBuffer;   // owns all arrays
+};
+
+// build the geometry from the PMTINFO table (airfill2.ratdb)
+void BuildPMTGeometry(PMTGeometry & geo);
+
+// binary cache, reading fails if the file is missing, from another version,
+// built from another PMTINFO file or older than it
+// writing goes through a temporary file that is renamed to filename
+bool ReadPMTGeometry(const string & filename, PMTGeometry & geo);
+bool WritePMTGeometry(const string & filename, const PMTGeometry & geo);
+
+// name of the cache for an ntuple: pmt_geometry.bin in the same directory
+string GetPMTGeometryCacheName(const string & ntuple_filename);
+
+// geometry for this process, loaded on the first call only
+// read from cache_file if possible, otherwise built and written to cache_file (if given)
+const PMTGeometry & GetPMTGeometry(const string & cache_file = "");
+
+// copy into the vectors used by PMTInfo
+PMTInfo GetPMTpositions(const PMTGeometry & geo);
+
+// TimeOfFlight (AVLocTools.h) from inject to every PMT in one pass, written to vectorise
+// (the hit time pre-screen of chisqFitter, checked against the scalar version in avloc_bench)
+// tof: filled with geo.n_pmts times (ns)
+// returns the relative error on the times, which is the same for all PMTs
+double TimeOfFlight(const PMTGeometry & geo, const TVector3 & inject, PhysicsNr n_h2o,
+		    double offset, double * tof);
+
+#endif
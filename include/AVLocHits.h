@@ -0,0 +1,99 @@
+//
+// Hits from the avloc summary ntuple bucketed per fibre
+//
+// One pass over the ntuple fills a small time histogram and running
+// (Welford) moments of the hit time for every (fibre, sub, lcn) that
+// passes the cuts, so fits do not have to rescan the ntuple for each fibre.
+// The same buckets can be filled event by event for the online fit, and
+// written to and merged from partial result files of fibre sharded jobs
+//
+#ifndef __AVLOCHITS_H__
+#define __AVLOCHITS_H__
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <TFile.h>
+#include <TH1D.h>
+
+#include "include/AVLocNtuple.h"
+
+using namespace std;
+
+// Bucketed hits of one fibre
+struct FibreHits {
+  int    fibre_nr;
+  int    fibre_sub;
+  int    n_bins;          // time histogram binning, as for a TH1D
+  double time_min;
+  double time_max;
+  vector<int> lcn;        // LCNs with at least one hit
+  vector<int> row;        // LCN -> row in n_hits and counts, -1 if not hit
+  vector<int> n_hits;     // number of hits per row
+  vector<double> mean;    // mean hit time per row (ns)
+  vector<double> m2;      // sum of squared deviations from the mean per row (ns^2)
+  vector<unsigned int> counts; // counts[row*n_bins+bin]: hits in time bin (0 = first bin)
+};
+
+// Accumulates hits as they arrive, BucketHits from the ntuple or the online fit from RAT events
+// fibres are kept in order of first appearance, also if none of their hits pass the cuts
+class HitBuckets {
+public:
+  // keeps hits with dist < dist_max and time_lower < time < time_upper
+  HitBuckets(double dist_max, double time_lower, double time_upper,
+	     int n_bins, double time_min, double time_max);
+  void Add(int fibre_nr, int fibre_sub, int lcn, double time, double dist);
+  // hits of one event or file, the distance is calculated from the fibre and PMT positions
+  void Add(const LEDInfo & led, const HitBuffer & buffer, const PMTInfo & pmt_info);
+  const vector<FibreHits> & GetFibres() const { return fFibres; }
+private:
+  FibreHits & GetFibre(int fibre_nr, int fibre_sub);
+
+  double fDistMax, fTimeLower, fTimeUpper;
+  int    fNBins;
+  double fTimeMin, fTimeMax;
+  vector<FibreHits> fFibres;
+  map<pair<int,int>,int> fIndex;  // (fibre, sub) -> index in fFibres
+  int fLastNr, fLastSub, fLast;
+};
+
+// single pass over the avloc hits keeping hits with dist < dist_max and time_lower < time < time_upper
+// returns one entry per (fibre, sub) in order of first appearance
+vector<FibreHits> BucketHits(HitReader & reader, double dist_max, double time_lower, double time_upper,
+			     int n_bins, double time_min, double time_max);
+
+// same for the fibres in fibre_nrs only (both sub fibres), using the ntuple index if there is one
+vector<FibreHits> BucketHits(HitReader & reader, double dist_max, double time_lower, double time_upper,
+			     int n_bins, double time_min, double time_max, const vector<int> & fibre_nrs);
+
+// add the hits of from to into, both must be for the same fibre and binning
+// the moments are combined as for a single pass over all hits
+bool MergeFibreHits(FibreHits & into, const FibreHits & from);
+// add each fibre of from to the entry of the same fibre in into, or append it
+bool MergeFibreHits(vector<FibreHits> & into, const vector<FibreHits> & from);
+
+// partial results: the buckets are written to the "avlocbuckets" tree, one entry per fibre
+void WriteFibreHits(TFile * file, const vector<FibreHits> & hits);
+// merge the buckets in file into hits, false if the file has none or the binning differs
+bool ReadFibreHits(TFile * file, vector<FibreHits> & hits);
+
+// number of hits on a PMT, 0 if not hit
+int GetNumHits(const FibreHits & hits, int lcn);
+
+// mean hit time of a PMT and its error (standard deviation/sqrt(n)), false if fewer than 2 hits
+// this is the mean of all hits in the time window, tails included
+bool GetHitTime(const FibreHits & hits, int lcn, double & mean, double & error);
+
+// peak of the hit times of a PMT and its error from the time histogram, false if fewer than 2 hits
+// the mean is iterated over the bins within +-k_sigma standard deviations of it, with the standard
+// deviation corrected for the truncation of a gaussian at +-k_sigma and for the bin width, so the
+// prepulse and late light tails pull it much less than the mean of all hits
+bool GetHitPeak(const FibreHits & hits, int lcn, double & peak, double & error, double k_sigma = 2.);
+
+// time histogram of a PMT, caller owns the histogram
+TH1D * GetHitHisto(const FibreHits & hits, int lcn, const char * name);
+// same into an existing histogram with the binning of the buckets, which is reset first
+void FillHitHisto(const FibreHits & hits, int lcn, TH1D * histo);
+
+#endif
@@ -0,0 +1,227 @@
+//
+// Light paths for a fixed detector configuration
+//
+// RAT::DU::LightPathCalculator::QueryByPosition decides at run time where
+// the path starts, whether the AV reflection is used and whether the path
+// enters the neck. LightPathT makes these choices template policies so a
+// fit in one configuration, a fibre outside the AV with the ELLIE
+// reflection switched on, compiles to the straight line path of that
+// configuration only. The reflection is not calculated twice either, as
+// CalcPath did before by trying it ahead of QueryByPosition. Paths that
+// leave the configuration (nan positions, sources inside the AV for
+// AnySource, paths through the neck for CheckNeck) are passed on to the
+// general LightPathCalculator, so results are the same as QueryByPosition
+//
+#ifndef __AVLOCLIGHTPATH_H__
+#define __AVLOCLIGHTPATH_H__
+
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include <TMath.h>
+#include <TVector3.h>
+#include <RAT/DU/LightPathCalculator.hh>
+
+using namespace std;
+
+// source policies
+// the source is always outside of the AV, checked by assert only
+struct OutsideAVSource { static const bool kAlwaysOutside = true; };
+// sources inside the AV are passed on to the LightPathCalculator
+struct AnySource       { static const bool kAlwaysOutside = false; };
+
+// path policies, both use the straight line paths of the LightPathCalculator
+// straight lines with the reflection off the outer AV surface, needs SetELLIEReflect(true)
+struct ELLIEReflection { static const bool kReflect = true; };
+// straight lines without the reflection, as queries with locality 0 and the reflection off
+// queries with a non zero locality are passed on to the LightPathCalculator
+struct StraightLine    { static const bool kReflect = false; };
+
+// neck policies
+// paths into the neck are passed on to the LightPathCalculator
+struct CheckNeck       { static const bool kCheckNeck = true; };
+// the neck is ignored, only for sources that can not see it through the AV
+struct IgnoreNeck      { static const bool kCheckNeck = false; };
+
+template <class Source, class Path, class Neck>
+class LightPathT {
+public:
+  // the LightPathCalculator provides the geometry and the fallback, it must outlive this
+  LightPathT(const RAT::DU::LightPathCalculator & lp);
+  // same as lp.QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset)
+  RAT::DU::LightPathResult Query(const TVector3 & eventPos, const TVector3 & pmtPos,
+				 double energy, double localityVal, double avOffset) const;
+private:
+  // copies of the private helpers of the LightPathCalculator
+  // with all refractive indices equal to 1, TIR only sets the flag
+  static TVector3 VectorToSphereEdge(const TVector3 & startPos, const TVector3 & startDir,
+				     double radius, bool outside, bool & isTIR);
+  static TVector3 PathRefraction(const TVector3 & incidentVec, const TVector3 & incidentSurfVec, bool & isTIR);
+  static double ClosestAngle(const TVector3 & pos, double edgeRadius) {
+    return TMath::Pi()/2. - TMath::ACos(edgeRadius/pos.Mag());
+  }
+  // the condition of SetAVNeckInformation
+  bool EntersNeck(const TVector3 & pointOnAV, const TVector3 & dirVec) const;
+
+  const RAT::DU::LightPathCalculator * fLP;
+  double fAVInnerRadius, fAVOuterRadius, fNeckInnerRadius;
+  double fNeckMinHeight;
+};
+
+// the configuration of the AV location fits
+typedef LightPathT<OutsideAVSource,ELLIEReflection,CheckNeck> AVLocLightPath;
+extern template class LightPathT<OutsideAVSource,ELLIEReflection,CheckNeck>;
+
+template <class Source, class Path, class Neck>
+LightPathT<Source,Path,Neck>::LightPathT(const RAT::DU::LightPathCalculator & lp)
+  : fLP(&lp), fAVInnerRadius(lp.GetAVInnerRadius()), fAVOuterRadius(lp.GetAVOuterRadius()),
+    fNeckInnerRadius(lp.GetNeckInnerRadius())
+{
+  if ( lp.GetELLIEReflect() != Path::kReflect ) {
+    cerr << "AVLocLightPath::LightPathT : the ELLIE reflection of the LightPathCalculator is "
+	 << (lp.GetELLIEReflect() ? "on" : "off") << ", the path policy needs it "
+	 << (Path::kReflect ? "on" : "off") << endl;
+    assert(lp.GetELLIEReflect() == Path::kReflect);
+  }
+  fNeckMinHeight = TMath::Sqrt(TMath::Power(fAVInnerRadius,2.0) - TMath::Power(fNeckInnerRadius,2.0));
+}
+
+template <class Source, class Path, class Neck>
+TVector3 LightPathT<Source,Path,Neck>::VectorToSphereEdge(const TVector3 & startPos, const TVector3 & startDir,
+							  double radius, bool outside, bool & isTIR)
+{
+  const double bCoeff = 2.0 * startPos.Mag() * TMath::Cos(startPos.Angle(startDir));
+  const double cCoeff = startPos.Mag2() - radius*radius;
+  const double discrim = TMath::Power(bCoeff,2) - 4.0*cCoeff;
+  double distParam = 0.0;
+  if ( discrim >= 0.0 ) {
+    const double discrimPlus  = (-1.0*bCoeff + TMath::Sqrt(discrim))/2.0;
+    const double discrimMinus = (-1.0*bCoeff - TMath::Sqrt(discrim))/2.0;
+    if ( discrimPlus > 0.0 && !outside ) distParam = discrimPlus;
+    else                                 distParam = std::min(discrimMinus,discrimPlus);
+  }
+  else isTIR = true;
+  return startPos + distParam*startDir;
+}
+
+template <class Source, class Path, class Neck>
+TVector3 LightPathT<Source,Path,Neck>::PathRefraction(const TVector3 & incidentVec, const TVector3 & incidentSurfVec,
+						      bool & isTIR)
+{
+  // Snell's law with a ratio of refractive indices of 1
+  const double ratioRI = 1.0;
+  const double cosTheta1 = incidentSurfVec.Dot(-1.0*incidentVec);
+  const double cosTheta2 = TMath::Sqrt(1 - TMath::Power(ratioRI,2)*(1 - TMath::Power(cosTheta1,2)));
+  TVector3 refractedVec;
+  if ( std::isnan(cosTheta2) ) {
+    isTIR = true;
+    refractedVec = incidentVec;
+  }
+  else if ( cosTheta1 >= 0.0 ) refractedVec = ratioRI*incidentVec + (ratioRI*cosTheta1 - cosTheta2)*incidentSurfVec;
+  else                         refractedVec = ratioRI*incidentVec - (ratioRI*cosTheta1 - cosTheta2)*incidentSurfVec;
+  return refractedVec.Unit();
+}
+
+template <class Source, class Path, class Neck>
+bool LightPathT<Source,Path,Neck>::EntersNeck(const TVector3 & pointOnAV, const TVector3 & dirVec) const
+{
+  if ( !Neck::kCheckNeck ) return false;
+  TVector3 pointOnAVXY = pointOnAV;
+  pointOnAVXY.SetZ(0.0);
+  return pointOnAV.Z() > fNeckMinHeight && pointOnAVXY.Mag() < fNeckInnerRadius
+    && dirVec.Angle(TVector3(0.0,0.0,1.0)) < TMath::Pi()/2.;
+}
+
+template <class Source, class Path, class Neck>
+RAT::DU::LightPathResult LightPathT<Source,Path,Neck>::Query(const TVector3 & eventPos, const TVector3 & pmtPos,
+							     double energy, double localityVal, double avOffset) const
+{
+  // the refracted paths of the LightPathCalculator are not specialised
+  if ( !Path::kReflect && localityVal != 0.0 ) return fLP->QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset);
+  // sources in the scintillator or in the acrylic
+  const double startMag = eventPos.Mag();
+  if ( Source::kAlwaysOutside ) assert(!(startMag < fAVOuterRadius));
+  else if ( startMag < fAVOuterRadius && startMag != fAVInnerRadius )
+    return fLP->QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset);
+  // the LightPathCalculator returns its reset values for these
+  if ( std::isnan(startMag) || std::isinf(startMag) || std::isnan(pmtPos.Mag()) || std::isinf(pmtPos.Mag()) )
+    return fLP->QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset);
+
+  RAT::DU::LightPathResult result;
+  result.dDistInWaterDAVOffset = 0.0;
+  result.isTIR        = false;
+  result.resvHit      = false;
+  result.straightLine = true;
+  const TVector3 initOffset = (pmtPos - eventPos).Unit();
+  result.initialLightVec = initOffset;
+
+  if ( Path::kReflect ) {
+    RAT::DU::ReflectionPath reflection = fLP->CalcReflectionByPosition(eventPos,pmtPos,avOffset);
+    if ( reflection.valid ) {
+      result.type             = RAT::DU::WRefl;
+      result.distInInnerAV    = 0.0;
+      result.distInAV         = 0.0;
+      result.distInWater      = reflection.distInWater;
+      result.dDistInWaterDAVOffset = reflection.dDistInWaterDAVOffset;
+      result.incidentVecOnPMT = reflection.incidentVecOnPMT;
+      result.initialLightVec  = reflection.initialLightVec;
+      return result;
+    }
+  }
+
+  // does the straight line enter the AV
+  double approachAngle = ClosestAngle(eventPos,fAVOuterRadius);
+  double angle = (-1.0*eventPos).Angle(initOffset);
+  double sinAngle = TMath::Sin(eventPos.Angle(initOffset));
+  double rRatio = fAVOuterRadius/startMag;
+  if ( !(angle < approachAngle && sinAngle < rRatio) ) {
+    result.type             = RAT::DU::W;
+    result.distInInnerAV    = 0.0;
+    result.distInAV         = 0.0;
+    result.distInWater      = (eventPos - pmtPos).Mag();
+    result.incidentVecOnPMT = (pmtPos - eventPos).Unit();
+    return result;
+  }
+
+  bool isTIR = false;
+  const double endMag = pmtPos.Mag();
+  TVector3 pointOnAV1st = VectorToSphereEdge(eventPos,initOffset,fAVOuterRadius,1,isTIR);
+  TVector3 vec1 = PathRefraction(initOffset,pointOnAV1st.Unit(),isTIR);
+  // does it enter the scintillator
+  approachAngle = ClosestAngle(pointOnAV1st,fAVInnerRadius);
+  angle = (-1.0*pointOnAV1st).Angle(vec1);
+  sinAngle = TMath::Sin(pointOnAV1st.Angle(vec1));
+  rRatio = fAVInnerRadius/pointOnAV1st.Mag();
+  if ( angle < approachAngle && sinAngle < rRatio ) {
+    TVector3 pointOnAV2nd = VectorToSphereEdge(pointOnAV1st,vec1,fAVInnerRadius,1,isTIR);
+    TVector3 vec2 = PathRefraction(vec1,pointOnAV2nd.Unit(),isTIR);
+    TVector3 pointOnAV3rd = VectorToSphereEdge(pointOnAV2nd,vec2,fAVInnerRadius,0,isTIR);
+    TVector3 vec3 = PathRefraction(vec2,(-1.0*pointOnAV3rd).Unit(),isTIR);
+    TVector3 pointOnAV4th = VectorToSphereEdge(pointOnAV3rd,vec3,fAVOuterRadius,0,isTIR);
+    TVector3 vec4 = PathRefraction(vec3,(-1.0*pointOnAV4th).Unit(),isTIR);
+    if ( EntersNeck(pointOnAV3rd,vec2) ) return fLP->QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset);
+    TVector3 endPos = VectorToSphereEdge(pointOnAV4th,vec4,endMag,0,isTIR);
+    result.type             = RAT::DU::WASAW;
+    result.distInInnerAV    = (pointOnAV2nd - pointOnAV3rd).Mag();
+    result.distInAV         = (pointOnAV1st - pointOnAV2nd).Mag() + (pointOnAV3rd - pointOnAV4th).Mag();
+    result.distInWater      = (eventPos - pointOnAV1st).Mag() + (pointOnAV4th - endPos).Mag();
+    result.incidentVecOnPMT = vec4;
+  }
+  else {
+    TVector3 pointOnAV2nd = VectorToSphereEdge(pointOnAV1st,vec1,fAVOuterRadius,0,isTIR);
+    TVector3 vec2 = PathRefraction(vec1,(-1.0*pointOnAV2nd).Unit(),isTIR);
+    if ( EntersNeck(pointOnAV2nd,vec1) ) return fLP->QueryByPosition(eventPos,pmtPos,energy,localityVal,avOffset);
+    TVector3 endPos = VectorToSphereEdge(pointOnAV2nd,vec2,endMag,0,isTIR);
+    result.type             = RAT::DU::WAW;
+    result.distInInnerAV    = 0.0;
+    result.distInAV         = (pointOnAV1st - pointOnAV2nd).Mag();
+    result.distInWater      = (eventPos - pointOnAV1st).Mag() + (pointOnAV2nd - endPos).Mag();
+    result.incidentVecOnPMT = vec2;
+  }
+  result.isTIR = isTIR;
+  return result;
+}
+
+#endif
@@ -0,0 +1,141 @@
+//
+// Compact summary ntuple for AV location
+//
+// Hits are stored in the "avlochits" tree with typed branches
+// (fibre_nr, fibre_sub, lcn, time). The fibre position and direction
+// are written once per fibre to the "avlocfibres" tree, so the PMT
+// distance is looked up instead of being stored for every hit.
+// The "avlocindex" tree holds the entry ranges of each fibre, so a
+// single fibre can be read without scanning the whole file.
+// HitReader reads both this format and the old "avloctuple" TNtuple
+//
+#ifndef __AVLOCNTUPLE_H__
+#define __AVLOCNTUPLE_H__
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <TFile.h>
+#include <TNtuple.h>
+#include <TString.h>
+#include <TTree.h>
+
+#include "include/AVLocTools.h"
+
+using namespace std;
+
+// Fibre metadata as stored in the "avlocfibres" tree
+struct FibreRecord {
+  Int_t    nr;
+  Int_t    sub;
+  Double_t position[3];
+  Double_t direction[3];
+};
+
+// Entries [first,first+entries) of the hits tree belong to one fibre, as stored in the "avlocindex" tree
+struct FibreRange {
+  Int_t    nr;
+  Int_t    sub;
+  Long64_t first;
+  Long64_t entries;
+};
+
+// Hits of one fibre kept in memory, e.g. by a worker thread, until they are written
+struct HitBuffer {
+  vector<UShort_t> lcn;
+  vector<Float_t>  time;
+  void Fill(int pmt, double t) { lcn.push_back(pmt); time.push_back(t); }
+  void Clear() { vector<UShort_t>().swap(lcn); vector<Float_t>().swap(time); }
+};
+
+class HitWriter {
+public:
+  // creates the trees in file, or appends to them if they are already there
+  // a file with an old avloctuple is not written to, IsOpen is false then
+  HitWriter(TFile * file);
+  ~HitWriter();
+  bool IsOpen() const { return fHits != NULL; }
+
+  void Fill(LEDInfo & led_info, int lcn, double time);
+  void Fill(LEDInfo & led_info, const HitBuffer & buffer);
+  // write the hits, fibres and index trees to the file
+  void Write();
+
+private:
+  // index of files written before the index tree existed
+  void ScanIndex();
+
+  TFile * fFile;
+  TTree * fHits;
+  TTree * fFibres;
+  UChar_t  fFibreNr;
+  UChar_t  fFibreSub;
+  UShort_t fLCN;
+  Float_t  fTime;
+  FibreRecord fRecord;
+  map<pair<int,int>,bool> fKnownFibres; // fibres already in the metadata tree
+  int fLastNr, fLastSub;
+  vector<FibreRange> fIndex;
+};
+
+class HitReader {
+public:
+  // opens the "avlochits" tree in file, or the "avloctuple" ntuple for older files
+  // pmt_info is used to calculate the distance between fibre and PMT
+  HitReader(TFile * file, PMTInfo & pmt_info);
+  ~HitReader();
+
+  // false if the file holds neither format
+  bool IsValid() const { return fTree != NULL; }
+  bool IsLegacy() const { return fLegacy; }
+  TTree * GetTree() { return fTree; }
+
+  Long64_t GetEntries() const { return fTree->GetEntries(); }
+  void GetEntry(Long64_t i);
+
+  // false if the file has no index, entry ranges then cover the whole tree
+  bool HasIndex() const { return fHasIndex; }
+  // entry ranges holding the hits of a fibre (fibre_sub -1: any), in entry order
+  vector<FibreRange> GetEntryRanges(int fibre_nr, int fibre_sub = -1) const;
+  // fibre numbers in the avlocfibres tree in increasing order, empty for old files
+  vector<int> GetFibreNrs() const;
+
+  // values of the current hit
+  int    GetFibreNr() const { return fFibreNr; }
+  int    GetFibreSub() const { return fFibreSub; }
+  int    GetLCN() const { return fLCN; }
+  double GetTime() const { return fTime; }
+  // distance between fibre and PMT (mm)
+  double GetDist();
+
+private:
+  void ReadFibres(TFile * file);
+  void ReadIndex(TFile * file);
+  // table of PMT distances for a fibre, filled on first use
+  const vector<float> & GetDistTable(int fibre_nr, int fibre_sub);
+
+  TTree * fTree;
+  bool    fLegacy;
+  bool    fHasIndex;
+  vector<FibreRange> fIndex;
+  PMTInfo & fPMTInfo;
+  // current hit
+  int   fFibreNr, fFibreSub, fLCN;
+  float fTime, fDist;
+  // branch buffers
+  UChar_t  fBufFibreNr, fBufFibreSub;
+  UShort_t fBufLCN;
+  Float_t  fLegacyBuf[5]; // fibre_nr:fibre_sub:lcn:time:dist
+  // fibre positions and cached distance tables
+  map<pair<int,int>,TVector3> fFibrePositions;
+  map<pair<int,int>,vector<float> > fDistTables;
+  int fLastNr, fLastSub;
+  const vector<float> * fLastTable;
+};
+
+// function to gain access to a (re)writable compact summary ntuple for avloc
+// same file naming as GetNtuple
+HitWriter * GetHitWriter(TFile ** fpointer, TString filename);
+
+#endif
@@ -0,0 +1,103 @@
+//
+// Persistent cache of light paths for AV location
+//
+// The light paths from a fibre to the PMTs for one AV offset only depend
+// on the PMT positions, the detector geometry and refractive indices of
+// the LightPathCalculator at the energy used, and the locality. These
+// inputs are hashed, and the paths (distances, derivative w.r.t. the AV
+// offset and angle of entry into the PMT) are kept in one binary file
+// per fibre and offset, avloc_paths/<hash>.bin. Files are memory mapped
+// when found, missing PMTs are calculated on use and the file is
+// rewritten when the block goes out of scope
+//
+#ifndef __AVLOCPATHCACHE_H__
+#define __AVLOCPATHCACHE_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <TVector3.h>
+#include <RAT/DU/GroupVelocity.hh>
+#include <RAT/DU/LightPathCalculator.hh>
+
+#include "include/AVLocTools.h"
+
+using namespace std;
+
+// flags of CachedPath
+const int kPathValid   = 1;  // entry has been calculated
+const int kPathTIR     = 2;  // total internal reflection
+const int kPathResvHit = 4;  // light path did not converge within the locality
+const int kPathClosed  = 8;  // closed form AV reflection
+
+// light path from a fibre to one PMT
+struct CachedPath {
+  double distInInnerAV;          // mm
+  double distInAV;
+  double distInWater;
+  double dDistInWaterDAVOffset;  // derivative of distInWater w.r.t. the AV offset
+  double angleOfEntry;           // angle between the light and the PMT direction (degrees)
+  Int_t  flags;
+  Int_t  reserved;
+};
+
+// light path as in CalcTimeOfFlight: closed form if the ELLIE reflection is
+// switched on and possible, the full light path calculation otherwise
+CachedPath CalcPath(const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+		    const RAT::DU::LightPathCalculator & lp, double energy, double localityVal, double AVOffset);
+
+// time of flight (ns) along the path including the PMT bucket time
+// dTdOffset and vgroup as in CalcTimeOfFlight
+double PathTimeOfFlight(const CachedPath & path, const RAT::DU::GroupVelocity & gv, double energy,
+			double * dTdOffset = NULL, const GroupVelocityTable * vgroup = NULL);
+
+// cache directory: AVLOC_PATH_CACHE if set (empty switches the cache off),
+// otherwise the one given to SetPathCacheDir, empty by default
+void SetPathCacheDir(const string & dir);
+string GetPathCacheDir();
+// avloc_paths in the directory of an ntuple
+string GetPathCacheDirName(const string & ntuple_filename);
+
+// paths from one fibre for one AV offset, see PathCache::GetBlock
+// copies share the memory mapped file
+class PathBlock {
+public:
+  PathBlock(const TVector3 & fibrePos, const PMTInfo & pmt_info, const RAT::DU::LightPathCalculator & lp,
+	    double energy, double localityVal, double AVOffset, ULong64_t key, const string & filename);
+  ~PathBlock();
+  // path to a PMT, the reference is valid until the next call
+  const CachedPath & Get(int lcn);
+  // write the calculated paths, does nothing if there are none or the cache is off
+  bool Save();
+  const string & GetFileName() const { return fFileName; }
+private:
+  bool Map();
+
+  TVector3 fFibrePos;
+  const PMTInfo * fPMTInfo;
+  const RAT::DU::LightPathCalculator * fLP;
+  double fEnergy, fLocality, fAVOffset;
+  ULong64_t fKey;
+  string fFileName;
+  shared_ptr<const char> fMapping;   // header followed by the paths
+  const CachedPath * fMapped;
+  vector<CachedPath> fPaths;         // used once a path is missing from the file
+  bool fDirty;
+};
+
+// hash of the inputs that do not depend on the fibre and offset
+// the PMTs and the LightPathCalculator must outlive the blocks
+class PathCache {
+public:
+  PathCache(const PMTInfo & pmt_info, const RAT::DU::LightPathCalculator & lp, double energy, double localityVal);
+  PathBlock GetBlock(const TVector3 & fibrePos, double AVOffset) const;
+  ULong64_t GetKey() const { return fKey; }
+private:
+  const PMTInfo * fPMTInfo;
+  const RAT::DU::LightPathCalculator * fLP;
+  double fEnergy, fLocality;
+  ULong64_t fKey;
+};
+
+#endif
@@ -6,13 +6,25 @@
 #define __AVLOCPLOT_H__
 
 #include <cmath>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <TNtuple.h>
 #include <TH2.h>
 #include <TVector2.h>
 #include <TVector3.h>
 
+#include <RAT/DU/GroupVelocity.hh>
+#include <RAT/DU/LightPathCalculator.hh>
+
+#include "include/AVLocAnalysis.h"
+#include "include/AVLocNtuple.h"
+#include "include/AVLocPathCache.h"
+#include "include/AVLocTools.h"
+#include "include/AVLocWorkspace.h"
+
 // Tools for plotting on a SNO+ flat map
 // Originaly from Ken Clark, via James Waterfield
 // From http://www.rwgrayprojects.com/rbfnotes/polyhed/PolyhedraData/Icosahedralsahedron/Icosahedralsahedron.pdf
@@ -46,18 +58,141 @@ const TVector2 A54 = TVector2( 7.0 * a / 2.0 , 2.0 * b );
 TVector2 TransformCoord( const TVector3& V1, const TVector3& V2, const TVector3& V3, const TVector2& A1, const TVector2& A2, const TVector2& A3,const TVector3& P );
 TVector2 IcosProject( TVector3 pmtPos );
 
+// Expected times of flight from one fibre to the PMTs, each worked out once on first use
+// the light paths go through the path cache, see AVLocPathCache.h
+class FibreTimeOfFlight {
+public:
+  FibreTimeOfFlight(const TVector3 & fibrePos, const PMTInfo & pmt_info, const RAT::DU::GroupVelocity & gv,
+                    const RAT::DU::LightPathCalculator & lp, double AVOffset);
+  // time of flight including the PMT bucket time, and the bucket time alone (ns)
+  double GetTimeOfFlight(int lcn) { Calculate(lcn); return fTimeOfFlight[lcn]; }
+  double GetBucketTime(int lcn) { Calculate(lcn); return fBucketTime[lcn]; }
+  // times of flight to points across the PMT face, see bestHitTime
+  const vector<double> & GetHitTimeCandidates(int lcn);
+private:
+  void Calculate(int lcn) { if ( !fDone[lcn] ) CalculatePMT(lcn); }
+  void CalculatePMT(int lcn);
+
+  TVector3 fFibrePos;
+  const PMTInfo * fPMTInfo;
+  const RAT::DU::GroupVelocity * fGV;
+  const RAT::DU::LightPathCalculator * fLP;
+  double fAVOffset;
+  double fEnergy;
+  shared_ptr<PathBlock> fPaths;  // created on the first PMT, once the light path calculator is set up
+  vector<char>   fDone;
+  vector<double> fTimeOfFlight;
+  vector<double> fBucketTime;
+  map<int,vector<double> > fCandidates;
+};
+
+// times of flight from the fibre to points across the PMT face
+vector<double> hitTimeCandidates(const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+                                 const RAT::DU::GroupVelocity & gv, const RAT::DU::LightPathCalculator & lp, double AVOffset);
+// candidate closest to the hit time
+double bestHitTime(double hitTime, const vector<double> & candidates);
+double bestHitTime(double hitTime, const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+                   const RAT::DU::GroupVelocity & gv, const RAT::DU::LightPathCalculator & lp, double AVOffset);
+
+// Analyses behind the plotting functions below, to be booked together on one HitLoop
+
+// hits per PMT on the flat map, inside (in = true) or outside the distance cut
+class FlatmapAnalysis : public HitAnalysis {
+public:
+  FlatmapAnalysis(double distance, int fibre_nr, int sub_nr, double time_min, double time_max, bool in);
+  void Fill(const HitRow & hit);
+  void Finish();
+  TH2D * GetFlatmap() const { return fFlatmap; }
+private:
+  double   fDistance, fTimeMin, fTimeMax;
+  bool     fIn;
+  PMTArrays fPMTHits;
+  TH2D   * fFlatmap;
+};
+
+// hit time histogram per PMT, written with the summaries in Finish for PMTs with more than 30 hits
+class TimeHistogramsAnalysis : public HitAnalysis {
+public:
+  TimeHistogramsAnalysis(double distance, int fibre_nr, int sub_nr);
+  void Fill(const HitRow & hit);
+  void Finish();
+private:
+  double fDistance;
+  PMTHistograms fHistos;
+};
+
+// hit time residuals per PMT for one fibre and AV offset, see plot_offset
+class OffsetAnalysis : public HitAnalysis {
+public:
+  OffsetAnalysis(double distance, int fibre_nr, int sub_nr, double AVOffset);
+  void Fill(const HitRow & hit);
+  void Finish();
+private:
+  double fDistance;
+  int    fSubNr;
+  double fAVOffset;
+  int    fNBins;
+  LEDInfo fLED;
+  PMTInfo fPMTInfo;
+  RAT::DU::GroupVelocity       fGV;
+  RAT::DU::LightPathCalculator fLP;
+  FibreTimeOfFlight            fTOF;
+  // only the residuals are written, the others are fitted
+  PMTHistograms fResiduals;
+  PMTHistograms fResidualsPE;
+  PMTHistograms fBucketResiduals;
+  PMTHistograms fTimesNotOffset;
+};
+
+// hit time residuals in distance bins for all fibres, see plotAverageHitOffset
+class AverageHitOffsetAnalysis : public HitAnalysis {
+public:
+  AverageHitOffsetAnalysis(double distance);
+  void Fill(const HitRow & hit);
+  void Finish();
+private:
+  double       fDistance;
+  unsigned int fNBins;
+  PMTInfo      fPMTInfo;
+  RAT::DU::GroupVelocity       fGV;
+  RAT::DU::LightPathCalculator fLP;
+  TH1D       * fTimeHisto;
+  PMTHistograms fDistanceHistos;  // residuals per distance bin
+  map<pair<int,int>,FibreTimeOfFlight> fTOF;  // per fibre and sub
+};
+
+// running moments of the hit time per PMT, see compareOffsets
+class HitTimeMomentsAnalysis : public HitAnalysis {
+public:
+  HitTimeMomentsAnalysis(double distance, int fibre_nr, int num_pmts);
+  void Fill(const HitRow & hit);
+  double GetNumHits(int lcn) const { return fMoments[kNumHits][lcn]; }
+  // mean hit time and its error, false if fewer than 2 hits
+  bool GetHitTime(int lcn, double & mean, double & error) const;
+private:
+  enum { kNumHits, kMean, kM2, kNumArrays };
+  double    fDistance;
+  PMTArrays fMoments;  // number of hits, mean and sum of squared deviations per PMT
+};
+
 // use ntuple to plot flat map
-TH2D * flatmap_ntuple(TNtuple * ntuple, double distance = 100000., int fibre_nr = 44, int sub_nr = 0, double time_min = 0., double time_max = 500. , bool in = true);
+TH2D * flatmap_ntuple(HitReader & reader, double distance = 100000., int fibre_nr = 44, int sub_nr = 0, double time_min = 0., double time_max = 500. , bool in = true);
 
 // use ntuple to plot the time histograms
-void time_histograms(TNtuple * ntuple, double distance = 100000., int fibre_nr = 44, int sub_nr = 0);
+void time_histograms(HitReader & reader, double distance = 100000., int fibre_nr = 44, int sub_nr = 0);
 
 // plot histogram of PMT distance vs recorded offset: 
 // (mean time observed - mean time expected)*vgroup
 // distance: max PMT distance to be considered (mm)
 // fibre_nr: fibre nr to analyse 
-void plot_offset(TNtuple * ntuple, double distance = 5000., int fibre_nr = 44, int sub_nr = 0, double AVOffset =0);
-void plotAverageHitOffset(TNtuple * ntuple, double distance);
-//Plot the difference between two AV shifts
-void plotAVFlightDifference(TNtuple * ntuple1, TNtuple * ntuple2, double distance = 5000, int fibre_nr = 44, int sub_nr = 0);
+void plot_offset(HitReader & reader, double distance = 5000., int fibre_nr = 44, int sub_nr = 0, double AVOffset =0);
+void plotAverageHitOffset(HitReader & reader, double distance);
+// Compare ntuples simulated with different AV offsets in one pass, reading numThreads files at a time
+// the first file is the reference, written to the current directory are
+// time_shift: mean hit time of each PMT (x) and file (y) minus that of the first file
+// time_shift_distance: the same averaged (weighted) in distance bins
+// time_shift_vs_offset: the same averaged over all PMTs against the offset
+// only PMTs within distance of the fibre with more than 30 hits in both files are used
+void compareOffsets(const vector<string> & ntuple_filenames, const vector<double> & offsets, PMTInfo & pmt_info,
+                    double distance = 5000, int fibre_nr = 44, int sub_nr = 0, int numThreads = 1);
 #endif
@@ -10,13 +10,26 @@
 #include <RAT/DS/MC.hh>
 
 #include "include/AVLocTools.h"
+#include "include/AVLocNtuple.h"
 
 bool ProcessEventBasic(RAT::DS::Entry * rDS);
-bool ProcessEventNtuple(RAT::DS::Entry * rDS, TNtuple * ntuple, 
-			LEDInfo & led_info, PMTInfo & pmt_info);
 
-bool ProcessEventNtupleMC(RAT::DS::Entry * rDS, TNtuple * ntuple, 
-			LEDInfo & led_info, PMTInfo & pmt_info);
+// Fills the avloc hits for a run, database values are looked up once on construction.
+// Processing does not change the processor, so one can be shared by worker threads
+class NtupleProcessor {
+public:
+  // reads the DAQ trigger delay from the database
+  NtupleProcessor();
+  NtupleProcessor(double GTTriggerDelay);
+
+  double GetTriggerDelay() const { return fGTTriggerDelay; }
+
+  bool ProcessEvent(RAT::DS::Entry & rDS, HitBuffer & hits) const;
+  bool ProcessEventMC(RAT::DS::Entry & rDS, HitBuffer & hits) const;
+
+private:
+  double fGTTriggerDelay;  // DAQ gtriggerdelay (ns)
+};
 
 RAT::DS::MCPMT GetMCPMT(int pmtId, RAT::DS::MC& mc);
 #endif
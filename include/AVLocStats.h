@@ -0,0 +1,76 @@
+//
+// Stage timers and counters for AV location
+//
+// Built with AVLOC_STATS defined (make AVLOCSTATS=1), AVLOC_TIMER adds
+// the time until the end of the enclosing scope to a named stage and
+// AVLOC_COUNT/AVLOC_COUNT_N add to a named counter. Entries with the
+// same name are summed in the summary. Without AVLOC_STATS the macros
+// compile to nothing, without evaluating their arguments, and the
+// summary functions do nothing
+//
+#ifndef __AVLOCSTATS_H__
+#define __AVLOCSTATS_H__
+
+#include <string>
+
+using namespace std;
+
+#ifdef AVLOC_STATS
+
+#include <atomic>
+#include <chrono>
+
+// One named timer or counter, registered on construction, safe to update from any thread
+class StatsEntry {
+public:
+  StatsEntry(const char * name, bool timer = false);
+  void Add(long n) { fCount += n; }
+  void AddTime(long n, long nanoseconds) { fCount += n; fNanoseconds += nanoseconds; }
+  const char * GetName() const { return fName; }
+  long GetCount() const { return fCount; }
+  long GetNanoseconds() const { return fNanoseconds; }
+  bool IsTimer() const { return fTimer; }
+private:
+  const char * fName;
+  atomic<long> fCount;
+  atomic<long> fNanoseconds;
+  bool fTimer;
+};
+
+class ScopedStatsTimer {
+public:
+  ScopedStatsTimer(StatsEntry & entry) : fEntry(entry), fStart(chrono::steady_clock::now()) {}
+  ~ScopedStatsTimer() {
+    fEntry.AddTime(1,chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-fStart).count());
+  }
+private:
+  StatsEntry & fEntry;
+  chrono::steady_clock::time_point fStart;
+};
+
+#define AVLOC_STATS_CONCAT2(a,b) a##b
+#define AVLOC_STATS_CONCAT(a,b) AVLOC_STATS_CONCAT2(a,b)
+#define AVLOC_TIMER(name)						\
+  static StatsEntry AVLOC_STATS_CONCAT(avloc_timer_,__LINE__)(name,true);	\
+  ScopedStatsTimer AVLOC_STATS_CONCAT(avloc_scope_,__LINE__)(AVLOC_STATS_CONCAT(avloc_timer_,__LINE__))
+#define AVLOC_COUNT_N(name,n)						\
+  do { static StatsEntry avloc_counter(name); avloc_counter.Add(n); } while (0)
+
+// summary of all stages and counters, sorted by name
+void PrintStats();
+// same as tab separated lines
+bool WriteStats(const string & filename);
+
+#else
+
+#define AVLOC_TIMER(name)
+#define AVLOC_COUNT_N(name,n) do { } while (0)
+
+inline void PrintStats() {}
+inline bool WriteStats(const string &) { return true; }
+
+#endif
+
+#define AVLOC_COUNT(name) AVLOC_COUNT_N(name,1)
+
+#endif
@@ -0,0 +1,60 @@
+//
+// Tabulated time of flight for AV location fits
+//
+// The time of flight (including the PMT bucket time) from a fibre to
+// each nearby PMT is computed once on a uniform grid of AV offsets, so
+// that fits can interpolate instead of calling the LightPathCalculator
+//
+#ifndef __AVLOCTOFTABLE_H__
+#define __AVLOCTOFTABLE_H__
+
+#include <vector>
+
+#include <TFile.h>
+#include <RAT/DU/GroupVelocity.hh>
+#include <RAT/DU/LightPathCalculator.hh>
+
+#include "include/AVLocTools.h"
+
+// Storage for the tabulated time of flight of one fibre
+struct TOFTable {
+  int    fibre_nr;
+  int    fibre_sub;
+  double offset_min;    // first AV offset on the grid (mm)
+  double offset_step;   // grid spacing (mm)
+  int    n_offsets;     // number of grid points
+  int    spectrum;      // 1: spectrum averaged group velocities, 0: single wavelength
+  vector<int>   lcn;    // tabulated LCNs
+  vector<int>   row;    // LCN -> row in tof, -1 if not tabulated
+  vector<float> tof;    // tof[row*n_offsets+k]: time of flight (ns) at grid point k
+};
+
+// time of flight (ns) from the LED to a PMT for a given AV offset, including the PMT bucket time
+// dTdOffset: if given, filled with the derivative of the time of flight w.r.t. the AV offset (ns/mm)
+// vgroup: if given, the spectrum averaged group velocities are used instead of those at 506.787 nm
+double CalcTimeOfFlight(LEDInfo & led, PMTInfo & pmt_info, int lcn, double AVOffset,
+			const RAT::DU::LightPathCalculator & lp, RAT::DU::GroupVelocity & gv,
+			double * dTdOffset = NULL, const GroupVelocityTable * vgroup = NULL);
+
+// tabulate all PMTs closer than 'distance' (mm) to the fibre on a grid of n_offsets in [offset_min,offset_max]
+// prints nothing, so it can run on worker threads
+TOFTable BuildTOFTable(LEDInfo & led, PMTInfo & pmt_info, double distance,
+		       double offset_min, double offset_max, int n_offsets,
+		       const RAT::DU::LightPathCalculator & lp, RAT::DU::GroupVelocity & gv,
+		       const GroupVelocityTable * vgroup = NULL);
+
+// linear interpolation of the table, returns 0 for PMTs which are not tabulated
+// dTdOffset: if given, filled with the slope of the interpolating interval (ns/mm)
+double InterpolateTOF(const TOFTable & table, int lcn, double AVOffset, double * dTdOffset = NULL);
+
+// write table to the "toftable" tree in file, one entry per fibre
+void WriteTOFTable(TFile * file, TOFTable & table);
+
+// read the table for a fibre from file, false if it is missing or has a different offset grid or model
+// spectrum: 1 for tables built with the spectrum averaged group velocities, tables without
+// this information were built at a single wavelength
+bool ReadTOFTable(TFile * file, int fibre_nr, int fibre_sub,
+		  double offset_min, double offset_max, int n_offsets, TOFTable & table,
+		  int spectrum = 0);
+
+#endif
@@ -16,7 +16,10 @@ using namespace std;
 #include <RAT/DS/Run.hh>
 
 // function to load a root file
-void LoadRootFile(string filename, TTree **tree, RAT::DS::Entry **rDS, RAT::DS::Run **rRun);
+// hitsOnly: switch off the branches NtupleProcessor does not read (MC truth, uncalibrated hits, fits)
+// cacheSize: TTreeCache size in bytes for the event tree, 0 keeps the ROOT default
+void LoadRootFile(string filename, TTree **tree, RAT::DS::Entry **rDS, RAT::DS::Run **rRun,
+		  bool hitsOnly = false, Long64_t cacheSize = 0);
 
 // function to load the RAT database
 void LoadDataBase(string logname);
@@ -42,12 +45,15 @@ struct PMTInfo {
 
 // Get PMT position - in RAT, this is the centre of the bucket, ie 5.67 cm in front of the PMT
 // (source: SNO NIM)
+// built from the PMTGeometry of this process, see AVLocGeometry.h
 PMTInfo GetPMTpositions(void);
 
 // function to extract relevant LED info (uses part of filename and assumes db loaded)
-LEDInfo GetLEDInfoFromFileName(string filename);
-LEDInfo GetLEDInfoFromFibreNr(int fibre_nr, int subnr); // subnr: 0 for A fibre 1 for B fibre
-LEDInfo GetLEDInfoFromFibreName(string fibre_name);
+// each fibre is looked up in the database once and kept for the rest of the job,
+// all fibres share the same spectrum histogram (not owned by any file)
+const LEDInfo & GetLEDInfoFromFileName(string filename);
+const LEDInfo & GetLEDInfoFromFibreNr(int fibre_nr, int subnr); // subnr: 0 for A fibre 1 for B fibre
+const LEDInfo & GetLEDInfoFromFibreName(string fibre_name);
 
 // function to gain access to a (re)writable ntuple for summary data for avloc
 TNtuple * GetNtuple(TFile ** fpointer, TString filename);
@@ -57,7 +63,21 @@ struct PhysicsNr {
   double error;
 };
 
+// Spectrum weighted group velocities of the LED light
+// The time of flight is linear in the distance per medium, so the spectrum averaged
+// time of flight is sum_medium (distance * inv_medium)
+struct GroupVelocityTable {
+  double    inv_scint; // spectrum averaged inverse group velocity in the scintillator (ns/mm)
+  double    inv_av;    // spectrum averaged inverse group velocity in the acrylic (ns/mm)
+  double    inv_water; // spectrum averaged inverse group velocity in the water (ns/mm)
+  PhysicsNr vgroup;    // spectrum averaged group velocity in the water and its spread (mm/ns)
+};
+
+// built from the LED spectrum once per job (assumes db loaded and the RAT utility initialised)
+const GroupVelocityTable & GetGroupVelocityTable();
+
 // function to convert LED spectrum convoluted with the group velocity in water into an average and an error
+// all fibres share the same spectrum, so this is GetGroupVelocityTable().vgroup
 PhysicsNr GroupVelocity(string fibre_name);
 
 // Calculate time of flight in ns
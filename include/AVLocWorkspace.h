@@ -0,0 +1,86 @@
+//
+// Reusable per fibre state for AV location fits and plots
+//
+// PMTArrays holds a fixed number of PMT indexed arrays in one allocation,
+// sized once from the PMT count and zeroed by Reset between fibres.
+// PMTHistograms bins values per PMT (or any other index) in one block of
+// counts with the bin layout of a TH1, so the loops over the hits do not
+// create a ROOT object per PMT. Histograms are only made by MakeHisto for
+// the PMTs that are written, others are fitted by filling one scratch
+// histogram with FillHisto
+//
+#ifndef __AVLOCWORKSPACE_H__
+#define __AVLOCWORKSPACE_H__
+
+#include <assert.h>
+#include <vector>
+
+#include <TH1.h>
+
+using namespace std;
+
+class PMTArrays {
+public:
+  PMTArrays(int numPMTs = 0, int numArrays = 0);
+  // reallocates only if the size changes, all values are zero afterwards
+  void Resize(int numPMTs, int numArrays);
+  // zero all arrays, keeping the allocation
+  void Reset();
+  double * operator[](int array) { return &fData[array*fNumPMTs]; }
+  const double * operator[](int array) const { return &fData[array*fNumPMTs]; }
+  int GetNumPMTs() const { return fNumPMTs; }
+  int GetNumArrays() const { return fNumArrays; }
+private:
+  int fNumPMTs, fNumArrays;
+  vector<double> fData;
+};
+
+class PMTHistograms {
+public:
+  // size: number of PMTs (indices), binning as for a TH1
+  PMTHistograms(int size, int n_bins, double x_min, double x_max);
+  void Fill(int index, double x) {
+    assert(index >= 0 && index < (int)fRow.size());
+    if ( fRow[index] < 0 ) AddRow(index);
+    double * counts = &fCounts[fRow[index]*(fNBins+2)];
+    // bin as TAxis::FindFixBin, 0 and n_bins+1 are under- and overflow
+    int bin;
+    if      ( x < fXMin )  bin = 0;
+    else if ( x >= fXMax ) bin = fNBins+1;
+    else                   bin = 1 + int(fNBins*(x-fXMin)/(fXMax-fXMin));
+    counts[bin] += 1.;
+    fEntries[fRow[index]] += 1.;
+  }
+  // index was filled at least once, also if the value was outside the binning
+  bool Has(int index) const { return fRow[index] >= 0; }
+  // number of Fill calls, as TH1::GetEntries
+  double GetEntries(int index) const { return fRow[index] < 0 ? 0. : fEntries[fRow[index]]; }
+  // indices filled since the last Reset, in order of the first Fill
+  const vector<int> & GetIndices() const { return fIndices; }
+  int GetSize() const { return fRow.size(); }
+  int GetNBins() const { return fNBins; }
+  // contents of one index into a histogram with the same binning, which is reset first
+  void FillHisto(int index, TH1 * histo) const;
+  // new histogram of one index in the current directory, for writing
+  template <class H> H * MakeHisto(int index, const char * name, const char * xtitle = "time (ns)") const {
+    H * histo = new H(name,name,fNBins,fXMin,fXMax);
+    histo->SetXTitle(xtitle);
+    FillHisto(index,histo);
+    return histo;
+  }
+  // histogram with this binning outside of any directory, the caller owns it
+  TH1D * MakeScratch(const char * name) const;
+  // empty all indices, keeping the allocation
+  void Reset();
+private:
+  void AddRow(int index);
+
+  int    fNBins;
+  double fXMin, fXMax;
+  vector<int>    fRow;      // index -> row in fCounts and fEntries, -1 if not filled
+  vector<int>    fIndices;  // filled indices
+  vector<double> fCounts;   // fCounts[row*(n_bins+2)+bin]
+  vector<double> fEntries;
+};
+
+#endif
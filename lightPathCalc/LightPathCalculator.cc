@@ -150,6 +150,111 @@ LightPathCalculator::BeginOfRun()
   // context under the function of this class.
   ResetValues();
 
+  // Dense copies of the refractive indices for spectrum weighted calculations
+  BuildRITables();
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+void
+LightPathCalculator::FillRITable( const TGraph& graph,
+                                  const Int_t nPoints,
+                                  RITable& table )
+{
+
+  table.values.clear();
+  if ( graph.GetN() < 2 || nPoints < 2 ){ return; }
+
+  // LoadRefractiveIndex fills the graphs in increasing energy
+  table.energyMin = graph.GetX()[ 0 ];
+  table.energyMax = graph.GetX()[ graph.GetN() - 1 ];
+  if ( table.energyMax <= table.energyMin ){ return; }
+  const Double_t step = ( table.energyMax - table.energyMin ) / ( nPoints - 1 );
+  table.invStep = 1.0 / step;
+
+  table.values.resize( nPoints );
+  for ( Int_t i = 0; i < nPoints; i++ ){ table.values[ i ] = graph.Eval( table.energyMin + i * step ); }
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+void
+LightPathCalculator::BuildRITables( const Int_t nPoints )
+{
+
+  FillRITable( fInnerAVRI, nPoints, fInnerAVRITable );
+  FillRITable( fUpperTargetRI, nPoints, fUpperTargetRITable );
+  FillRITable( fLowerTargetRI, nPoints, fLowerTargetRITable );
+  FillRITable( fAVRI, nPoints, fAVRITable );
+  FillRITable( fWaterRI, nPoints, fWaterRITable );
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+void
+LightPathCalculator::CacheRefractiveIndices( const Double_t energyMeV )
+{
+
+  // Evaluate from the graphs directly, so cached and uncached paths agree exactly
+  const LightPathCalculator& graphs = RIGraphs();
+  fRICacheEnergy = -1.0;
+  fRICacheInnerAV = graphs.fInnerAVRI.Eval( energyMeV );
+  fRICacheAV = graphs.fAVRI.Eval( energyMeV );
+  fRICacheWater = graphs.fWaterRI.Eval( energyMeV );
+  fRICacheEnergy = energyMeV;
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+void
+LightPathCalculator::CacheTargetRefractiveIndices( const Double_t energyMeV )
+{
+
+  // Only the partial fill paths use these, so they are not evaluated with the others
+  const LightPathCalculator& graphs = RIGraphs();
+  fRICacheTargetEnergy = -1.0;
+  fRICacheUpperTarget = graphs.fUpperTargetRI.Eval( energyMeV );
+  fRICacheLowerTarget = graphs.fLowerTargetRI.Eval( energyMeV );
+  fRICacheTargetEnergy = energyMeV;
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+LightPathCalculator::LightPathCalculator( const LightPathCalculator& shared, Bool_t )
+  : TObject(), fRIShared( &shared.RIGraphs() )
+{
+
+  ResetValues();
+
+  // Only the geometry and path options are needed, the refractive index
+  // graphs are read through fRIShared
+  fNeckInnerRadius = shared.fNeckInnerRadius;
+  fNeckOuterRadius = shared.fNeckOuterRadius;
+  fAVInnerRadius = shared.fAVInnerRadius;
+  fAVOuterRadius = shared.fAVOuterRadius;
+  fPMTRadius = shared.fPMTRadius;
+  fFillZ = shared.fFillZ;
+  fELLIEReflect = shared.fELLIEReflect;
+
+  // Reuse the refractive indices the shared calculator has cached
+  fRICacheEnergy = shared.fRICacheEnergy;
+  fRICacheTargetEnergy = shared.fRICacheTargetEnergy;
+  fRICacheInnerAV = shared.fRICacheInnerAV;
+  fRICacheUpperTarget = shared.fRICacheUpperTarget;
+  fRICacheLowerTarget = shared.fRICacheLowerTarget;
+  fRICacheAV = shared.fRICacheAV;
+  fRICacheWater = shared.fRICacheWater;
+
 }
 
 //////////////////////////////////////
@@ -204,6 +309,12 @@ LightPathCalculator::ResetValues()
   fDistInNeckInnerAV = 0.0;
   fDistInNeckAV = 0.0;
   fDistInNeckWater = 0.0;
+  fDDistInWaterDAVOffset = 0.0;
+
+  fAVOffset = 0.0;
+
+  fRICacheEnergy = -1.0;
+  fRICacheTargetEnergy = -1.0;
   
   fEnergy = WavelengthToEnergy( 400.0e-6 );
   
@@ -219,7 +330,7 @@ LightPathCalculator::ResetValues()
 //////////////////////////////////////
 
 Double_t
-LightPathCalculator::EnergyToWavelength( const Double_t energy )
+LightPathCalculator::EnergyToWavelength( const Double_t energy ) const
 {
   
   // Planck's Constant * Speed of Light in Vacuum ( 197.3270 MeV fm )
@@ -245,7 +356,7 @@ LightPathCalculator::EnergyToWavelength( const Double_t energy )
 //////////////////////////////////////
 
 Double_t
-LightPathCalculator::WavelengthToEnergy( const Double_t wavelength )
+LightPathCalculator::WavelengthToEnergy( const Double_t wavelength ) const
 {
   
   // Planck's Constant * Speed of Light in Vacuum ( 197.3270 MeV fm )
@@ -295,6 +406,7 @@ LightPathCalculator::CalcByPosition( const TVector3& eventPos,
   fIsTIR = false;                            // Total Internal Reflection
   fStraightLine = false;                     // Straight Line Path
   fXAVNeck = false;                          // Whether the path intersected the neck region
+  fDDistInWaterDAVOffset = 0.0;              // Only non-zero for ELLIE reflected paths
 
   // Set the start and end position requirements of the path
   fStartPos = eventPos;                      // Start Position of the path
@@ -329,6 +441,7 @@ LightPathCalculator::CalcByPosition( const TVector3& eventPos,
 
     // Initalise the refractive indices of the scintillator, acrylic and water regions
     // based on the energy value provided
+    if ( fEnergy != fRICacheEnergy ){ CacheRefractiveIndices( fEnergy ); }
     fInnerAVRIVal = GetInnerAVRI( fEnergy );
     fAVRIVal = GetAVRI( fEnergy );
     fWaterRIVal = GetWaterRI( fEnergy ); 
@@ -435,6 +548,37 @@ LightPathCalculator::CalcByPosition( const TVector3& eventPos,
 //////////////////////////////////////
 //////////////////////////////////////
 
+LightPathResult
+LightPathCalculator::QueryByPosition( const TVector3& eventPos,
+                                      const TVector3& pmtPos,
+                                      const Double_t energyMeV,
+                                      const Double_t localityVal,
+                                      const Double_t avOffset ) const
+{
+
+  LightPathCalculator scratch( *this, true );
+  scratch.fAVOffset = avOffset;
+  scratch.CalcByPosition( eventPos, pmtPos, energyMeV, localityVal );
+
+  LightPathResult result;
+  result.type = scratch.fLightPathType;
+  result.distInInnerAV = scratch.fDistInInnerAV;
+  result.distInAV = scratch.fDistInAV;
+  result.distInWater = scratch.fDistInWater;
+  result.dDistInWaterDAVOffset = scratch.fDDistInWaterDAVOffset;
+  result.incidentVecOnPMT = scratch.fIncidentVecOnPMT;
+  result.initialLightVec = scratch.fInitialLightVec;
+  result.isTIR = scratch.fIsTIR;
+  result.resvHit = scratch.fResvHit;
+  result.straightLine = scratch.fStraightLine;
+
+  return result;
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
 Bool_t
 LightPathCalculator::CalculateDistancesInnerAV( const TVector3& startPos,
                                                 const TVector3& endPos )
@@ -1784,36 +1928,23 @@ LightPathCalculator::PathCalculation( const TVector3& initOffset )
   // Calculation for events that originate outside of the AV (in the water)
   else {
 
-    Double_t maxReflectionAngle = ReflectionAngle( fStartPos, fAVOuterRadius );
-
     // Check to see if reflect path off of the AV are required (fELLIEReflect = true),
     // and if so, whether they are eligible for being reflected off of the AV
-    if ( fELLIEReflect && ( fStartPos.Angle( fEndPos ) < maxReflectionAngle ) ){
+    ReflectionPath reflection;
+    if ( fELLIEReflect ){ reflection = CalcReflectionByPosition( fStartPos, fEndPos, fAVOffset ); }
+    if ( fELLIEReflect && reflection.valid ){
 
       // Assume that light reflected off of the outer AV surface
-      
-      // Find the magnitude weighted average vector between the pmt position
-      // and event position.
-      TVector3 avVec = ( fEndPos + fStartPos ).Unit();
-      // Note: This is different to (fEndPos.Unit() + fStartPos.Unit()).Unit()
-      // which is the bisection of the two unit vectors.
-      
-      // Calculate the point on the AV where the light reflected
-      TVector3 reflectedPoint = avVec * fAVOuterRadius;
-      fPointOnAV1st = reflectedPoint;
-      
-      Double_t a = (fStartPos.Mag()+fAVOffset) /(fStartPos.Mag());
-      // Distance through the water
-      fDistInWater = ( (a*fStartPos) - reflectedPoint ).Mag() + ( reflectedPoint - fEndPos ).Mag();
+      fPointOnAV1st = reflection.reflectedPoint;
+      fDistInWater = reflection.distInWater;
+      fDDistInWaterDAVOffset = reflection.dDistInWaterDAVOffset;
       
       // Distance through the acrylic and scintillator is zero
       fDistInInnerAV = 0.0;
       fDistInAV = 0.0;
       
-      // Distance through the water
-      
-      fIncidentVecOnPMT = ( fEndPos - reflectedPoint ).Unit();
-      fInitialLightVec = ( reflectedPoint - fStartPos ).Unit();
+      fIncidentVecOnPMT = reflection.incidentVecOnPMT;
+      fInitialLightVec = reflection.initialLightVec;
       
       fLightPathType = WRefl;
       
@@ -2034,7 +2165,7 @@ LightPathCalculator::ReadjustOffset( const TVector3& distWater,
 
 Double_t 
 LightPathCalculator::ClosestAngle( const TVector3& eventPos,
-                                   const Double_t edgeRadius )
+                                   const Double_t edgeRadius ) const
 {
   
   // Calculate one of the angles of the Right-Angled triangle to obtain
@@ -2051,7 +2182,7 @@ LightPathCalculator::ClosestAngle( const TVector3& eventPos,
 
 Double_t 
 LightPathCalculator::ReflectionAngle( const TVector3& eventPos,
-                                      const Double_t edgeRadius )
+                                      const Double_t edgeRadius ) const
 {
   
   Double_t angle = 2.0 * ( TMath::ACos( edgeRadius / eventPos.Mag() ) ); 
@@ -2062,6 +2193,50 @@ LightPathCalculator::ReflectionAngle( const TVector3& eventPos,
 //////////////////////////////////////
 //////////////////////////////////////
 
+ReflectionPath
+LightPathCalculator::CalcReflectionByPosition( const TVector3& eventPos,
+                                               const TVector3& pmtPos,
+                                               const Double_t avOffset ) const
+{
+
+  ReflectionPath path;
+  path.valid = false;
+  path.distInWater = 0.0;
+  path.dDistInWaterDAVOffset = 0.0;
+
+  // Only start positions in the water can reflect off of the outer AV surface
+  if ( eventPos.Mag() <= fAVOuterRadius ){ return path; }
+  if ( eventPos.Angle( pmtPos ) >= ReflectionAngle( eventPos, fAVOuterRadius ) ){ return path; }
+
+  // Find the magnitude weighted average vector between the pmt position
+  // and event position.
+  TVector3 avVec = ( pmtPos + eventPos ).Unit();
+  // Note: This is different to (pmtPos.Unit() + eventPos.Unit()).Unit()
+  // which is the bisection of the two unit vectors.
+
+  // Calculate the point on the AV where the light reflected
+  path.reflectedPoint = avVec * fAVOuterRadius;
+
+  Double_t a = ( eventPos.Mag() + avOffset ) / ( eventPos.Mag() );
+  // Distance through the water
+  TVector3 firstLeg = ( a * eventPos ) - path.reflectedPoint;
+  path.distInWater = firstLeg.Mag() + ( path.reflectedPoint - pmtPos ).Mag();
+
+  // Only the leg from the (scaled) start position depends on the AV offset,
+  // d( a*eventPos ) / d( avOffset ) = eventPos.Unit()
+  if ( firstLeg.Mag() > 0.0 ){ path.dDistInWaterDAVOffset = firstLeg.Dot( eventPos.Unit() ) / firstLeg.Mag(); }
+
+  path.incidentVecOnPMT = ( pmtPos - path.reflectedPoint ).Unit();
+  path.initialLightVec = ( path.reflectedPoint - eventPos ).Unit();
+  path.valid = true;
+
+  return path;
+
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
 void 
 LightPathCalculator::CalcByPositionPartial( const TVector3& eventPos,
                                             const TVector3& pmtPos,
@@ -2111,6 +2286,8 @@ LightPathCalculator::CalcByPositionPartial( const TVector3& eventPos,
   else{
     // Initalise the refractive indices of the upper/lower target, acrylic and water regions
     // based on the energy value provided
+    if ( fEnergy != fRICacheEnergy ){ CacheRefractiveIndices( fEnergy ); }
+    if ( fEnergy != fRICacheTargetEnergy ){ CacheTargetRefractiveIndices( fEnergy ); }
     fUpperTargetRIVal = GetUpperTargetRI( fEnergy );
     fLowerTargetRIVal = GetLowerTargetRI( fEnergy );
     fAVRIVal = GetAVRI( fEnergy );
@@ -16,6 +16,9 @@
 ///  - 2015-03-05 : Rob Stainforth - Changed warning messages to debug statements
 ///  - 2015-03-05 : M Mottram - Updated warnings for partial fill geometry.
 ///  - 2015-04-20 : Rob Stainforth - Fix divide by zero check in DTheta* methods.
+///  -   AVloc    : Closed form ELLIE reflection query (in place of a warm start for the AV offset scans)
+///  -   AVloc    : Const, thread safe QueryByPosition taking the AV offset as a parameter
+///  -   AVloc    : Refractive index cache at fixed energy, uniformly sampled RI tables
 ///
 /// \details Returns the refracted path through the scintillator 
 /// AV and water of the detector region. Currently requires single 
@@ -40,6 +43,7 @@
 #include <TVector3.h>
 
 #include <map>
+#include <vector>
 #include <iostream>
 
 namespace RAT 
@@ -57,6 +61,42 @@ namespace RAT
     // Type 'WRefl' - Water -> Reflection -> PMT (Reflection off of the AV)
     // Type 'Null' - Light Path Uninitialised
     enum eLightPathType { SAW, AW, ASAW, WASAW, WAW, W, WRefl, Null };
+
+    /// Result of a closed form ELLIE reflection calculation, see CalcReflectionByPosition
+    struct ReflectionPath
+    {
+      Bool_t   valid;                  ///< FALSE: the path is not eligible for a reflection off of the AV
+      TVector3 reflectedPoint;         ///< The point on the outer AV surface where the light reflected
+      Double_t distInWater;            ///< Total distance through the water
+      Double_t dDistInWaterDAVOffset;  ///< Derivative of distInWater with respect to the AV offset
+      TVector3 incidentVecOnPMT;       ///< Unit vector of the light incident on the PMT
+      TVector3 initialLightVec;        ///< Unit vector of the initial light direction
+    };
+
+    /// Refractive index sampled on a uniform energy grid for O(1) linear
+    /// interpolation, see LightPathCalculator::BuildRITables
+    struct RITable
+    {
+      Double_t energyMin;              ///< First energy of the grid [MeV]
+      Double_t energyMax;              ///< Last energy of the grid [MeV]
+      Double_t invStep;                ///< Inverse of the grid spacing [1/MeV]
+      std::vector< Double_t > values;  ///< Refractive index at each grid point
+    };
+
+    /// Result of a light path calculation, see QueryByPosition
+    struct LightPathResult
+    {
+      eLightPathType type;             ///< The light path type
+      Double_t distInInnerAV;          ///< Distance in the scintillator region
+      Double_t distInAV;               ///< Distance in the acrylic region of the AV
+      Double_t distInWater;            ///< Distance in the water region
+      Double_t dDistInWaterDAVOffset;  ///< Derivative of distInWater with respect to the AV offset (ELLIE reflected paths)
+      TVector3 incidentVecOnPMT;       ///< Final light path direction (unit normalised)
+      TVector3 initialLightVec;        ///< Initial light path direction (unit normalised)
+      Bool_t   isTIR;                  ///< TRUE: Total Internal Reflection encountered
+      Bool_t   resvHit;                ///< TRUE: Difficult path to resolve and calculate
+      Bool_t   straightLine;           ///< TRUE: Light Path is a straight line approximation
+    };
     
     class LightPathCalculator : public TObject
     {
@@ -68,7 +108,7 @@ namespace RAT
       /////////////////////////////////
 
       /// Default constructor
-      LightPathCalculator() : TObject() { }
+      LightPathCalculator() : TObject(), fRICacheEnergy( -1.0 ), fRICacheTargetEnergy( -1.0 ), fRIShared( NULL ) { }
 
       /// Called at the start of a run, loads from the database
       /// Initialise the inner and outer AV radii, 
@@ -90,12 +130,12 @@ namespace RAT
       /// Converts the energy to the equivalent wavelength, remember RAT units are MeV [Energy], mm [Length]
       ///
       /// @param[in] energy The energy to convert
-      Double_t EnergyToWavelength( const Double_t energy );
+      Double_t EnergyToWavelength( const Double_t energy ) const;
 
       /// Converts the wavelengths to equivalent energies, remember RAT units are MeV [Energy], mm [Length]
       ///
       /// @param[in] wavelength The wavelength to convert
-      Double_t WavelengthToEnergy( const Double_t wavelength );
+      Double_t WavelengthToEnergy( const Double_t wavelength ) const;
 
       /// Use this to calculate the path of the light from 'eventPos' to 'pmtPos'.
       /// Refraction is modelled for values of 'localityVal' > 0.0. If 'localityVal' = 0.0,
@@ -111,6 +151,46 @@ namespace RAT
                            const Double_t energyMeV = 3.103125 * 1e-6,
                            const Double_t localityVal = 0.0 );
 
+      /// As CalcByPosition, but with the AV offset passed as a parameter and the
+      /// path returned rather than stored. The calculation runs on a scratch
+      /// calculator which shares the refractive index graphs of this one, so a
+      /// single calculator can serve concurrent callers (e.g. worker threads) as
+      /// long as nothing calls BeginOfRun or a setter at the same time.
+      ///
+      /// @param[in] eventPos The starting point of the light path (typically an event position)
+      /// @param[in] pmtPos The end point of the PMT (typically a PMT position)
+      /// @param[in] energy The photon energy in MeV
+      /// @param[in] localityVal The accepted tolerance [mm] for how close the path is calculated to the 'pmtPos' (0.0 -> Straight Line Calculation)
+      /// @param[in] avOffset The offset of the AV from the origin [mm]
+      ///
+      /// @return The calculated light path
+      LightPathResult QueryByPosition( const TVector3& eventPos,
+                                       const TVector3& pmtPos,
+                                       const Double_t energyMeV,
+                                       const Double_t localityVal,
+                                       const Double_t avOffset ) const;
+
+      /// Evaluate and keep the scintillator, AV and water refractive indices at 'energyMeV'.
+      /// The Get*RI methods and the path calculations use the kept values for as long
+      /// as they are asked for the same energy, which is the usual case as the fits
+      /// use a single wavelength. Called by CalcByPosition when the energy changes;
+      /// call it before sharing the calculator to give QueryByPosition the same benefit.
+      /// The partial fill target indices are cached separately by CalcByPositionPartial.
+      ///
+      /// @param[in] energyMeV The photon energy in MeV
+      void CacheRefractiveIndices( const Double_t energyMeV );
+
+      /// Energy of the refractive indices kept by CacheRefractiveIndices
+      ///
+      /// @return The energy in MeV, -1 if nothing is cached
+      Double_t GetRICacheEnergy() const { return fRICacheEnergy; }
+
+      /// Sample the refractive index graphs on uniform energy grids of 'nPoints' points
+      /// spanning each graph, see the Get*RIFromTable methods. Called by BeginOfRun.
+      ///
+      /// @param[in] nPoints The number of grid points per table
+      void BuildRITables( const Int_t nPoints = 4096 );
+
       /// Used for partial fill geometry.
       /// Use this to calculate the path of the light from 'eventPos' to 'pmtPos'.
       /// Refraction is modelled for values of 'localityVal' > 0.0. If 'localityVal' = 0.0,
@@ -175,31 +255,43 @@ namespace RAT
       /// @param[in] energy The wavelength (energy) in MeV
       ///
       /// @return The refractive index in the scintillator for this wavelength (energy)
-      Double_t GetInnerAVRI( const Double_t energy ) const { return fInnerAVRI.Eval( energy ); }
+      Double_t GetInnerAVRI( const Double_t energy ) const { return energy == fRICacheEnergy ? fRICacheInnerAV : RIGraphs().fInnerAVRI.Eval( energy ); }
 
       /// Return refractive index in the upper target (partial fill) for a given wavelength (energy) in MeV
       /// @param[in] energy The wavelength (energy) in MeV
       ///
       /// @return The refractive index in the upper filled part of the detector for this wavelength (energy)
-      Double_t GetUpperTargetRI( const Double_t energy ) const { return fUpperTargetRI.Eval( energy ); }
+      Double_t GetUpperTargetRI( const Double_t energy ) const { return energy == fRICacheTargetEnergy ? fRICacheUpperTarget : RIGraphs().fUpperTargetRI.Eval( energy ); }
 
       /// Return refractive index in the lower target (partial fill) for a given wavelength (energy) in MeV
       /// @param[in] energy The wavelength (energy) in MeV
       ///
       /// @return The refractive index in the lower filled part of the detector for this wavelength (energy)
-      Double_t GetLowerTargetRI( const Double_t energy ) const { return fLowerTargetRI.Eval( energy ); }
+      Double_t GetLowerTargetRI( const Double_t energy ) const { return energy == fRICacheTargetEnergy ? fRICacheLowerTarget : RIGraphs().fLowerTargetRI.Eval( energy ); }
       
       /// Return refractive index in AV for a given wavelength (energy) in MeV
       /// @param[in] energy The wavelength (energy) in MeV
       ///
       /// @return The refractive index in the AV for this wavelength (energy)
-      Double_t GetAVRI( const Double_t energy ) const { return fAVRI.Eval( energy ); }
+      Double_t GetAVRI( const Double_t energy ) const { return energy == fRICacheEnergy ? fRICacheAV : RIGraphs().fAVRI.Eval( energy ); }
       
       /// Return refractive index in water for a given wavelength (energy) in MeV
       /// @param[in] energy The wavelength (energy) in MeV
       ///
       /// @return The refractive index in the water for this wavelength (energy)
-      Double_t GetWaterRI( const Double_t energy ) const { return fWaterRI.Eval( energy ); }
+      Double_t GetWaterRI( const Double_t energy ) const { return energy == fRICacheEnergy ? fRICacheWater : RIGraphs().fWaterRI.Eval( energy ); }
+
+      /// Return the refractive indices interpolated from the uniform tables (see BuildRITables),
+      /// these avoid the binary search of TGraph::Eval for loops over a spectrum.
+      /// Energies outside the tabulated range fall back to the graphs.
+      /// @param[in] energy The wavelength (energy) in MeV
+      ///
+      /// @return The refractive index in the respective region for this wavelength (energy)
+      Double_t GetInnerAVRIFromTable( const Double_t energy ) const { return EvalRITable( RIGraphs().fInnerAVRITable, RIGraphs().fInnerAVRI, energy ); }
+      Double_t GetUpperTargetRIFromTable( const Double_t energy ) const { return EvalRITable( RIGraphs().fUpperTargetRITable, RIGraphs().fUpperTargetRI, energy ); }
+      Double_t GetLowerTargetRIFromTable( const Double_t energy ) const { return EvalRITable( RIGraphs().fLowerTargetRITable, RIGraphs().fLowerTargetRI, energy ); }
+      Double_t GetAVRIFromTable( const Double_t energy ) const { return EvalRITable( RIGraphs().fAVRITable, RIGraphs().fAVRI, energy ); }
+      Double_t GetWaterRIFromTable( const Double_t energy ) const { return EvalRITable( RIGraphs().fWaterRITable, RIGraphs().fWaterRI, energy ); }
       
       /// Return the loop ceiling value 
       /// (i.e. max number of possible iterations to be made for the refracted path calculation)
@@ -286,6 +378,10 @@ namespace RAT
       /// @return The distance in the water following the path going through the neck region
       Double_t GetDistInNeckWater() const { return fDistInNeckWater; }
 
+      /// @return The derivative of the distance in the water with respect to the AV offset (see SetAVOffset).
+      /// Only non-zero for ELLIE reflected paths, as the other paths do not depend on the offset.
+      Double_t GetDDistInWaterDAVOffset() const { return fDDistInWaterDAVOffset; }
+
       /// @return The total distance on the light path
       Double_t GetTotalDist() { return ( fDistInInnerAV + fDistInAV + fDistInWater ); }
 
@@ -399,6 +495,24 @@ namespace RAT
       {
         fELLIEReflect = reflect;
       }
+
+      /// Calculate the path of light reflected off of the outer AV surface
+      /// directly, without going through CalcByPosition. The reflection is
+      /// closed form, so this neither iterates nor modifies the calculator and
+      /// gives the same distances as CalcByPosition with SetELLIEReflect( true )
+      /// and SetAVOffset( avOffset ).
+      /// The AV offset scans evaluate these reflected paths at offsets a few mm apart.
+      /// Being closed form, the query has no iteration a previous solution could seed,
+      /// so it takes the place of a warm start of the loop for these scans.
+      ///
+      /// @param[in] eventPos The starting position of the light path (the fibre position)
+      /// @param[in] pmtPos The PMT position
+      /// @param[in] avOffset The offset of the AV from the origin [mm]
+      ///
+      /// @return The reflected path, valid is FALSE if the start is not outside the AV or the angle is too large to reflect
+      ReflectionPath CalcReflectionByPosition( const TVector3& eventPos,
+                                               const TVector3& pmtPos,
+                                               const Double_t avOffset ) const;
       
       // This ROOT macro adds dictionary methods to this class.
       // The number is 0 as this class is never, and should never be written to disc.
@@ -407,6 +521,48 @@ namespace RAT
 
     private:
 
+      /// Scratch calculator for QueryByPosition, copies the geometry of 'shared'
+      /// and reads the refractive indices from its graphs
+      ///
+      /// @param[in] shared The calculator holding the refractive index graphs, must outlive this one
+      explicit LightPathCalculator( const LightPathCalculator& shared, Bool_t );
+
+      /// @return The calculator holding the refractive index graphs
+      const LightPathCalculator& RIGraphs() const { return fRIShared != NULL ? *fRIShared : *this; }
+
+      /// Evaluate and keep the upper and lower target refractive indices at 'energyMeV',
+      /// see CacheRefractiveIndices. Called by CalcByPositionPartial when the energy changes.
+      ///
+      /// @param[in] energyMeV The photon energy in MeV
+      void CacheTargetRefractiveIndices( const Double_t energyMeV );
+
+      /// Linear interpolation in a uniform refractive index table
+      ///
+      /// @param[in] table The table to interpolate
+      /// @param[in] graph The graph the table was sampled from, used outside the table range
+      /// @param[in] energy The wavelength (energy) in MeV
+      ///
+      /// @return The interpolated refractive index
+      static Double_t EvalRITable( const RITable& table,
+                                   const TGraph& graph,
+                                   const Double_t energy )
+      {
+        if ( table.values.size() < 2 || energy < table.energyMin || energy > table.energyMax ){ return graph.Eval( energy ); }
+        const Double_t x = ( energy - table.energyMin ) * table.invStep;
+        size_t bin = static_cast< size_t >( x );
+        if ( bin > table.values.size() - 2 ){ bin = table.values.size() - 2; }
+        return table.values[ bin ] + ( x - bin ) * ( table.values[ bin + 1 ] - table.values[ bin ] );
+      }
+
+      /// Fill a uniform table from a refractive index graph, left empty for empty graphs
+      ///
+      /// @param[in] graph The graph to sample
+      /// @param[in] nPoints The number of grid points
+      /// @param[out] table The sampled table
+      static void FillRITable( const TGraph& graph,
+                               const Int_t nPoints,
+                               RITable& table );
+
       //////////////////////////////////////////////////
       ////////     PRIVATE UTILITY ROUTINES     ////////
       //////////////////////////////////////////////////
@@ -603,7 +759,7 @@ namespace RAT
       ///
       /// @return Calculate the closest angular displacement of a path close to a surface interface
       Double_t ClosestAngle( const TVector3& eventPos,
-                             const Double_t edgeRadius );
+                             const Double_t edgeRadius ) const;
 
       /// Calculate the maximum allowed angle between the event position
       /// and the PMT position for it to reflect off of the AV
@@ -613,7 +769,7 @@ namespace RAT
       ///
       /// @return Calculate the maximum allowed angle between the event position and the PMT position for it to reflect off of the AV
       Double_t ReflectionAngle( const TVector3& eventPos,
-                                const Double_t edgeRadius );
+                                const Double_t edgeRadius ) const;
       
       
       /// Calculate refracted photon vector (unit normalised)
@@ -741,6 +897,20 @@ namespace RAT
       TGraph fAVRI;                                                      ///< AV refractive index TGraph
       TGraph fWaterRI;                                                   ///< Water refractive index TGraph
 
+      RITable fInnerAVRITable;                                           ///< Uniformly sampled fInnerAVRI
+      RITable fUpperTargetRITable;                                       ///< Uniformly sampled fUpperTargetRI
+      RITable fLowerTargetRITable;                                       ///< Uniformly sampled fLowerTargetRI
+      RITable fAVRITable;                                                ///< Uniformly sampled fAVRI
+      RITable fWaterRITable;                                             ///< Uniformly sampled fWaterRI
+
+      Double_t fRICacheEnergy;                                           ///< Energy of the cached scintillator, AV and water refractive indices (-1: none)
+      Double_t fRICacheTargetEnergy;                                     ///< Energy of the cached upper and lower target refractive indices (-1: none)
+      Double_t fRICacheInnerAV;                                          ///< Cached scintillator refractive index
+      Double_t fRICacheUpperTarget;                                      ///< Cached upper target refractive index
+      Double_t fRICacheLowerTarget;                                      ///< Cached lower target refractive index
+      Double_t fRICacheAV;                                               ///< Cached AV refractive index
+      Double_t fRICacheWater;                                            ///< Cached water refractive index
+
       Double_t fFillFraction;                                            ///< The fill fraction of the detector (from the bottom of the detector)
       Double_t fLoopCeiling;                                             ///< Iteration Ceiling for algortithm loop
       Double_t fFinalLoopSize;                                           ///< Final loop value which meets locality conditions
@@ -806,6 +976,9 @@ namespace RAT
       Double_t fFresnelRCoeff;                                           ///< The combined Fresnel REFLECTIVITY coefficient for this path  
 
       Double_t  fAVOffset;                                               ///< Offset of the AV from the origin (Used for AVloc)
+      Double_t  fDDistInWaterDAVOffset;                                  ///< Derivative of fDistInWater with respect to fAVOffset (ELLIE reflected paths)
+
+      const LightPathCalculator* fRIShared;                              ///< Calculator holding the refractive index graphs (NULL: this one)
     };
     
   } // namespace DU
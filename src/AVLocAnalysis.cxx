@@ -0,0 +1,147 @@
+//
+// Single pass analysis layer for the avloc summary ntuple
+//
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <thread>
+
+#include <TROOT.h>
+
+#include "include/AVLocAnalysis.h"
+#include "include/AVLocStats.h"
+
+using namespace std;
+
+HitAnalysis::HitAnalysis()
+  : fFibreNr(-1), fFibreSub(-1),
+    fTimeMin(-numeric_limits<double>::max()), fTimeMax(numeric_limits<double>::max()),
+    fDistMin(-numeric_limits<double>::max()), fDistMax(numeric_limits<double>::max())
+{
+}
+
+void HitAnalysis::SetFibre(int fibre_nr, int fibre_sub)
+{
+  fFibreNr  = fibre_nr;
+  fFibreSub = fibre_sub;
+}
+
+void HitAnalysis::SetTimeWindow(double time_min, double time_max)
+{
+  fTimeMin = time_min;
+  fTimeMax = time_max;
+}
+
+void HitAnalysis::SetDistWindow(double dist_min, double dist_max)
+{
+  fDistMin = dist_min;
+  fDistMax = dist_max;
+}
+
+bool HitAnalysis::AcceptFibreTime(const HitRow & hit) const
+{
+  if ( fFibreNr  >= 0 && hit.fibre_nr  != fFibreNr  ) return false;
+  if ( fFibreSub >= 0 && hit.fibre_sub != fFibreSub ) return false;
+  return hit.time >= fTimeMin && hit.time <= fTimeMax;
+}
+
+bool HitAnalysis::Accept(const HitRow & hit) const
+{
+  return AcceptFibreTime(hit) && hit.dist >= fDistMin && hit.dist <= fDistMax;
+}
+
+HitLoop::HitLoop(HitReader & reader, int numThreads)
+  : fReader(reader), fNumThreads(numThreads < 1 ? 1 : numThreads)
+{
+  if ( fNumThreads > 1 ) ROOT::EnableThreadSafety();
+}
+
+void HitLoop::Book(HitAnalysis * analysis)
+{
+  fAnalyses.push_back(analysis);
+}
+
+void HitLoop::Run()
+{
+  if ( !fReader.IsValid() ) {
+    cerr << "AVLocAnalysis::HitLoop::Run : no hits to read" << endl;
+    return;
+  }
+  AVLOC_TIMER("HitLoop::Run");
+  vector<HitRow> chunk;
+  chunk.reserve(kHitsPerChunk);
+  vector<FibreRange> ranges = GetEntryRanges();
+  for (unsigned int r = 0 ; r < ranges.size() ; ++r) {
+    Long64_t last = ranges[r].first + ranges[r].entries;
+    AVLOC_COUNT_N("hits read",ranges[r].entries);
+    for (Long64_t i = ranges[r].first ; i < last ; ++i) {
+      fReader.GetEntry(i);
+      HitRow hit;
+      hit.fibre_nr  = fReader.GetFibreNr();
+      hit.fibre_sub = fReader.GetFibreSub();
+      hit.lcn       = fReader.GetLCN();
+      hit.time      = fReader.GetTime();
+      hit.dist      = -1;
+      bool wanted = false;
+      for (unsigned int k = 0 ; k < fAnalyses.size() && !wanted ; ++k) wanted = fAnalyses[k]->AcceptFibreTime(hit);
+      if ( !wanted ) continue;
+      hit.dist = fReader.GetDist();
+      AVLOC_COUNT("hits passing cuts");
+      chunk.push_back(hit);
+      if ( chunk.size() == kHitsPerChunk ) {
+	Process(chunk);
+	chunk.clear();
+      }
+    }
+  }
+  if ( !chunk.empty() ) Process(chunk);
+  for (unsigned int k = 0 ; k < fAnalyses.size() ; ++k) fAnalyses[k]->Finish();
+}
+
+static bool CompareFirstEntry(const FibreRange & a, const FibreRange & b)
+{
+  return a.first < b.first;
+}
+
+vector<FibreRange> HitLoop::GetEntryRanges() const
+{
+  vector<FibreRange> ranges;
+  bool all = !fReader.HasIndex() || fAnalyses.empty();
+  for (unsigned int k = 0 ; k < fAnalyses.size() && !all ; ++k) all = fAnalyses[k]->GetFibreNr() < 0;
+  if ( all ) {
+    FibreRange range = { -1, -1, 0, fReader.GetEntries() };
+    ranges.push_back(range);
+    return ranges;
+  }
+  for (unsigned int k = 0 ; k < fAnalyses.size() ; ++k) {
+    vector<FibreRange> fibre = fReader.GetEntryRanges(fAnalyses[k]->GetFibreNr(),fAnalyses[k]->GetFibreSub());
+    ranges.insert(ranges.end(),fibre.begin(),fibre.end());
+  }
+  // analyses of the same fibre give the same ranges, the index has no overlapping ones
+  sort(ranges.begin(),ranges.end(),CompareFirstEntry);
+  vector<FibreRange> unique;
+  for (unsigned int i = 0 ; i < ranges.size() ; ++i) {
+    if ( !unique.empty() && unique.back().first == ranges[i].first ) continue;
+    unique.push_back(ranges[i]);
+  }
+  return unique;
+}
+
+void HitLoop::Process(const vector<HitRow> & chunk)
+{
+  atomic<unsigned int> next(0);
+  auto worker = [this,&chunk,&next]() {
+    for (unsigned int k = next++ ; k < fAnalyses.size() ; k = next++) {
+      HitAnalysis * analysis = fAnalyses[k];
+      for (unsigned int i = 0 ; i < chunk.size() ; ++i) {
+	if ( analysis->Accept(chunk[i]) ) analysis->Fill(chunk[i]);
+      }
+    }
+  };
+  int numThreads = min(fNumThreads,(int)fAnalyses.size());
+  vector<thread> threads;
+  for (int t = 1 ; t < numThreads ; ++t) threads.push_back(thread(worker));
+  worker();
+  for (unsigned int t = 0 ; t < threads.size() ; ++t) threads[t].join();
+}
@@ -0,0 +1,60 @@
+//
+// AV offset fit of a single fibre
+//
+#include <algorithm>
+#include <sstream>
+
+#include <Math/Functor.h>
+#include <Minuit2/Minuit2Minimizer.h>
+
+#include "include/AVLocFit.h"
+#include "include/AVLocStats.h"
+
+using namespace std;
+
+double FibreFit::trialFunction(int LCN, double AVOffset, double * dTrial)
+{
+  if ( useTOFTable ) return InterpolateTOF(tofTable,LCN,AVOffset,dTrial);
+  return CalcTimeOfFlight(led,*pmts,LCN,AVOffset,*lp,gv,dTrial,vgroup);
+}
+
+double FibreFit::chisq(const double * par, double * dChisq)
+{
+  AVLOC_COUNT("FCN calls");
+  double sum = 0;
+  double dSum = 0;
+  const int n = pmtArrays.GetNumPMTs();
+  for (int i = 0 ; i < n ; ++i) {
+    double weight = weighted ? weights(i) : 1.0;
+    if ( numHits(i) == 0 || weight == 0 ) continue;
+    double dTrial = 0;
+    double trial = trialFunction(i,par[0],dChisq ? &dTrial : NULL);
+    double residual = (trial-hitTimes(i))/hitErrors(i);
+    sum  += weight*residual*residual;
+    dSum += weight*2*residual*dTrial/hitErrors(i);
+  }
+  if ( dChisq ) *dChisq = dSum;
+  return sum;
+}
+
+void FitFibre(FibreFit & fit, bool useGradient)
+{
+  AVLOC_TIMER("fitFibre (Minuit)");
+  ROOT::Minuit2::Minuit2Minimizer min(ROOT::Minuit2::kMigrad);
+  ROOT::Math::Functor chisq([&fit](const double * par){ return fit.chisq(par); },1);
+  ROOT::Math::GradFunctor chisqGrad([&fit](const double * par){ return fit.chisq(par); },
+				    [&fit](const double * par, unsigned int){ double d = 0; fit.chisq(par,&d); return d; },1);
+  if ( useGradient ) min.SetFunction(chisqGrad);
+  else               min.SetFunction(chisq);
+  min.SetErrorDef(1.0);
+  min.SetPrintLevel(0);
+  stringstream ss;
+  ss << "fibre " << fit.fibre << " Offset";
+  double start = fit.warmStart ? fit.value : 0;
+  double step  = fit.warmStart ? max(fit.error,1.0) : 50;
+  min.SetLimitedVariable(0,ss.str(),start,step,fit.offsetMin,fit.offsetMax);
+  min.Minimize();
+  fit.status = min.Status();
+  fit.value  = min.X()[0];
+  fit.error  = min.Errors()[0];
+}
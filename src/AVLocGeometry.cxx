@@ -0,0 +1,253 @@
+//
+// Packed PMT geometry for AV location
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+#include <mutex>
+
+#include <TVector2.h>
+#include <TVector3.h>
+#include <RAT/DB.hh>
+
+#include "include/AVLocGeometry.h"
+#include "include/AVLocPlot.h"
+
+using namespace std;
+
+// number of arrays in PMTGeometry
+const int kPMTGeometryArrays = 11;
+const int kPMTGeometryVersion = 2;
+
+// header of the binary cache, followed by the arrays in PMTGeometry order
+struct PMTGeometryHeader {
+  char      magic[8];
+  Int_t     version;
+  Int_t     n_pmts;
+  Int_t     n_padded;
+  Int_t     reserved;
+  Long64_t  source_mtime;  // modification time of the PMTINFO file
+  char      source[256];   // PMTINFO file the arrays were built from
+};
+
+// PMTINFO file in the RAT data directory
+static string GetPMTInfoFile()
+{
+  char* ratroot = getenv("RATROOT");
+  if (ratroot == static_cast<char*>(NULL)) {
+    cerr << "Environment variable $RATROOT must be set" << endl;
+    assert(ratroot);
+  }
+  string pmtfile = string(ratroot);
+  pmtfile += "/data/pmt/airfill2.ratdb";
+  return pmtfile;
+}
+
+static Long64_t GetModificationTime(const string & filename)
+{
+  struct stat info;
+  if ( stat(filename.c_str(),&info) != 0 ) return 0;
+  return info.st_mtime;
+}
+
+PMTGeometry::PMTGeometry()
+  : n_pmts(0), n_padded(0), fBuffer(NULL)
+{
+  Allocate(0);
+}
+
+PMTGeometry::~PMTGeometry()
+{
+  free(fBuffer);
+}
+
+void PMTGeometry::Allocate(int n)
+{
+  free(fBuffer);
+  const int pad = kPMTGeometryAlign/sizeof(double);
+  n_pmts   = n;
+  n_padded = ((n+pad-1)/pad)*pad;
+  size_t bytes = sizeof(double)*n_padded*kPMTGeometryArrays;
+  void * buffer = NULL;
+  if ( posix_memalign(&buffer,kPMTGeometryAlign,bytes > 0 ? bytes : kPMTGeometryAlign) != 0 ) {
+    cerr << "AVLocGeometry::Allocate : could not allocate " << bytes << " bytes" << endl;
+    assert(0);
+  }
+  fBuffer = (double*)buffer;
+  memset(fBuffer,0,bytes);
+  double ** arrays[kPMTGeometryArrays] = { &x_pos, &y_pos, &z_pos, &x_dir, &y_dir, &z_dir,
+					   &x_unit, &y_unit, &z_unit, &x_flat, &y_flat };
+  for (int k = 0 ; k < kPMTGeometryArrays ; ++k) *arrays[k] = fBuffer + k*n_padded;
+}
+
+void BuildPMTGeometry(PMTGeometry & geo)
+{
+  cout << "Loading PMT positions" << endl;
+  //const double offset = 56.7; // difference front PMT and bucket in mm
+  const double offset = 0.0;
+  RAT::DB* db = RAT::DB::Get();
+  assert(db);
+  db->LoadFile(GetPMTInfoFile());
+  RAT::DBLinkPtr pmtInfo = db->GetLink("PMTINFO");
+  assert(pmtInfo);
+  vector<double> x_pos = pmtInfo->GetDArray("x");
+  vector<double> y_pos = pmtInfo->GetDArray("y");
+  vector<double> z_pos = pmtInfo->GetDArray("z");
+  vector<double> x_dir = pmtInfo->GetDArray("v");
+  vector<double> y_dir = pmtInfo->GetDArray("u");
+  vector<double> z_dir = pmtInfo->GetDArray("w");
+  geo.Allocate(x_pos.size());
+  for (int i = 0 ; i < geo.n_pmts ; ++i) {
+    TVector3 pos(x_pos[i],y_pos[i],z_pos[i]);
+    TVector3 dir(x_dir[i],y_dir[i],z_dir[i]);
+    pos += dir.Unit()*offset;
+    geo.x_pos[i] = pos.X();
+    geo.y_pos[i] = pos.Y();
+    geo.z_pos[i] = pos.Z();
+    geo.x_dir[i] = dir.X();
+    geo.y_dir[i] = dir.Y();
+    geo.z_dir[i] = dir.Z();
+    TVector3 unit = pos.Unit();
+    geo.x_unit[i] = unit.X();
+    geo.y_unit[i] = unit.Y();
+    geo.z_unit[i] = unit.Z();
+    TVector2 flat = IcosProject(pos);
+    geo.x_flat[i] = flat.X();
+    geo.y_flat[i] = flat.Y();
+  }
+}
+
+bool ReadPMTGeometry(const string & filename, PMTGeometry & geo)
+{
+  FILE * file = fopen(filename.c_str(),"rb");
+  if ( file == NULL ) return false;
+  PMTGeometryHeader header;
+  bool ok = fread(&header,sizeof(header),1,file) == 1 &&
+    strncmp(header.magic,"AVLOCPMT",8) == 0 && header.version == kPMTGeometryVersion;
+  const string pmtfile = GetPMTInfoFile();
+  if ( ok && strncmp(header.source,pmtfile.c_str(),sizeof(header.source)) != 0 ) {
+    cout << "AVLocGeometry::ReadPMTGeometry : " << filename << " was built from another PMTINFO file, rebuilding" << endl;
+    ok = false;
+  }
+  if ( ok && header.source_mtime < GetModificationTime(pmtfile) ) {
+    cout << "AVLocGeometry::ReadPMTGeometry : " << filename << " is older than PMTINFO, rebuilding" << endl;
+    ok = false;
+  }
+  if ( ok ) {
+    geo.Allocate(header.n_pmts);
+    ok = header.n_padded == geo.n_padded;
+  }
+  if ( ok ) {
+    size_t n = (size_t)geo.n_padded*kPMTGeometryArrays;
+    ok = fread(geo.x_pos,sizeof(double),n,file) == n;
+  }
+  fclose(file);
+  if ( !ok ) geo.Allocate(0);
+  return ok;
+}
+
+bool WritePMTGeometry(const string & filename, const PMTGeometry & geo)
+{
+  // the cache is shared by all jobs on the ntuple directory, so it is written
+  // next to the final name and renamed, readers never see a partial file
+  char suffix[32];
+  snprintf(suffix,sizeof(suffix),".tmp%d",(int)getpid());
+  string tmpname = filename + suffix;
+  FILE * file = fopen(tmpname.c_str(),"wb");
+  if ( file == NULL ) {
+    cerr << "AVLocGeometry::WritePMTGeometry : could not open " << tmpname << endl;
+    return false;
+  }
+  const string pmtfile = GetPMTInfoFile();
+  PMTGeometryHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,"AVLOCPMT",8);
+  header.version      = kPMTGeometryVersion;
+  header.n_pmts       = geo.n_pmts;
+  header.n_padded     = geo.n_padded;
+  header.source_mtime = GetModificationTime(pmtfile);
+  strncpy(header.source,pmtfile.c_str(),sizeof(header.source));
+  size_t n = (size_t)geo.n_padded*kPMTGeometryArrays;
+  bool ok = fwrite(&header,sizeof(header),1,file) == 1 &&
+    fwrite(geo.x_pos,sizeof(double),n,file) == n;
+  ok = fclose(file) == 0 && ok;
+  if ( ok ) ok = rename(tmpname.c_str(),filename.c_str()) == 0;
+  if ( !ok ) {
+    cerr << "AVLocGeometry::WritePMTGeometry : could not write " << filename << endl;
+    unlink(tmpname.c_str());
+  }
+  return ok;
+}
+
+string GetPMTGeometryCacheName(const string & ntuple_filename)
+{
+  size_t slash = ntuple_filename.find_last_of('/');
+  if ( slash == string::npos ) return "pmt_geometry.bin";
+  return ntuple_filename.substr(0,slash+1) + "pmt_geometry.bin";
+}
+
+const PMTGeometry & GetPMTGeometry(const string & cache_file)
+{
+  static PMTGeometry geo;
+  static bool loaded = false;
+  static mutex load_mutex;
+  lock_guard<mutex> lock(load_mutex);
+  if ( loaded ) return geo;
+  if ( cache_file.empty() || !ReadPMTGeometry(cache_file,geo) ) {
+    BuildPMTGeometry(geo);
+    if ( !cache_file.empty() ) WritePMTGeometry(cache_file,geo);
+  }
+  else {
+    cout << "Read PMT geometry from " << cache_file << endl;
+  }
+  loaded = true;
+  return geo;
+}
+
+double TimeOfFlight(const PMTGeometry & geo, const TVector3 & inject, PhysicsNr n_h2o,
+		    double offset, double * tof)
+{
+  assert(n_h2o.value);
+  // same reflection point and path as TimeOfFlight, with the square roots and divisions
+  // kept inside one loop over plain arrays so the compiler can vectorise it
+  const double ns_per_mm = 1E9*n_h2o.value/299792458000.;
+  const double r  = 6050.*offset;
+  const double ix = inject.X();
+  const double iy = inject.Y();
+  const double iz = inject.Z();
+  const double * __restrict__ x = (const double*)__builtin_assume_aligned(geo.x_pos,kPMTGeometryAlign);
+  const double * __restrict__ y = (const double*)__builtin_assume_aligned(geo.y_pos,kPMTGeometryAlign);
+  const double * __restrict__ z = (const double*)__builtin_assume_aligned(geo.z_pos,kPMTGeometryAlign);
+  double * __restrict__ out = tof;
+  const int n = geo.n_pmts;
+  for (int i = 0 ; i < n ; ++i) {
+    double sx = ix + x[i];
+    double sy = iy + y[i];
+    double sz = iz + z[i];
+    double scale = r/sqrt(sx*sx + sy*sy + sz*sz);
+    double rx = sx*scale;
+    double ry = sy*scale;
+    double rz = sz*scale;
+    double ax = ix - rx, ay = iy - ry, az = iz - rz;
+    double bx = x[i] - rx, by = y[i] - ry, bz = z[i] - rz;
+    out[i] = (sqrt(ax*ax + ay*ay + az*az) + sqrt(bx*bx + by*by + bz*bz))*ns_per_mm;
+  }
+  return n_h2o.error/n_h2o.value;
+}
+
+PMTInfo GetPMTpositions(const PMTGeometry & geo)
+{
+  PMTInfo pmt_info;
+  pmt_info.x_pos.assign(geo.x_pos,geo.x_pos+geo.n_pmts);
+  pmt_info.y_pos.assign(geo.y_pos,geo.y_pos+geo.n_pmts);
+  pmt_info.z_pos.assign(geo.z_pos,geo.z_pos+geo.n_pmts);
+  pmt_info.x_dir.assign(geo.x_dir,geo.x_dir+geo.n_pmts);
+  pmt_info.y_dir.assign(geo.y_dir,geo.y_dir+geo.n_pmts);
+  pmt_info.z_dir.assign(geo.z_dir,geo.z_dir+geo.n_pmts);
+  return pmt_info;
+}
@@ -0,0 +1,342 @@
+//
+// Hits from the avloc summary ntuple bucketed per fibre
+//
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <TMath.h>
+#include <TTree.h>
+#include <TVector3.h>
+
+#include "include/AVLocHits.h"
+#include "include/AVLocStats.h"
+
+using namespace std;
+
+// iterations of the truncated mean in GetHitPeak
+const int kPeakIterations = 20;
+
+HitBuckets::HitBuckets(double dist_max, double time_lower, double time_upper,
+		       int n_bins, double time_min, double time_max)
+  : fDistMax(dist_max), fTimeLower(time_lower), fTimeUpper(time_upper),
+    fNBins(n_bins), fTimeMin(time_min), fTimeMax(time_max), fLastNr(-1), fLastSub(-1), fLast(-1)
+{
+}
+
+FibreHits & HitBuckets::GetFibre(int fibre_nr, int fibre_sub)
+{
+  // entries are mostly grouped by fibre so remember the last one
+  if ( fibre_nr != fLastNr || fibre_sub != fLastSub ) {
+    map<pair<int,int>,int>::iterator it = fIndex.find(make_pair(fibre_nr,fibre_sub));
+    if ( it == fIndex.end() ) {
+      FibreHits hits;
+      hits.fibre_nr  = fibre_nr;
+      hits.fibre_sub = fibre_sub;
+      hits.n_bins    = fNBins;
+      hits.time_min  = fTimeMin;
+      hits.time_max  = fTimeMax;
+      it = fIndex.insert(make_pair(make_pair(fibre_nr,fibre_sub),(int)fFibres.size())).first;
+      fFibres.push_back(hits);
+    }
+    fLastNr  = fibre_nr;
+    fLastSub = fibre_sub;
+    fLast    = it->second;
+  }
+  return fFibres[fLast];
+}
+
+void HitBuckets::Add(int fibre_nr, int fibre_sub, int lcn, double time, double dist)
+{
+  FibreHits & hits = GetFibre(fibre_nr,fibre_sub);
+  if ( time <= fTimeLower || time >= fTimeUpper ) return;
+  if ( dist >= fDistMax ) return;
+  // same bin as TAxis::FindBin, minus the underflow bin
+  int bin = (int)(fNBins*(time-fTimeMin)/(fTimeMax-fTimeMin));
+  if ( bin < 0 || bin >= fNBins ) return;
+  if ( lcn >= (int)hits.row.size() ) hits.row.resize(lcn+1,-1);
+  if ( hits.row[lcn] < 0 ) {
+    hits.row[lcn] = hits.lcn.size();
+    hits.lcn.push_back(lcn);
+    hits.n_hits.push_back(0);
+    hits.mean.push_back(0.);
+    hits.m2.push_back(0.);
+    hits.counts.resize(hits.counts.size()+fNBins,0);
+  }
+  int row = hits.row[lcn];
+  int n = ++hits.n_hits[row];
+  hits.counts[row*fNBins+bin]++;
+  double delta = time - hits.mean[row];
+  hits.mean[row] += delta/n;
+  hits.m2[row]   += delta*(time - hits.mean[row]);
+}
+
+void HitBuckets::Add(const LEDInfo & led, const HitBuffer & buffer, const PMTInfo & pmt_info)
+{
+  AVLOC_COUNT_N("hits bucketed",buffer.lcn.size());
+  GetFibre(led.nr,led.sub);
+  for (unsigned int i = 0 ; i < buffer.lcn.size() ; ++i) {
+    int pmt = buffer.lcn[i];
+    TVector3 PMT_pos(pmt_info.x_pos[pmt],pmt_info.y_pos[pmt],pmt_info.z_pos[pmt]);
+    Add(led.nr,led.sub,pmt,buffer.time[i],(PMT_pos-led.position).Mag());
+  }
+}
+
+// fill buckets from the entry ranges, only with the fibres in selected if given
+static void FillBuckets(HitReader & reader, HitBuckets & buckets, const vector<FibreRange> & ranges,
+			double time_lower, double time_upper, const set<int> * selected)
+{
+  for (unsigned int r = 0 ; r < ranges.size() ; ++r) {
+    Long64_t end = ranges[r].first + ranges[r].entries;
+    AVLOC_COUNT_N("hits read",ranges[r].entries);
+    for (Long64_t i = ranges[r].first ; i < end ; ++i) {
+      reader.GetEntry(i);
+      if ( selected && selected->count(reader.GetFibreNr()) == 0 ) continue;
+      double time = reader.GetTime();
+      // the distance is only looked up for hits inside the time window
+      double dist = time <= time_lower || time >= time_upper ? 0. : reader.GetDist();
+      buckets.Add(reader.GetFibreNr(),reader.GetFibreSub(),reader.GetLCN(),time,dist);
+    }
+  }
+}
+
+vector<FibreHits> BucketHits(HitReader & reader, double dist_max, double time_lower, double time_upper,
+			     int n_bins, double time_min, double time_max)
+{
+  HitBuckets buckets(dist_max,time_lower,time_upper,n_bins,time_min,time_max);
+  if ( !reader.IsValid() ) {
+    cerr << "AVLocHits::BucketHits : no hits to read" << endl;
+    return buckets.GetFibres();
+  }
+  AVLOC_TIMER("BucketHits");
+  FibreRange all = { -1, -1, 0, reader.GetEntries() };
+  FillBuckets(reader,buckets,vector<FibreRange>(1,all),time_lower,time_upper,NULL);
+  return buckets.GetFibres();
+}
+
+vector<FibreHits> BucketHits(HitReader & reader, double dist_max, double time_lower, double time_upper,
+			     int n_bins, double time_min, double time_max, const vector<int> & fibre_nrs)
+{
+  HitBuckets buckets(dist_max,time_lower,time_upper,n_bins,time_min,time_max);
+  if ( !reader.IsValid() ) {
+    cerr << "AVLocHits::BucketHits : no hits to read" << endl;
+    return buckets.GetFibres();
+  }
+  AVLOC_TIMER("BucketHits");
+  set<int> selected(fibre_nrs.begin(),fibre_nrs.end());
+  vector<FibreRange> ranges;
+  if ( reader.HasIndex() ) {
+    for (set<int>::iterator it = selected.begin() ; it != selected.end() ; ++it) {
+      vector<FibreRange> fibre = reader.GetEntryRanges(*it);
+      ranges.insert(ranges.end(),fibre.begin(),fibre.end());
+    }
+  }
+  else {
+    FibreRange all = { -1, -1, 0, reader.GetEntries() };
+    ranges.push_back(all);
+  }
+  FillBuckets(reader,buckets,ranges,time_lower,time_upper,&selected);
+  return buckets.GetFibres();
+}
+
+bool MergeFibreHits(FibreHits & into, const FibreHits & from)
+{
+  if ( into.fibre_nr != from.fibre_nr || into.fibre_sub != from.fibre_sub ) {
+    cerr << "AVLocHits::MergeFibreHits : fibre " << from.fibre_nr << "/" << from.fibre_sub
+	 << " added to fibre " << into.fibre_nr << "/" << into.fibre_sub << endl;
+    return false;
+  }
+  if ( into.n_bins != from.n_bins || into.time_min != from.time_min || into.time_max != from.time_max ) {
+    cerr << "AVLocHits::MergeFibreHits : different time binning for fibre " << from.fibre_nr << endl;
+    return false;
+  }
+  const int n_bins = into.n_bins;
+  for (unsigned int r = 0 ; r < from.lcn.size() ; ++r) {
+    int pmt = from.lcn[r];
+    if ( pmt >= (int)into.row.size() ) into.row.resize(pmt+1,-1);
+    if ( into.row[pmt] < 0 ) {
+      into.row[pmt] = into.lcn.size();
+      into.lcn.push_back(pmt);
+      into.n_hits.push_back(0);
+      into.mean.push_back(0.);
+      into.m2.push_back(0.);
+      into.counts.resize(into.counts.size()+n_bins,0);
+    }
+    int row = into.row[pmt];
+    // pairwise update of the moments (Chan et al.)
+    double na = into.n_hits[row], nb = from.n_hits[r];
+    double n = na + nb;
+    if ( n == 0 ) continue;
+    double delta = from.mean[r] - into.mean[row];
+    into.mean[row] += delta*nb/n;
+    into.m2[row]   += from.m2[r] + delta*delta*na*nb/n;
+    into.n_hits[row] += from.n_hits[r];
+    for (int bin = 0 ; bin < n_bins ; ++bin) into.counts[row*n_bins+bin] += from.counts[r*n_bins+bin];
+  }
+  return true;
+}
+
+bool MergeFibreHits(vector<FibreHits> & into, const vector<FibreHits> & from)
+{
+  bool ok = true;
+  for (unsigned int i = 0 ; i < from.size() ; ++i) {
+    unsigned int j = 0;
+    while ( j < into.size() && (into[j].fibre_nr != from[i].fibre_nr || into[j].fibre_sub != from[i].fibre_sub) ) ++j;
+    if ( j == into.size() ) into.push_back(from[i]);
+    else                    ok = MergeFibreHits(into[j],from[i]) && ok;
+  }
+  return ok;
+}
+
+void WriteFibreHits(TFile * file, const vector<FibreHits> & hits)
+{
+  file->cd();
+  FibreHits entry;
+  vector<int>          * lcn    = &entry.lcn;
+  vector<int>          * n_hits = &entry.n_hits;
+  vector<double>       * mean   = &entry.mean;
+  vector<double>       * m2     = &entry.m2;
+  vector<unsigned int> * counts = &entry.counts;
+  TTree * tree = new TTree("avlocbuckets","bucketed hits per fibre and LCN");
+  tree->Branch("fibre_nr",&entry.fibre_nr,"fibre_nr/I");
+  tree->Branch("fibre_sub",&entry.fibre_sub,"fibre_sub/I");
+  tree->Branch("n_bins",&entry.n_bins,"n_bins/I");
+  tree->Branch("time_min",&entry.time_min,"time_min/D");
+  tree->Branch("time_max",&entry.time_max,"time_max/D");
+  tree->Branch("lcn",&lcn);
+  tree->Branch("n_hits",&n_hits);
+  tree->Branch("mean",&mean);
+  tree->Branch("m2",&m2);
+  tree->Branch("counts",&counts);
+  for (unsigned int i = 0 ; i < hits.size() ; ++i) {
+    entry = hits[i];
+    tree->Fill();
+  }
+  tree->Write("",TObject::kOverwrite);
+  delete tree;
+}
+
+bool ReadFibreHits(TFile * file, vector<FibreHits> & hits)
+{
+  TTree * tree = (TTree*)file->Get("avlocbuckets");
+  if ( tree == NULL ) {
+    cerr << "AVLocHits::ReadFibreHits : no avlocbuckets in " << file->GetName() << endl;
+    return false;
+  }
+  FibreHits entry;
+  vector<int>          * lcn    = NULL;
+  vector<int>          * n_hits = NULL;
+  vector<double>       * mean   = NULL;
+  vector<double>       * m2     = NULL;
+  vector<unsigned int> * counts = NULL;
+  tree->SetBranchAddress("fibre_nr",&entry.fibre_nr);
+  tree->SetBranchAddress("fibre_sub",&entry.fibre_sub);
+  tree->SetBranchAddress("n_bins",&entry.n_bins);
+  tree->SetBranchAddress("time_min",&entry.time_min);
+  tree->SetBranchAddress("time_max",&entry.time_max);
+  tree->SetBranchAddress("lcn",&lcn);
+  tree->SetBranchAddress("n_hits",&n_hits);
+  tree->SetBranchAddress("mean",&mean);
+  tree->SetBranchAddress("m2",&m2);
+  tree->SetBranchAddress("counts",&counts);
+  bool ok = true;
+  for (Long64_t i = 0 ; i < tree->GetEntries() ; ++i) {
+    tree->GetEntry(i);
+    entry.lcn    = *lcn;
+    entry.n_hits = *n_hits;
+    entry.mean   = *mean;
+    entry.m2     = *m2;
+    entry.counts = *counts;
+    // rebuild the LCN -> row lookup
+    int maxLCN = -1;
+    for (unsigned int r = 0 ; r < entry.lcn.size() ; ++r) maxLCN = max(maxLCN,entry.lcn[r]);
+    entry.row.assign(maxLCN+1,-1);
+    for (unsigned int r = 0 ; r < entry.lcn.size() ; ++r) entry.row[entry.lcn[r]] = r;
+    ok = MergeFibreHits(hits,vector<FibreHits>(1,entry)) && ok;
+  }
+  tree->ResetBranchAddresses();
+  delete lcn;
+  delete n_hits;
+  delete mean;
+  delete m2;
+  delete counts;
+  return ok;
+}
+
+int GetNumHits(const FibreHits & hits, int lcn)
+{
+  if ( lcn < 0 || lcn >= (int)hits.row.size() || hits.row[lcn] < 0 ) return 0;
+  return hits.n_hits[hits.row[lcn]];
+}
+
+bool GetHitTime(const FibreHits & hits, int lcn, double & mean, double & error)
+{
+  int n = GetNumHits(hits,lcn);
+  if ( n < 2 ) return false;
+  int row = hits.row[lcn];
+  mean  = hits.mean[row];
+  error = sqrt(hits.m2[row]/(n-1)/n);
+  return true;
+}
+
+bool GetHitPeak(const FibreHits & hits, int lcn, double & peak, double & error, double k_sigma)
+{
+  int n = GetNumHits(hits,lcn);
+  if ( n < 2 ) return false;
+  int row = hits.row[lcn];
+  const unsigned int * counts = &hits.counts[row*hits.n_bins];
+  const double width = (hits.time_max-hits.time_min)/hits.n_bins;
+  // fraction of a gaussian within +-k_sigma, and the variance of the truncated gaussian in sigma^2
+  const double inside     = TMath::Erf(k_sigma/sqrt(2.));
+  const double truncation = 1. - 2.*k_sigma*TMath::Gaus(k_sigma,0.,1.,kTRUE)/inside;
+  // start from all hits, the window is never narrower than a bin either side
+  double mean  = hits.mean[row];
+  double sigma = sqrt(hits.m2[row]/(n-1));
+  double sum   = n;
+  for (int iter = 0 ; iter < kPeakIterations ; ++iter) {
+    double half = k_sigma*max(sigma,width);
+    double s0 = 0, s1 = 0, s2 = 0;
+    for (int bin = 0 ; bin < hits.n_bins ; ++bin) {
+      if ( counts[bin] == 0 ) continue;
+      double t = hits.time_min + (bin+0.5)*width;
+      if ( fabs(t-mean) > half ) continue;
+      s0 += counts[bin];
+      s1 += counts[bin]*t;
+      s2 += counts[bin]*t*t;
+    }
+    if ( s0 < 2 ) break;
+    double next = s1/s0;
+    // Sheppard's correction for the binning
+    double var = s2/s0 - next*next - width*width/12.;
+    bool converged = fabs(next-mean) < 1E-3*width;
+    mean  = next;
+    sigma = var > 0 ? sqrt(var/truncation) : 0.;
+    sum   = s0;
+    if ( converged ) break;
+  }
+  peak  = mean;
+  // error of the mean of the whole gaussian, estimated from the hits inside the window
+  error = max(sigma,width/sqrt(12.))/sqrt(sum/inside);
+  return true;
+}
+
+TH1D * GetHitHisto(const FibreHits & hits, int lcn, const char * name)
+{
+  TH1D * histo = new TH1D(name,name,hits.n_bins,hits.time_min,hits.time_max);
+  FillHitHisto(hits,lcn,histo);
+  return histo;
+}
+
+void FillHitHisto(const FibreHits & hits, int lcn, TH1D * histo)
+{
+  histo->Reset();
+  if ( lcn < 0 || lcn >= (int)hits.row.size() || hits.row[lcn] < 0 ) return;
+  const unsigned int * counts = &hits.counts[hits.row[lcn]*hits.n_bins];
+  for (int bin = 0 ; bin < hits.n_bins ; ++bin) {
+    if ( counts[bin] ) histo->SetBinContent(bin+1,counts[bin]);
+  }
+  histo->SetEntries(hits.n_hits[hits.row[lcn]]);
+}
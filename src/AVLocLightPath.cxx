@@ -0,0 +1,7 @@
+//
+// Light paths for a fixed detector configuration
+//
+#include "include/AVLocLightPath.h"
+
+// compiled once here, see the extern declaration in the header
+template class LightPathT<OutsideAVSource,ELLIEReflection,CheckNeck>;
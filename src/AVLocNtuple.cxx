@@ -0,0 +1,329 @@
+//
+// Compact summary ntuple for AV location
+//
+#include <assert.h>
+#include <iostream>
+
+#include <Compression.h>
+#include <TSystem.h>
+#include <TVector3.h>
+
+#include "include/AVLocNtuple.h"
+
+using namespace std;
+
+// hits per cluster, baskets are sized to hold one cluster for each branch
+const Long64_t kHitsPerCluster = 256000;
+
+HitWriter::HitWriter(TFile * file)
+  : fFile(file), fHits(NULL), fFibres(NULL), fLastNr(-1), fLastSub(-1)
+{
+  assert(fFile);
+  fFile->cd();
+  fHits   = (TTree*)fFile->Get("avlochits");
+  fFibres = (TTree*)fFile->Get("avlocfibres");
+  if ( fHits == NULL ) {
+    if ( fFile->Get("avloctuple") ) {
+      cerr << "AVLocNtuple::HitWriter : " << fFile->GetName() << " holds an old avloctuple, will not mix formats" << endl;
+      return;
+    }
+    fHits = new TTree("avlochits","avloc hits");
+    fHits->Branch("fibre_nr",&fFibreNr,"fibre_nr/b",kHitsPerCluster*sizeof(UChar_t));
+    fHits->Branch("fibre_sub",&fFibreSub,"fibre_sub/b",kHitsPerCluster*sizeof(UChar_t));
+    fHits->Branch("lcn",&fLCN,"lcn/s",kHitsPerCluster*sizeof(UShort_t));
+    fHits->Branch("time",&fTime,"time/F",kHitsPerCluster*sizeof(Float_t));
+    fHits->SetAutoFlush(kHitsPerCluster);
+    fFibres = new TTree("avlocfibres","avloc fibre positions");
+    fFibres->Branch("nr",&fRecord.nr,"nr/I");
+    fFibres->Branch("sub",&fRecord.sub,"sub/I");
+    fFibres->Branch("position",fRecord.position,"position[3]/D");
+    fFibres->Branch("direction",fRecord.direction,"direction[3]/D");
+  }
+  else {
+    assert(fFibres);
+    fHits->SetBranchAddress("fibre_nr",&fFibreNr);
+    fHits->SetBranchAddress("fibre_sub",&fFibreSub);
+    fHits->SetBranchAddress("lcn",&fLCN);
+    fHits->SetBranchAddress("time",&fTime);
+    fFibres->SetBranchAddress("nr",&fRecord.nr);
+    fFibres->SetBranchAddress("sub",&fRecord.sub);
+    fFibres->SetBranchAddress("position",fRecord.position);
+    fFibres->SetBranchAddress("direction",fRecord.direction);
+    for (Long64_t i = 0 ; i < fFibres->GetEntries() ; ++i) {
+      fFibres->GetEntry(i);
+      fKnownFibres[make_pair((int)fRecord.nr,(int)fRecord.sub)] = true;
+    }
+    TTree * index = (TTree*)fFile->Get("avlocindex");
+    if ( index ) {
+      FibreRange range;
+      index->SetBranchAddress("nr",&range.nr);
+      index->SetBranchAddress("sub",&range.sub);
+      index->SetBranchAddress("first",&range.first);
+      index->SetBranchAddress("entries",&range.entries);
+      for (Long64_t i = 0 ; i < index->GetEntries() ; ++i) {
+	index->GetEntry(i);
+	fIndex.push_back(range);
+      }
+      index->ResetBranchAddresses();
+    }
+    else {
+      ScanIndex();
+    }
+  }
+}
+
+void HitWriter::ScanIndex()
+{
+  cout << "AVLocNtuple::HitWriter : indexing " << fHits->GetEntries() << " hits in " << fFile->GetName() << endl;
+  fHits->SetBranchStatus("*",0);
+  fHits->SetBranchStatus("fibre_nr",1);
+  fHits->SetBranchStatus("fibre_sub",1);
+  for (Long64_t i = 0 ; i < fHits->GetEntries() ; ++i) {
+    fHits->GetEntry(i);
+    if ( fIndex.empty() || fIndex.back().nr != fFibreNr || fIndex.back().sub != fFibreSub ) {
+      FibreRange range = { fFibreNr, fFibreSub, i, 0 };
+      fIndex.push_back(range);
+    }
+    ++fIndex.back().entries;
+  }
+  fHits->SetBranchStatus("*",1);
+}
+
+HitWriter::~HitWriter()
+{
+}
+
+void HitWriter::Fill(LEDInfo & led_info, int lcn, double time)
+{
+  assert(IsOpen());
+  if ( led_info.nr != fLastNr || led_info.sub != fLastSub ) {
+    if ( !fKnownFibres[make_pair(led_info.nr,led_info.sub)] ) {
+      fRecord.nr  = led_info.nr;
+      fRecord.sub = led_info.sub;
+      for (int k = 0 ; k < 3 ; ++k) {
+	fRecord.position[k]  = led_info.position[k];
+	fRecord.direction[k] = led_info.direction[k];
+      }
+      fFibres->Fill();
+      fKnownFibres[make_pair(led_info.nr,led_info.sub)] = true;
+    }
+    fLastNr  = led_info.nr;
+    fLastSub = led_info.sub;
+  }
+  fFibreNr  = led_info.nr;
+  fFibreSub = led_info.sub;
+  fLCN      = lcn;
+  fTime     = time;
+  Long64_t entry = fHits->GetEntries();
+  if ( fIndex.empty() || fIndex.back().nr != led_info.nr || fIndex.back().sub != led_info.sub ||
+       fIndex.back().first + fIndex.back().entries != entry ) {
+    FibreRange range = { led_info.nr, led_info.sub, entry, 0 };
+    fIndex.push_back(range);
+  }
+  fHits->Fill();
+  ++fIndex.back().entries;
+}
+
+void HitWriter::Fill(LEDInfo & led_info, const HitBuffer & buffer)
+{
+  for (unsigned int i = 0 ; i < buffer.lcn.size() ; ++i) Fill(led_info,buffer.lcn[i],buffer.time[i]);
+}
+
+void HitWriter::Write()
+{
+  if ( !IsOpen() ) return;
+  fFile->cd();
+  fHits->Write("",TObject::kOverwrite);
+  fFibres->Write("",TObject::kOverwrite);
+  // the index is small, rewrite it as a whole
+  fFile->Delete("avlocindex;*");
+  TTree * index = new TTree("avlocindex","avloc hit entry ranges per fibre");
+  FibreRange range;
+  index->Branch("nr",&range.nr,"nr/I");
+  index->Branch("sub",&range.sub,"sub/I");
+  index->Branch("first",&range.first,"first/L");
+  index->Branch("entries",&range.entries,"entries/L");
+  for (unsigned int i = 0 ; i < fIndex.size() ; ++i) {
+    range = fIndex[i];
+    index->Fill();
+  }
+  index->Write();
+  delete index;
+}
+
+HitReader::HitReader(TFile * file, PMTInfo & pmt_info)
+  : fTree(NULL), fLegacy(false), fHasIndex(false), fPMTInfo(pmt_info),
+    fFibreNr(-1), fFibreSub(-1), fLCN(-1), fTime(0), fDist(-1),
+    fLastNr(-1), fLastSub(-1), fLastTable(NULL)
+{
+  assert(file);
+  fTree = (TTree*)file->Get("avlochits");
+  if ( fTree ) {
+    fTree->SetBranchAddress("fibre_nr",&fBufFibreNr);
+    fTree->SetBranchAddress("fibre_sub",&fBufFibreSub);
+    fTree->SetBranchAddress("lcn",&fBufLCN);
+    fTree->SetBranchAddress("time",&fTime);
+    ReadFibres(file);
+    ReadIndex(file);
+    return;
+  }
+  fTree = (TTree*)file->Get("avloctuple");
+  if ( fTree ) {
+    fLegacy = true;
+    fTree->SetBranchAddress("fibre_nr",&fLegacyBuf[0]);
+    fTree->SetBranchAddress("fibre_sub",&fLegacyBuf[1]);
+    fTree->SetBranchAddress("lcn",&fLegacyBuf[2]);
+    fTree->SetBranchAddress("time",&fLegacyBuf[3]);
+    fTree->SetBranchAddress("dist",&fLegacyBuf[4]);
+    return;
+  }
+  cerr << "AVLocNtuple::HitReader : no avlochits or avloctuple in " << file->GetName() << endl;
+}
+
+HitReader::~HitReader()
+{
+  if ( fTree ) fTree->ResetBranchAddresses();
+}
+
+void HitReader::ReadFibres(TFile * file)
+{
+  TTree * fibres = (TTree*)file->Get("avlocfibres");
+  if ( fibres == NULL ) {
+    cerr << "AVLocNtuple::HitReader : no avlocfibres in " << file->GetName() << endl;
+    return;
+  }
+  FibreRecord record;
+  fibres->SetBranchAddress("nr",&record.nr);
+  fibres->SetBranchAddress("sub",&record.sub);
+  fibres->SetBranchAddress("position",record.position);
+  fibres->SetBranchAddress("direction",record.direction);
+  for (Long64_t i = 0 ; i < fibres->GetEntries() ; ++i) {
+    fibres->GetEntry(i);
+    fFibrePositions[make_pair((int)record.nr,(int)record.sub)] =
+      TVector3(record.position[0],record.position[1],record.position[2]);
+  }
+  fibres->ResetBranchAddresses();
+}
+
+void HitReader::ReadIndex(TFile * file)
+{
+  TTree * index = (TTree*)file->Get("avlocindex");
+  if ( index == NULL ) return;
+  FibreRange range;
+  index->SetBranchAddress("nr",&range.nr);
+  index->SetBranchAddress("sub",&range.sub);
+  index->SetBranchAddress("first",&range.first);
+  index->SetBranchAddress("entries",&range.entries);
+  Long64_t total = 0;
+  for (Long64_t i = 0 ; i < index->GetEntries() ; ++i) {
+    index->GetEntry(i);
+    fIndex.push_back(range);
+    total += range.entries;
+  }
+  index->ResetBranchAddresses();
+  // an index which does not cover the hits tree is not used
+  fHasIndex = total == fTree->GetEntries();
+  if ( !fHasIndex ) {
+    cerr << "AVLocNtuple::HitReader : avlocindex does not match avlochits in " << file->GetName() << ", ignoring it" << endl;
+    fIndex.clear();
+  }
+}
+
+vector<FibreRange> HitReader::GetEntryRanges(int fibre_nr, int fibre_sub) const
+{
+  vector<FibreRange> ranges;
+  if ( !fHasIndex ) {
+    FibreRange range = { fibre_nr, fibre_sub, 0, GetEntries() };
+    ranges.push_back(range);
+    return ranges;
+  }
+  for (unsigned int i = 0 ; i < fIndex.size() ; ++i) {
+    if ( fIndex[i].nr != fibre_nr ) continue;
+    if ( fibre_sub >= 0 && fIndex[i].sub != fibre_sub ) continue;
+    ranges.push_back(fIndex[i]);
+  }
+  return ranges;
+}
+
+vector<int> HitReader::GetFibreNrs() const
+{
+  vector<int> nrs;
+  for (map<pair<int,int>,TVector3>::const_iterator it = fFibrePositions.begin() ; it != fFibrePositions.end() ; ++it) {
+    if ( nrs.empty() || nrs.back() != it->first.first ) nrs.push_back(it->first.first);
+  }
+  return nrs;
+}
+
+void HitReader::GetEntry(Long64_t i)
+{
+  fTree->GetEntry(i);
+  if ( fLegacy ) {
+    fFibreNr  = (int)fLegacyBuf[0];
+    fFibreSub = (int)fLegacyBuf[1];
+    fLCN      = (int)fLegacyBuf[2];
+    fTime     = fLegacyBuf[3];
+    fDist     = fLegacyBuf[4];
+  }
+  else {
+    fFibreNr  = fBufFibreNr;
+    fFibreSub = fBufFibreSub;
+    fLCN      = fBufLCN;
+    fDist     = -1;
+  }
+}
+
+double HitReader::GetDist()
+{
+  if ( fDist < 0 ) {
+    if ( fFibreNr != fLastNr || fFibreSub != fLastSub ) {
+      fLastTable = &GetDistTable(fFibreNr,fFibreSub);
+      fLastNr  = fFibreNr;
+      fLastSub = fFibreSub;
+    }
+    fDist = (*fLastTable)[fLCN];
+  }
+  return fDist;
+}
+
+const vector<float> & HitReader::GetDistTable(int fibre_nr, int fibre_sub)
+{
+  pair<int,int> key = make_pair(fibre_nr,fibre_sub);
+  map<pair<int,int>,vector<float> >::iterator it = fDistTables.find(key);
+  if ( it != fDistTables.end() ) return it->second;
+  TVector3 position;
+  map<pair<int,int>,TVector3>::iterator pos = fFibrePositions.find(key);
+  if ( pos != fFibrePositions.end() ) {
+    position = pos->second;
+  }
+  else {
+    cerr << "AVLocNtuple::HitReader : fibre " << fibre_nr << "-" << fibre_sub
+	 << " not in avlocfibres, using the database position" << endl;
+    position = GetLEDInfoFromFibreNr(fibre_nr,fibre_sub).position;
+  }
+  vector<float> & table = fDistTables[key];
+  table.resize(fPMTInfo.x_pos.size());
+  for (unsigned int i = 0 ; i < table.size() ; ++i) {
+    TVector3 dist(fPMTInfo.x_pos[i],fPMTInfo.y_pos[i],fPMTInfo.z_pos[i]);
+    dist -= position;
+    table[i] = dist.Mag();
+  }
+  return table;
+}
+
+HitWriter * GetHitWriter(TFile ** fpointer, TString outputFile)
+{
+  TString filename = "summary_ntuple";
+  filename+=outputFile;
+  filename+=".root";
+  TString filenameTest;
+  filenameTest = filename;
+  if ( gSystem->FindFile("./",filenameTest) == 0 ) {
+    cout << "CREATING NEW FILE " << filename << endl;
+    (*fpointer) = new TFile(filename,"NEW","",ROOT::CompressionSettings(ROOT::kLZ4,4));
+  }
+  else {
+    cout << "REUSING OLD FILE " << filename << endl;
+    (*fpointer) = new TFile(filename,"UPDATE");
+  }
+  return new HitWriter(*fpointer);
+}
@@ -0,0 +1,288 @@
+//
+// Persistent cache of light paths for AV location
+//
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include <TMath.h>
+
+#include "include/AVLocLightPath.h"
+#include "include/AVLocPathCache.h"
+#include "include/AVLocStats.h"
+
+using namespace std;
+
+const Int_t kPathCacheVersion = 1;
+
+// header of a cache file, followed by one CachedPath per PMT
+struct PathCacheHeader {
+  char      magic[8];
+  Int_t     version;
+  Int_t     n_pmts;
+  ULong64_t key;
+  // for inspection only, all of them are part of the key
+  Double_t  energy;
+  Double_t  locality;
+  Double_t  AVOffset;
+  Double_t  fibre[3];
+};
+
+// 64 bit FNV-1a
+static const ULong64_t kFNVOffset = 14695981039346656037ULL;
+static const ULong64_t kFNVPrime  = 1099511628211ULL;
+
+static ULong64_t HashBytes(ULong64_t hash, const void * data, size_t n)
+{
+  const unsigned char * bytes = (const unsigned char *)data;
+  for (size_t i = 0 ; i < n ; ++i) {
+    hash ^= bytes[i];
+    hash *= kFNVPrime;
+  }
+  return hash;
+}
+
+static ULong64_t HashDouble(ULong64_t hash, double value)
+{
+  return HashBytes(hash,&value,sizeof(value));
+}
+
+static ULong64_t HashArray(ULong64_t hash, const vector<double> & values)
+{
+  return values.empty() ? hash : HashBytes(hash,&values[0],values.size()*sizeof(double));
+}
+
+CachedPath CalcPath(const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+		    const RAT::DU::LightPathCalculator & lp, double energy, double localityVal, double AVOffset)
+{
+  CachedPath cached;
+  memset(&cached,0,sizeof(cached));
+  cached.flags = kPathValid;
+  // reflected paths are closed form, and the paths that are not reflected are straight
+  // lines, both are calculated for the configuration of the fits by AVLocLightPath
+  RAT::DU::LightPathResult path;
+  if ( lp.GetELLIEReflect() ) {
+    path = AVLocLightPath(lp).Query(fibrePos, PMTPos, energy, localityVal, AVOffset);
+    if ( path.type == RAT::DU::WRefl ) {
+      AVLOC_COUNT("closed form reflections");
+      cached.distInWater           = path.distInWater;
+      cached.dDistInWaterDAVOffset = path.dDistInWaterDAVOffset;
+      cached.angleOfEntry          = path.incidentVecOnPMT.Angle(PMTDir)*TMath::RadToDeg();
+      cached.flags |= kPathClosed;
+      return cached;
+    }
+  }
+  else path = lp.QueryByPosition(fibrePos, PMTPos, energy, localityVal, AVOffset);
+  AVLOC_COUNT("light path queries");
+  if ( path.isTIR )   AVLOC_COUNT("light path TIR");
+  if ( path.resvHit ) AVLOC_COUNT("light path locality failures");
+  cached.distInInnerAV         = path.distInInnerAV;
+  cached.distInAV              = path.distInAV;
+  cached.distInWater           = path.distInWater;
+  cached.dDistInWaterDAVOffset = path.dDistInWaterDAVOffset;
+  cached.angleOfEntry          = path.incidentVecOnPMT.Angle(PMTDir)*TMath::RadToDeg();
+  if ( path.isTIR )   cached.flags |= kPathTIR;
+  if ( path.resvHit ) cached.flags |= kPathResvHit;
+  return cached;
+}
+
+double PathTimeOfFlight(const CachedPath & path, const RAT::DU::GroupVelocity & gv, double energy,
+			double * dTdOffset, const GroupVelocityTable * vgroup)
+{
+  double timeOfFlight;
+  if ( vgroup ) timeOfFlight = path.distInInnerAV*vgroup->inv_scint + path.distInAV*vgroup->inv_av
+		  + path.distInWater*vgroup->inv_water;
+  else          timeOfFlight = gv.CalcByDistance(path.distInInnerAV,path.distInAV,path.distInWater,energy);
+  // adding time spent in the PMT bucket
+  timeOfFlight += gv.PMTBucketTime(path.angleOfEntry);
+  // the time is linear in the distances and the incident angle on the PMT does not
+  // depend on the offset, so only the distance in water contributes to the derivative
+  if ( dTdOffset ) *dTdOffset = vgroup ? path.dDistInWaterDAVOffset*vgroup->inv_water
+		     : gv.CalcByDistance(0.,0.,path.dDistInWaterDAVOffset,energy);
+  return timeOfFlight;
+}
+
+static string gPathCacheDir;
+
+void SetPathCacheDir(const string & dir)
+{
+  gPathCacheDir = dir;
+}
+
+string GetPathCacheDir()
+{
+  char * env = getenv("AVLOC_PATH_CACHE");
+  if ( env != NULL ) return env;
+  return gPathCacheDir;
+}
+
+string GetPathCacheDirName(const string & ntuple_filename)
+{
+  size_t slash = ntuple_filename.find_last_of('/');
+  if ( slash == string::npos ) return "avloc_paths";
+  return ntuple_filename.substr(0,slash+1) + "avloc_paths";
+}
+
+PathBlock::PathBlock(const TVector3 & fibrePos, const PMTInfo & pmt_info, const RAT::DU::LightPathCalculator & lp,
+		     double energy, double localityVal, double AVOffset, ULong64_t key, const string & filename)
+  : fFibrePos(fibrePos), fPMTInfo(&pmt_info), fLP(&lp), fEnergy(energy), fLocality(localityVal),
+    fAVOffset(AVOffset), fKey(key), fFileName(filename), fMapped(NULL), fDirty(false)
+{
+  if ( !fFileName.empty() ) Map();
+}
+
+PathBlock::~PathBlock()
+{
+  Save();
+}
+
+bool PathBlock::Map()
+{
+  int fd = open(fFileName.c_str(),O_RDONLY);
+  if ( fd < 0 ) return false;
+  size_t n_pmts = fPMTInfo->x_pos.size();
+  size_t size = sizeof(PathCacheHeader) + n_pmts*sizeof(CachedPath);
+  struct stat info;
+  void * data = MAP_FAILED;
+  if ( fstat(fd,&info) == 0 && (size_t)info.st_size == size )
+    data = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if ( data == MAP_FAILED ) {
+    cerr << "AVLocPathCache::Map : ignoring " << fFileName << ", wrong size or not readable" << endl;
+    return false;
+  }
+  const PathCacheHeader * header = (const PathCacheHeader *)data;
+  if ( strncmp(header->magic,"AVLOCLPC",8) != 0 || header->version != kPathCacheVersion ||
+       header->key != fKey || header->n_pmts != (Int_t)n_pmts ) {
+    cerr << "AVLocPathCache::Map : ignoring " << fFileName << ", written for other inputs" << endl;
+    munmap(data,size);
+    return false;
+  }
+  fMapping = shared_ptr<const char>((const char *)data,[size](const char * p) { munmap((void *)p,size); });
+  fMapped = (const CachedPath *)(fMapping.get() + sizeof(PathCacheHeader));
+  return true;
+}
+
+const CachedPath & PathBlock::Get(int lcn)
+{
+  assert(lcn >= 0 && lcn < (int)fPMTInfo->x_pos.size());
+  if ( fPaths.empty() ) {
+    if ( fMapped && (fMapped[lcn].flags & kPathValid) ) {
+      AVLOC_COUNT("path cache hits");
+      return fMapped[lcn];
+    }
+    // first miss, continue from the paths in the file
+    CachedPath empty;
+    memset(&empty,0,sizeof(empty));
+    if ( fMapped ) fPaths.assign(fMapped,fMapped+fPMTInfo->x_pos.size());
+    else           fPaths.assign(fPMTInfo->x_pos.size(),empty);
+    fMapped = NULL;
+    fMapping.reset();
+  }
+  CachedPath & path = fPaths[lcn];
+  if ( path.flags & kPathValid ) {
+    AVLOC_COUNT("path cache hits");
+    return path;
+  }
+  AVLOC_COUNT("path cache misses");
+  TVector3 PMT_pos(fPMTInfo->x_pos[lcn],fPMTInfo->y_pos[lcn],fPMTInfo->z_pos[lcn]);
+  TVector3 PMT_dir(fPMTInfo->x_dir[lcn],fPMTInfo->y_dir[lcn],fPMTInfo->z_dir[lcn]);
+  path = CalcPath(fFibrePos,PMT_pos,PMT_dir,*fLP,fEnergy,fLocality,fAVOffset);
+  fDirty = true;
+  return path;
+}
+
+bool PathBlock::Save()
+{
+  if ( !fDirty || fFileName.empty() ) return true;
+  fDirty = false;
+  size_t slash = fFileName.find_last_of('/');
+  if ( slash != string::npos && mkdir(fFileName.substr(0,slash).c_str(),0755) != 0 && errno != EEXIST ) {
+    cerr << "AVLocPathCache::Save : could not create the directory for " << fFileName << endl;
+    return false;
+  }
+  // written next to the final name and renamed, readers never see a partial file
+  char suffix[32];
+  snprintf(suffix,sizeof(suffix),".tmp%d",(int)getpid());
+  string tmpname = fFileName + suffix;
+  FILE * file = fopen(tmpname.c_str(),"wb");
+  if ( file == NULL ) {
+    cerr << "AVLocPathCache::Save : could not open " << tmpname << endl;
+    return false;
+  }
+  PathCacheHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,"AVLOCLPC",8);
+  header.version  = kPathCacheVersion;
+  header.n_pmts   = fPaths.size();
+  header.key      = fKey;
+  header.energy   = fEnergy;
+  header.locality = fLocality;
+  header.AVOffset = fAVOffset;
+  header.fibre[0] = fFibrePos.X();
+  header.fibre[1] = fFibrePos.Y();
+  header.fibre[2] = fFibrePos.Z();
+  bool ok = fwrite(&header,sizeof(header),1,file) == 1 &&
+    fwrite(&fPaths[0],sizeof(CachedPath),fPaths.size(),file) == fPaths.size();
+  ok = fclose(file) == 0 && ok;
+  if ( ok ) ok = rename(tmpname.c_str(),fFileName.c_str()) == 0;
+  if ( !ok ) {
+    cerr << "AVLocPathCache::Save : could not write " << fFileName << endl;
+    unlink(tmpname.c_str());
+  }
+  return ok;
+}
+
+PathCache::PathCache(const PMTInfo & pmt_info, const RAT::DU::LightPathCalculator & lp, double energy, double localityVal)
+  : fPMTInfo(&pmt_info), fLP(&lp), fEnergy(energy), fLocality(localityVal)
+{
+  AVLOC_TIMER("PathCache key");
+  // everything the paths depend on apart from the fibre position and the AV offset
+  ULong64_t hash = kFNVOffset;
+  hash = HashBytes(hash,&kPathCacheVersion,sizeof(kPathCacheVersion));
+  hash = HashArray(hash,pmt_info.x_pos);
+  hash = HashArray(hash,pmt_info.y_pos);
+  hash = HashArray(hash,pmt_info.z_pos);
+  hash = HashArray(hash,pmt_info.x_dir);
+  hash = HashArray(hash,pmt_info.y_dir);
+  hash = HashArray(hash,pmt_info.z_dir);
+  hash = HashDouble(hash,lp.GetAVInnerRadius());
+  hash = HashDouble(hash,lp.GetAVOuterRadius());
+  hash = HashDouble(hash,lp.GetNeckInnerRadius());
+  hash = HashDouble(hash,lp.GetNeckOuterRadius());
+  hash = HashDouble(hash,lp.GetPMTRadius());
+  hash = HashDouble(hash,lp.GetFillFraction());
+  hash = HashDouble(hash,lp.GetELLIEReflect() ? 1. : 0.);
+  hash = HashDouble(hash,lp.GetInnerAVRIFromTable(energy));
+  hash = HashDouble(hash,lp.GetUpperTargetRIFromTable(energy));
+  hash = HashDouble(hash,lp.GetLowerTargetRIFromTable(energy));
+  hash = HashDouble(hash,lp.GetAVRIFromTable(energy));
+  hash = HashDouble(hash,lp.GetWaterRIFromTable(energy));
+  hash = HashDouble(hash,energy);
+  hash = HashDouble(hash,localityVal);
+  fKey = hash;
+}
+
+PathBlock PathCache::GetBlock(const TVector3 & fibrePos, double AVOffset) const
+{
+  ULong64_t key = fKey;
+  key = HashDouble(key,fibrePos.X());
+  key = HashDouble(key,fibrePos.Y());
+  key = HashDouble(key,fibrePos.Z());
+  key = HashDouble(key,AVOffset);
+  string dir = GetPathCacheDir();
+  string filename;
+  if ( !dir.empty() ) {
+    char name[32];
+    snprintf(name,sizeof(name),"/%016llx.bin",(unsigned long long)key);
+    filename = dir + name;
+  }
+  return PathBlock(fibrePos,*fPMTInfo,*fLP,fEnergy,fLocality,AVOffset,key,filename);
+}
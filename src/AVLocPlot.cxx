@@ -4,6 +4,8 @@
 //
 #include "include/AVLocPlot.h"
 #include "include/AVLocTools.h"
+#include "include/AVLocGeometry.h"
+#include "include/AVLocStats.h"
 
 #include <RAT/DS/Entry.hh>
 #include <RAT/DS/EV.hh>
@@ -14,11 +16,17 @@
 
 #include <TF1.h>
 #include <TFile.h>
+#include <TGraphErrors.h>
 #include <TMath.h>
 #include <TH1D.h>
+#include <TH2D.h>
 #include <TCanvas.h>
+#include <TROOT.h>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <thread>
 
 using namespace std;
 
@@ -44,222 +52,170 @@ TVector2 TransformCoord( const TVector3& V1, const TVector3& V2, const TVector3&
     return result;
 }
 
+// Face of the icosahedron with the parts of TransformCoord which do not depend on the point
+struct IcosFace {
+    TVector3 centre;
+    TVector3 V1;
+    TVector3 xV, yV, zV;    // unit vectors along and normal to the face
+    double   planeD;
+    TVector2 A1;
+    TVector2 xA, yA;        // flat map axes, scaled from the sphere to flat map units
+};
+
+// faces in the order of the projection, built once on first use
+static vector<IcosFace> BuildIcosFaces(){
+    // From http://www.rwgrayprojects.com/rbfnotes/polyhed/PolyhedraData/Icosahedralsahedron/Icosahedralsahedron.pdf
+    const double t = ( 1.0 + sqrt( 5.0 ) ) / 2.0;
+    TVector3 V[59];
+    V[2] = TVector3( t * t, 0.0, t * t * t ).Unit();
+    V[6] = TVector3( -t * t, 0.0, t * t * t ).Unit();
+    V[12] = TVector3( 0.0, t * t * t, t * t ).Unit();
+    V[17] = TVector3( 0.0, -t * t * t, t * t ).Unit();
+    V[27] = TVector3( t * t * t, t * t, 0.0 ).Unit();
+    V[31] = TVector3( -t * t * t, t * t, 0.0 ).Unit();
+    V[33] = TVector3( -t * t * t, -t * t, 0.0 ).Unit();
+    V[37] = TVector3( t * t * t, -t * t, 0.0 ).Unit();
+    V[46] = TVector3( 0.0, t * t * t, -t * t ).Unit();
+    V[51] = TVector3( 0.0, -t * t * t, -t * t ).Unit();
+    V[54] = TVector3( t * t, 0.0, -t * t * t ).Unit();
+    V[58] = TVector3( -t * t, 0.0, -t * t * t ).Unit();
+    // vertices of each face and their position on the flat map
+    const int vertices[20][3] = {
+        { 2, 6, 17}, { 2, 12, 6}, { 2, 17, 37}, { 2, 37, 27}, { 2, 27, 12}, {37, 54, 27},
+        {27, 54, 46}, {27, 46, 12}, {12, 46, 31}, {12, 31, 6}, { 6, 31, 33}, { 6, 33, 17},
+        {17, 33, 51}, {17, 51, 37}, {37, 51, 54}, {58, 54, 51}, {58, 46, 54}, {58, 31, 46},
+        {58, 33, 31}, {58, 51, 33} };
+    const TVector2 * corners[20][3] = {
+        {&A2a, &A6, &A17a}, {&A2a, &A12a, &A6}, {&A2b, &A17b, &A37}, {&A2b, &A37, &A27}, {&A2b, &A27, &A12e}, {&A37, &A54, &A27},
+        {&A27, &A54, &A46}, {&A27, &A46, &A12d}, {&A12c, &A46, &A31}, {&A12b, &A31, &A6}, {&A6, &A31, &A33}, {&A6, &A33, &A17a},
+        {&A17a, &A33, &A51a}, {&A17b, &A51e, &A37}, {&A37, &A51d, &A54}, {&A58, &A54, &A51c}, {&A58, &A46, &A54}, {&A58, &A31, &A46},
+        {&A58, &A33, &A31}, {&A58, &A51b, &A33} };
+    vector<IcosFace> faces(20);
+    for( unsigned int i = 0; i < faces.size(); i++ ){
+        const TVector3 & V1 = V[vertices[i][0]];
+        const TVector3 & V2 = V[vertices[i][1]];
+        const TVector3 & V3 = V[vertices[i][2]];
+        const TVector2 & A1 = *corners[i][0];
+        const TVector2 & A2 = *corners[i][1];
+        const TVector2 & A3 = *corners[i][2];
+        IcosFace & face = faces[i];
+        face.centre = ( V1 + V2 + V3 ) * ( 1.0 / 3.0 );
+        TVector3 xV = V2 - V1;
+        TVector3 yV = ( ( V3 - V1 ) + ( V3 - V2 ) ) * 0.5;
+        face.zV = xV.Cross( yV ).Unit();
+        face.planeD = V1.Dot( face.zV );
+        face.V1 = V1;
+        face.xV = xV.Unit();
+        face.yV = yV.Unit();
+        TVector2 xA = A2 - A1;
+        TVector2 yA = ( ( A3 - A1 ) +( A3 - A2 ) ) * 0.5;
+        double convUnits = xA.Mod() / xV.Mag();
+        face.A1 = A1;
+        face.xA = xA.Unit() * convUnits;
+        face.yA = yA.Unit() * convUnits;
+    }
+    return faces;
+}
+
 TVector2 IcosProject( TVector3 pmtPos ){
+    static const vector<IcosFace> faces = BuildIcosFaces();
     TVector3 pointOnSphere( pmtPos.X(), pmtPos.Y(), pmtPos.Z() );
     pointOnSphere = pointOnSphere.Unit();
     pointOnSphere.RotateX( -45.0 );
-    // From http://www.rwgrayprojects.com/rbfnotes/polyhed/PolyhedraData/Icosahedralsahedron/Icosahedralsahedron.pdf                                                                                                                                                                                               
-    const double t = ( 1.0 + sqrt( 5.0 ) ) / 2.0;
-    const TVector3 V2 = TVector3( t * t, 0.0, t * t * t ).Unit();
-    const TVector3 V6 = TVector3( -t * t, 0.0, t * t * t ).Unit();
-    const TVector3 V12 = TVector3( 0.0, t * t * t, t * t ).Unit();
-    const TVector3 V17 = TVector3( 0.0, -t * t * t, t * t ).Unit();
-    const TVector3 V27 = TVector3( t * t * t, t * t, 0.0 ).Unit();
-    const TVector3 V31 = TVector3( -t * t * t, t * t, 0.0 ).Unit();
-    const TVector3 V33 = TVector3( -t * t * t, -t * t, 0.0 ).Unit();
-    const TVector3 V37 = TVector3( t * t * t, -t * t, 0.0 ).Unit();
-    const TVector3 V46 = TVector3( 0.0, t * t * t, -t * t ).Unit();
-    const TVector3 V51 = TVector3( 0.0, -t * t * t, -t * t ).Unit();
-    const TVector3 V54 = TVector3( t * t, 0.0, -t * t * t ).Unit();
-    const TVector3 V58 = TVector3( -t * t, 0.0, -t * t * t ).Unit();
-    // Faces {{ 2, 6, 17}, { 2, 12, 6}, { 2, 17, 37}, { 2, 37, 27}, { 2, 27, 12}, {37, 54, 27},                                                                                                                                                                                                                    
-    // {27, 54, 46}, {27, 46, 12}, {12, 46, 31}, {12, 31, 6}, { 6, 31, 33}, { 6, 33, 17},                                                                                                                                                                                                                          
-    // {17, 33, 51}, {17, 51, 37}, {37, 51, 54}, {58, 54, 51}, {58, 46, 54}, {58, 31, 46},                                                                                                                                                                                                                         
-    // {58, 33, 31}, {58, 51, 33}}                                                                                                                                                                                                                                                                                 
-    vector<TVector3> IcosahedralCentres;
-    IcosahedralCentres.push_back( ( V2 + V6 + V17 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V2 + V12 + V6 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V2 + V17 + V37 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V2 + V37 + V27 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V2 + V27 + V12 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V37 + V54 + V27 ) * ( 1.0 / 3.0 ) );
-
-    IcosahedralCentres.push_back( ( V27 + V54 + V46 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V27 + V46 + V12 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V12 + V46 + V31 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V12 + V31 + V6 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V6 + V31 + V33 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V6 + V33 + V17 ) * ( 1.0 / 3.0 ) );
-
-    IcosahedralCentres.push_back( ( V17 + V33 + V51 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V17 + V51 + V37 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V37 + V51 + V54 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V58 + V54 + V51 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V58 + V46 + V54 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V58 + V31 + V46 ) * ( 1.0 / 3.0 ) );
-
-    IcosahedralCentres.push_back( ( V58 + V33 + V31 ) * ( 1.0 / 3.0 ) );
-    IcosahedralCentres.push_back( ( V58 + V51 + V33 ) * ( 1.0 / 3.0 ) );
-
-    vector<double> distFromCentre;
-    unsigned int uLoop;
-    for( uLoop = 0; uLoop < IcosahedralCentres.size(); uLoop++ ){
-        distFromCentre.push_back( ( IcosahedralCentres[uLoop] - pointOnSphere ).Mag() );
-    }
-    const int face = min_element( distFromCentre.begin(), distFromCentre.end() ) - distFromCentre.begin() + 1;
-    TVector2 resultPosition;
-    switch(face)
-    {
-        case 1://{ 2, 6, 17}
-            resultPosition = TransformCoord( V2, V6, V17, A2a, A6, A17a, pointOnSphere );
-            break;
-        case 2://{ 2, 12, 6}                        
-            resultPosition = TransformCoord( V2, V12, V6, A2a, A12a, A6, pointOnSphere );
-            break;
-        case 3://{ 2, 17, 37}
-            resultPosition = TransformCoord( V2, V17, V37, A2b, A17b, A37, pointOnSphere );
-            break;
-        case 4://{ 2, 37, 27}
-            resultPosition = TransformCoord( V2, V37, V27, A2b, A37, A27, pointOnSphere );
-            break;
-        case 5://{ 2, 27, 12}
-            resultPosition = TransformCoord( V2, V27, V12, A2b, A27, A12e, pointOnSphere );
-            break;
-        case 6://{37, 54, 27}
-            resultPosition = TransformCoord( V37, V54, V27, A37, A54, A27, pointOnSphere );
-            break;
-        case 7://{27, 54, 46}
-            resultPosition = TransformCoord( V27, V54, V46, A27, A54, A46, pointOnSphere );
-            break;
-        case 8://{27, 46, 12}
-            resultPosition = TransformCoord( V27, V46, V12, A27, A46, A12d, pointOnSphere );
-            break;
-        case 9://{12, 46, 31}
-            resultPosition = TransformCoord( V12, V46, V31, A12c, A46, A31, pointOnSphere );
-            break;
-        case 10://{12, 31, 6}
-            resultPosition = TransformCoord( V12, V31, V6, A12b, A31, A6, pointOnSphere );
-            break;
-        case 11://{ 6, 31, 33}
-            resultPosition = TransformCoord( V6, V31, V33, A6, A31, A33, pointOnSphere );
-            break;
-        case 12://{ 6, 33, 17}
-            resultPosition = TransformCoord( V6, V33, V17, A6, A33, A17a, pointOnSphere );
-            break;
-        case 13://{17, 33, 51}
-            resultPosition = TransformCoord( V17, V33, V51, A17a, A33, A51a, pointOnSphere );
-            break;
-        case 14://{17, 51, 37}
-            resultPosition = TransformCoord( V17, V51, V37, A17b, A51e, A37, pointOnSphere );
-            break;
-        case 15://{37, 51, 54}
-            resultPosition = TransformCoord( V37, V51, V54, A37, A51d, A54, pointOnSphere );
-            break;
-        case 16://{58, 54, 51}
-            resultPosition = TransformCoord( V58, V54, V51, A58, A54, A51c, pointOnSphere );
-            break;
-        case 17://{58, 46, 54}
-            resultPosition = TransformCoord( V58, V46, V54, A58, A46, A54, pointOnSphere );
-            break;
-        case 18://{58, 31, 46}
-            resultPosition = TransformCoord( V58, V31, V46, A58, A31, A46, pointOnSphere );
-            break;
-        case 19://{58, 33, 31}
-            resultPosition = TransformCoord( V58, V33, V31, A58, A33, A31, pointOnSphere );
-            break;
-        case 20://{58, 51, 33}
-            resultPosition = TransformCoord( V58, V51, V33, A58, A51b, A33, pointOnSphere );
-            break;
+    // closest face centre
+    unsigned int closest = 0;
+    double minDist2 = ( faces[0].centre - pointOnSphere ).Mag2();
+    for( unsigned int uLoop = 1; uLoop < faces.size(); uLoop++ ){
+        double dist2 = ( faces[uLoop].centre - pointOnSphere ).Mag2();
+        if( dist2 < minDist2 ){
+            minDist2 = dist2;
+            closest = uLoop;
+        }
     }
+    // as TransformCoord, with the face part taken from the table
+    const IcosFace & face = faces[closest];
+    double t = face.planeD / pointOnSphere.Dot( face.zV );
+    TVector3 localP = t*pointOnSphere - face.V1;
+    TVector2 resultPosition = localP.Dot( face.xV ) * face.xA + localP.Dot( face.yV ) * face.yA + face.A1;
     return TVector2( resultPosition.X(), 2.0 * resultPosition.Y() );
 }
 
 
-// use ntuple to plot flat map
-TH2D * flatmap_ntuple(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr, double time_min, double time_max, bool in)
+FlatmapAnalysis::FlatmapAnalysis(double distance, int fibre_nr, int sub_nr, double time_min, double time_max, bool in)
+    : fDistance(distance), fTimeMin(time_min), fTimeMax(time_max), fIn(in),
+      fPMTHits(GetPMTGeometry().n_pmts,1), fFlatmap(NULL)
 {
-    // PMT info
-    RAT::Log::Init("/dev/null");
-    RAT::DB* db = RAT::DB::Get();
-    assert(db);
-    char* ratroot = getenv("RATROOT");
-    if (ratroot == static_cast<char*>(NULL)) {
-        cerr << "Environment variable $RATROOT must be set" << endl;
-        assert(ratroot);
+    SetFibre(fibre_nr,sub_nr);
+    SetTimeWindow(time_min,time_max);
+    if ( in ) SetDistWindow(0.,distance);
+    else      SetDistWindow(distance,1E30);
+}
+
+void FlatmapAnalysis::Fill(const HitRow & hit)
+{
+    bool in_distance;
+    if ( fIn ) {
+        hit.dist < fDistance ? in_distance = true : in_distance = false;
     }
-    string rat     = string(ratroot);
-    string pmtfile = rat;
-    pmtfile += "/data/pmt/airfill2.ratdb";
-    db->LoadFile(pmtfile);
-    RAT::DBLinkPtr pmtInfo = db->GetLink("PMTINFO");
-    assert(pmtInfo);
-    vector<double> xPos = pmtInfo->GetDArray("x");
-    vector<double> yPos = pmtInfo->GetDArray("y");
-    vector<double> zPos = pmtInfo->GetDArray("z");
-
-    // Loop over ntuple
-    Double_t pmt_hits[10000] = {0};
-
-    unsigned int nev = ntuple->GetEntries();
-    for (unsigned int i=0 ; i < nev ; ++i) {
-        ntuple->GetEntry(i);
-        int  fibre  = (int)ntuple->GetArgs()[0];
-        int    sub  = (int)ntuple->GetArgs()[1];
-        int    lcn  = (int)ntuple->GetArgs()[2];
-        double time = (double)ntuple->GetArgs()[3];
-        double dis  = (double)ntuple->GetArgs()[4]; 
-        bool in_distance;
-        if ( in ) {
-            dis < distance ? in_distance = true : in_distance = false;
-        }
-        else {
-            dis > distance ? in_distance = true : in_distance = false;
+    else {
+        hit.dist > fDistance ? in_distance = true : in_distance = false;
 
-        }
-        if (in_distance && fibre == fibre_nr && sub == sub_nr && time >= time_min && time < time_max) {
-            pmt_hits[lcn] += 1;
-        }
     }
+    if (in_distance && hit.time >= fTimeMin && hit.time < fTimeMax) {
+        fPMTHits[0][hit.lcn] += 1;
+    }
+}
+
+void FlatmapAnalysis::Finish()
+{
+    // PMT info, flat map coordinates are precomputed
+    const PMTGeometry & geo = GetPMTGeometry();
 
     // Make plot
     const int xbins = 300;
     const int ybins = 300;
-    TH2D *hflatmap = new TH2D("hflatmap","SNO+ flatmap",xbins, 0 , 1, ybins, 0 , 1);
-    for (unsigned int i = 0; i < 10000; i++){
-        TVector3 pmtPos(xPos[i],yPos[i],zPos[i]);
-        TVector2 icosProj = IcosProject(pmtPos);
-        int xbin = int((1-icosProj.X())*xbins);
-        int ybin = int((1-icosProj.Y())*ybins);
-        int bin = hflatmap->GetBin(xbin,ybin);
-        if(pmt_hits[i]>0){
-            //printf("Hits on PMT %d : %d\n",i,pmt_hits[i]);
-            hflatmap->SetBinContent(bin,pmt_hits[i]);
+    fFlatmap = new TH2D("hflatmap","SNO+ flatmap",xbins, 0 , 1, ybins, 0 , 1);
+    for (int i = 0; i < geo.n_pmts && i < fPMTHits.GetNumPMTs(); i++){
+        int xbin = int((1-geo.x_flat[i])*xbins);
+        int ybin = int((1-geo.y_flat[i])*ybins);
+        int bin = fFlatmap->GetBin(xbin,ybin);
+        if(fPMTHits[0][i]>0){
+            //printf("Hits on PMT %d : %d\n",i,fPMTHits[0][i]);
+            fFlatmap->SetBinContent(bin,fPMTHits[0][i]);
         }
     }
-    return hflatmap;
+}
+
+// use ntuple to plot flat map
+TH2D * flatmap_ntuple(HitReader & reader, double distance, int fibre_nr, int sub_nr, double time_min, double time_max, bool in)
+{
+    FlatmapAnalysis flatmap(distance,fibre_nr,sub_nr,time_min,time_max,in);
+    HitLoop loop(reader);
+    loop.Book(&flatmap);
+    loop.Run();
+    return flatmap.GetFlatmap();
 }
 
 
-// use ntuple to plot the time histograms
-void time_histograms(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr)
+TimeHistogramsAnalysis::TimeHistogramsAnalysis(double distance, int fibre_nr, int sub_nr)
+    : fDistance(distance), fHistos(GetPMTGeometry().n_pmts,51,-0.5,50.5)
 {
-    // Loop over ntuple
-    TH1I * histo_map[10000];
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_map[i] = NULL;
-    unsigned int nev = ntuple->GetEntries();
-    cout << "entries: " << nev << endl;
-    for (unsigned int i = 0 ; i < nev ; ++i) {
-        ntuple->GetEntry(i);
-        double dist = (double)ntuple->GetArgs()[4]; 
-        if ( dist < distance ) {
-            int    lcn  = (int)ntuple->GetArgs()[2];
-            double time = (double)ntuple->GetArgs()[3]; 
-            int  fibre  = (int)ntuple->GetArgs()[0];
-            int  sub    = (int)ntuple->GetArgs()[1];
-            if ( histo_map[lcn] == NULL ) {
-                char name[128];
-                sprintf(name,"pmt%i",lcn);
-                histo_map[lcn] = new TH1I(name,name,51,-0.5,50.5);
-                histo_map[lcn]->SetXTitle("time (ns)");
-            }
-            //cout << "Filling Histogram "<<endl;
-            //This is the line causing the bug time offset not like the old stuff
-            if ( fibre == fibre_nr && sub == sub_nr && time > 0. && time < 50. ) {
-                histo_map[lcn]->Fill(time);
-            }
-        }
+    SetFibre(fibre_nr,sub_nr);
+    SetTimeWindow(0.,50.);
+    SetDistWindow(0.,distance);
+}
+
+void TimeHistogramsAnalysis::Fill(const HitRow & hit)
+{
+    //cout << "Filling Histogram "<<endl;
+    //This is the line causing the bug time offset not like the old stuff
+    if ( hit.dist < fDistance && hit.time > 0. && hit.time < 50. ) {
+        fHistos.Fill(hit.lcn,hit.time);
     }
+}
 
+void TimeHistogramsAnalysis::Finish()
+{
     // save histograms to file (needs to open!)
     TH1D * time_summary = new TH1D("time_summary","average hit time for each PMT",
             10001,-0.5,10000.5);
@@ -267,14 +223,17 @@ void time_histograms(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr
             501,-0.5,50.5);
     time_summary->SetXTitle("LCN");
     time_summary->SetYTitle("hit_time (ns)");
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) {
-        if (histo_map[i] != NULL ) {
+    for (int i = 0 ; i < fHistos.GetSize() ; ++i ) {
+        if (fHistos.Has(i) ) {
             // if at least 30 entries, calculate mean and rms
-            //cout << "histo map " << i << " entries "<<histo_map[i]->GetEntries()<<endl;
-            if (histo_map[i]->GetEntries() > 30 ) {
-                histo_map[i]->Fit("gaus");
-                histo_map[i]->Write();
-                TF1 * f = histo_map[i]->GetFunction("gaus");
+            //cout << "histo map " << i << " entries "<<fHistos.GetEntries(i)<<endl;
+            if (fHistos.GetEntries(i) > 30 ) {
+                char name[128];
+                snprintf(name,sizeof(name),"pmt%i",i);
+                TH1I * histo = fHistos.MakeHisto<TH1I>(i,name);
+                histo->Fit("gaus");
+                histo->Write();
+                TF1 * f = histo->GetFunction("gaus");
                 assert(f);
                 double mu = f->GetParameter(1);
                 double si = f->GetParError(1);
@@ -290,149 +249,150 @@ void time_histograms(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr
     time_histo->Write();
 }
 
-double bestHitTime(double hitTime, TVector3 fibrePos,TVector3 PMTPos, TVector3 PMTDir,RAT::DU::GroupVelocity gv, RAT::DU::LightPathCalculator lp){
+// use ntuple to plot the time histograms
+void time_histograms(HitReader & reader, double distance, int fibre_nr, int sub_nr)
+{
+    cout << "entries: " << reader.GetEntries() << endl;
+    TimeHistogramsAnalysis histograms(distance,fibre_nr,sub_nr);
+    HitLoop loop(reader);
+    loop.Book(&histograms);
+    loop.Run();
+}
+
+vector<double> hitTimeCandidates(const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+                                 const RAT::DU::GroupVelocity & gv, const RAT::DU::LightPathCalculator & lp, double AVOffset){
     TVector3 orthPMTDir = PMTDir.Orthogonal();
     orthPMTDir.SetMag(1.0);
-    double bestResidual = 1000;
-    double output = -19999999;
+    vector<double> candidates;
     double localityVal = 10.0;
     double energy = lp.WavelengthToEnergy(500e-6);
     for(double rotationAngle =0; rotationAngle<360; rotationAngle++){
         for(double radius = 5; radius<134.5;radius+=10){ 
             TVector3 testPos = PMTPos+(radius*orthPMTDir*cos(rotationAngle*TMath::DegToRad()));
-            lp.CalcByPosition(fibrePos, testPos, energy, localityVal);
-            double distInWater = lp.GetDistInWater();
-            double distInInnerAV = lp.GetDistInInnerAV();
-            double distInAV = lp.GetDistInAV();
-            double timeOfFlight = gv.CalcByDistance(distInInnerAV,distInAV,distInWater,energy);
+            RAT::DU::LightPathResult path = lp.QueryByPosition(fibrePos, testPos, energy, localityVal, AVOffset);
+            AVLOC_COUNT("light path queries");
+            double timeOfFlight = gv.CalcByDistance(path.distInInnerAV,path.distInAV,path.distInWater,energy);
             //Getting PMT Bucket time
-            double angleOfEntry = lp.GetIncidentVecOnPMT().Angle(PMTDir)*TMath::RadToDeg();
+            double angleOfEntry = path.incidentVecOnPMT.Angle(PMTDir)*TMath::RadToDeg();
             timeOfFlight += gv.PMTBucketTime(angleOfEntry);
-            if(fabs(hitTime-timeOfFlight)<bestResidual){
-                bestResidual = fabs(hitTime-timeOfFlight);
-                output = timeOfFlight;
-            }
+            candidates.push_back(timeOfFlight);
+        }
+    }
+    return candidates;
+}
+
+double bestHitTime(double hitTime, const vector<double> & candidates){
+    double bestResidual = 1000;
+    double output = -19999999;
+    for(unsigned int i = 0; i < candidates.size(); i++){
+        if(fabs(hitTime-candidates[i])<bestResidual){
+            bestResidual = fabs(hitTime-candidates[i]);
+            output = candidates[i];
         }
     }
     return output;
 }
 
-void plot_offset(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr, double AVOffset)
+double bestHitTime(double hitTime, const TVector3 & fibrePos, const TVector3 & PMTPos, const TVector3 & PMTDir,
+                   const RAT::DU::GroupVelocity & gv, const RAT::DU::LightPathCalculator & lp, double AVOffset){
+    return bestHitTime(hitTime,hitTimeCandidates(fibrePos,PMTPos,PMTDir,gv,lp,AVOffset));
+}
+
+
+FibreTimeOfFlight::FibreTimeOfFlight(const TVector3 & fibrePos, const PMTInfo & pmt_info, const RAT::DU::GroupVelocity & gv,
+                                     const RAT::DU::LightPathCalculator & lp, double AVOffset)
+    : fFibrePos(fibrePos), fPMTInfo(&pmt_info), fGV(&gv), fLP(&lp), fAVOffset(AVOffset),
+      fEnergy(lp.WavelengthToEnergy(506.787e-6)),
+      fDone(pmt_info.x_pos.size(),0), fTimeOfFlight(pmt_info.x_pos.size(),0.), fBucketTime(pmt_info.x_pos.size(),0.)
+{
+}
+
+void FibreTimeOfFlight::CalculatePMT(int lcn)
+{
+    if ( !fPaths ) {
+        double localityVal = 10.0;
+        PathCache cache(*fPMTInfo,*fLP,fEnergy,localityVal);
+        fPaths = make_shared<PathBlock>(cache.GetBlock(fFibrePos,fAVOffset));
+    }
+    const CachedPath & path = fPaths->Get(lcn);
+    //Setting this for fibre 2mm infront of PMT
+    //path.distInWater = 2.0;
+    //Getting PMT Bucket time
+    fBucketTime[lcn]   = fGV->PMTBucketTime(path.angleOfEntry);
+    fTimeOfFlight[lcn] = PathTimeOfFlight(path,*fGV,fEnergy);
+    fDone[lcn] = 1;
+}
+
+const vector<double> & FibreTimeOfFlight::GetHitTimeCandidates(int lcn)
 {
-    int nBins = 200;
-    LEDInfo   led    = GetLEDInfoFromFibreNr(fibre_nr, sub_nr);
-    PMTInfo pmt_info = GetPMTpositions();
-    RAT::DU::GroupVelocity  gv = RAT::DU::Utility::Get()->GetGroupVelocity();
-    RAT::DU::LightPathCalculator lp = RAT::DU::Utility::Get()->GetLightPathCalculator();
-    lp.SetELLIEReflect(true);
-    lp.SetAVOffset(AVOffset);
+    map<int,vector<double> >::iterator it = fCandidates.find(lcn);
+    if ( it != fCandidates.end() ) return it->second;
+    TVector3 PMT_pos(fPMTInfo->x_pos[lcn],fPMTInfo->y_pos[lcn],fPMTInfo->z_pos[lcn]);
+    TVector3 PMT_dir(fPMTInfo->x_dir[lcn],fPMTInfo->y_dir[lcn],fPMTInfo->z_dir[lcn]);
+    vector<double> & candidates = fCandidates[lcn];
+    candidates = hitTimeCandidates(fFibrePos,PMT_pos,PMT_dir,*fGV,*fLP,fAVOffset);
+    return candidates;
+}
+
+
+OffsetAnalysis::OffsetAnalysis(double distance, int fibre_nr, int sub_nr, double AVOffset)
+    : fDistance(distance), fSubNr(sub_nr), fAVOffset(AVOffset), fNBins(200),
+      fLED(GetLEDInfoFromFibreNr(fibre_nr, sub_nr)), fPMTInfo(GetPMTpositions()),
+      fGV(RAT::DU::Utility::Get()->GetGroupVelocity()), fLP(RAT::DU::Utility::Get()->GetLightPathCalculator()),
+      fTOF(fLED.position,fPMTInfo,fGV,fLP,AVOffset),
+      fResiduals(fPMTInfo.x_pos.size(),51,-25.5,25.5), fResidualsPE(fPMTInfo.x_pos.size(),51,-25.5,25.5),
+      fBucketResiduals(fPMTInfo.x_pos.size(),51,-10.5,10.5), fTimesNotOffset(fPMTInfo.x_pos.size(),51,0,50)
+{
+    // the sub fibre is only used for the fibre position, hits of both sub fibres are used
+    SetFibre(fibre_nr);
+    SetTimeWindow(15.,30.);
+    SetDistWindow(0.,distance);
+    fLP.SetELLIEReflect(true);
+    // the queries on fLP start from the refractive indices it has cached
+    fLP.CacheRefractiveIndices(fLP.WavelengthToEnergy(506.787e-6));
     // effective refractive index:
     // need to get this from the database but is in data now ... hardcoded, i.e. improve!!
     cout << "Set up Light Path Calculator"<<endl;
-    PhysicsNr n_h2o; 
-    n_h2o.value = 1.3637; 
-    n_h2o.error = 0.0021;
-    // Loop over ntuple
-    TH1D * histo_map[10000];
-    TH1D * histo_mapPE[10000];
-    TH1D * pmtBucketResiduals[10000];
-    TH1I * histo_mapNotOffset[10000];
-    TH1D * distanceInAV[10000];
-    TH1D * distanceInWater[10000];
-    TH1D * distanceInScint[10000];
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_map[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_mapPE[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_mapNotOffset[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) distanceInAV[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) distanceInWater[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) distanceInScint[i] = NULL;
-    unsigned int nev = ntuple->GetEntries();
-    for (unsigned int i = 0 ; i < nev ; ++i) {
-        ntuple->GetEntry(i);
-        double dist = (double)ntuple->GetArgs()[4]; 
-        if ( dist < distance ) {
-            //cout << "GOt Entry "<<i<<endl;
-            int    lcn    = (int)ntuple->GetArgs()[2];
-            double time   = (double)ntuple->GetArgs()[3]; 
-            int    fibre  = (int)ntuple->GetArgs()[0];
-            //double peTime = (double)ntuple->GetArgs()[5];
-            //double photonTime = (double)ntuple->GetArgs()[6];
-            double peTime =0;
-            double photonTime=0;
-            //cout << "Got Args"<<endl;
-            if ( histo_map[lcn] == NULL ){
-                char name[128];
-                char namePE[128];
-                char nameNotOffset[128];
-                char nameAV[128];
-                char nameWater[128];
-                char nameScint[128];
-                char nameBucketTime[128];
-                sprintf(name,"pmt%i",lcn);
-                sprintf(nameNotOffset,"pmt no offset%i",lcn);
-                sprintf(namePE,"pmtPE%i",lcn);
-                sprintf(nameAV,"dist in AV %i",lcn);
-                sprintf(nameWater,"dist in Water %i",lcn);
-                sprintf(nameScint,"dist in Scint  %i",lcn);
-                sprintf(nameBucketTime,"Time in Bucket- calculated %i",lcn);
-                histo_map[lcn] = new TH1D(name,name,51,-25.5,25.5);
-                histo_mapPE[lcn] = new TH1D(namePE,namePE,51,-25.5,25.5);
-                pmtBucketResiduals[lcn] = new TH1D(nameBucketTime,nameBucketTime,51,-10.5,10.5);
-                histo_mapNotOffset[lcn] = new TH1I(nameNotOffset,nameNotOffset,51,0,50);
-                distanceInAV[lcn] = new TH1D(nameAV,nameAV,50,-20,200);
-                distanceInWater[lcn] = new TH1D(nameWater,nameWater,500,20,8000);
-                distanceInScint[lcn] = new TH1D(nameScint,nameScint,50,-20,200);
-                histo_map[lcn]->SetXTitle("time (ns)");
-                histo_mapPE[lcn]->SetXTitle("time (ns)");
-                pmtBucketResiduals[lcn]->SetXTitle("time (ns)");
-                histo_mapNotOffset[lcn]->SetXTitle("time (ns)");
-                distanceInAV[lcn]->SetXTitle("distance (mm)");
-                distanceInScint[lcn]->SetXTitle("distance (mm)");
-                distanceInWater[lcn]->SetXTitle("distance (mm)");
-            }
-           // cout << "Set UP histo map" <<endl;
-            if ( fibre == fibre_nr && time > 15. && time < 30. ) {
-                TVector3 PMT_pos(pmt_info.x_pos[lcn],pmt_info.y_pos[lcn],pmt_info.z_pos[lcn]);
-                TVector3 PMT_dir(pmt_info.x_dir[lcn],pmt_info.y_dir[lcn],pmt_info.z_dir[lcn]);
-                //PhysicsNr tof = TimeOfFlight(led.position, PMT_pos, n_h2o, 1.);
-                double localityVal = 10.0;
-                double energy = lp.WavelengthToEnergy(506.787e-6);
-                lp.CalcByPosition(led.position, PMT_pos, energy, localityVal);
-                double distInWater = lp.GetDistInWater();
-                double distInInnerAV = lp.GetDistInInnerAV();
-                double distInAV = lp.GetDistInAV();
-                //Setting this for fibre 2mm infront of PMT
-                //distInWater = 2.0;
-                double timeOfFlight = gv.CalcByDistance(distInInnerAV,distInAV,distInWater,energy);
-                //Getting PMT Bucket time
-                double angleOfEntry = lp.GetIncidentVecOnPMT().Angle(PMT_dir)*TMath::RadToDeg();
-                //double timeOfFlight = bestHitTime(time,led.position,PMT_pos,PMT_dir,gv,lp);
-                timeOfFlight += gv.PMTBucketTime(angleOfEntry);
-                histo_mapPE[lcn]->Fill(time-peTime);
-                histo_map[lcn]->Fill(time-timeOfFlight);
-                pmtBucketResiduals[lcn]->Fill(peTime-photonTime-gv.PMTBucketTime(angleOfEntry));
-                //cout << time << endl;
-                histo_mapNotOffset[lcn]->Fill(time);
-                /*distanceInAV[lcn]->Fill(distInAV);
-                distanceInWater[lcn]->Fill(distInWater);
-                distanceInScint[lcn]->Fill(distInInnerAV);*/
-            }
+}
+
+void OffsetAnalysis::Fill(const HitRow & hit)
+{
+    if ( hit.dist < fDistance ) {
+        int    lcn    = hit.lcn;
+        double time   = hit.time;
+        double peTime =0;
+        double photonTime=0;
+        if ( time > 15. && time < 30. ) {
+            // the expected time only depends on the PMT, so it is worked out once per PMT
+            double timeOfFlight = fTOF.GetTimeOfFlight(lcn);
+            double bucketTime   = fTOF.GetBucketTime(lcn);
+            //double timeOfFlight = bestHitTime(time,fTOF.GetHitTimeCandidates(lcn));
+            fResidualsPE.Fill(lcn,time-peTime);
+            fResiduals.Fill(lcn,time-timeOfFlight);
+            fBucketResiduals.Fill(lcn,peTime-photonTime-bucketTime);
+            //cout << time << endl;
+            fTimesNotOffset.Fill(lcn,time);
         }
     }
+}
 
+void OffsetAnalysis::Finish()
+{
+    int fibre_nr = fFibreNr;
+    int sub_nr   = fSubNr;
     // save histograms to file (needs to open!)
     TH1D * time_summary = new TH1D("time_summary","average hit time for each PMT",
             10001,-0.5,10000.5);
     TH1D * time_summary_offset  = new TH1D("time_summary_fucntionOfDistance","average hit time offset with Distance",
-            nBins,0.0,distance);
+            fNBins,0.0,fDistance);
     TH1D * time_summary_Distance  = new TH1D("time_summary_DistanceNoOffset","average hit time with Distance",
-            nBins,0.0,distance);
+            fNBins,0.0,fDistance);
     time_summary_Distance->GetYaxis()->SetRangeUser(21.0,23.5);
     char title[128];
     sprintf(title,"time distribution for reflections, fibre %i-%i",fibre_nr,sub_nr);
-    TH1D * time_histo = new TH1D("time_histo",title, nBins+1,-10.05,10.05);
-    TH1D * time_histo_PE = new TH1D("time_histo_PE",title, nBins+1,-10.05,10.05);
-    TH1D * bucketResidSummary = new TH1D("Bucket time residuals","Bucket Time Residuals",nBins+1,-10.5,10.5);
+    TH1D * time_histo = new TH1D("time_histo",title, fNBins+1,-10.05,10.05);
+    TH1D * time_histo_PE = new TH1D("time_histo_PE",title, fNBins+1,-10.05,10.05);
+    TH1D * bucketResidSummary = new TH1D("Bucket time residuals","Bucket Time Residuals",fNBins+1,-10.5,10.5);
     time_summary->SetXTitle("LCN");
     bucketResidSummary->SetXTitle("difference between actual bucket time and calculation (ns)");
     time_summary->SetYTitle("hit_time (ns)");
@@ -440,32 +400,40 @@ void plot_offset(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr, do
     time_summary_offset->SetYTitle("Residuals (ns)");
     time_summary_Distance->SetXTitle("Distance (mm)");
     time_summary_Distance->SetYTitle("Hit Time (ns)");
-    double energy = lp.WavelengthToEnergy(506.787e-6);
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) {
-        if (histo_map[i] != NULL ) {
+    double energy = fLP.WavelengthToEnergy(506.787e-6);
+    // the histograms that are only fitted are refilled into these
+    TH1D * residualsPE    = fResidualsPE.MakeScratch("pmtPE");
+    TH1D * timesNotOffset = fTimesNotOffset.MakeScratch("pmt no offset");
+    for (int i = 0 ; i < fResiduals.GetSize() ; ++i ) {
+        if (fResiduals.Has(i) ) {
             // if at least 30 entries, calculate mean and rms
-            TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
-            double dist = (PMT_pos-led.position).Mag();
-            //printf("Hits on PMT timing %d : %d\n",i,histo_map[i]->GetEntries());
-            if (histo_map[i]->GetEntries() > 30 && dist<distance) {
-                histo_map[i]->Fit("gaus");
-                histo_mapPE[i]->Fit("gaus");
-                histo_map[i]->Write();
-                histo_mapNotOffset[i]->Fit("gaus");
-                TF1 * f = histo_map[i]->GetFunction("gaus");
-                TF1 * fPE = histo_mapPE[i]->GetFunction("gaus");
-                TF1 * fNotOffset = histo_mapNotOffset[i]->GetFunction("gaus");
+            TVector3 PMT_pos(fPMTInfo.x_pos[i],fPMTInfo.y_pos[i],fPMTInfo.z_pos[i]);
+            double dist = (PMT_pos-fLED.position).Mag();
+            //printf("Hits on PMT timing %d : %d\n",i,fResiduals.GetEntries(i));
+            if (fResiduals.GetEntries(i) > 30 && dist<fDistance) {
+                char name[128];
+                snprintf(name,sizeof(name),"pmt%i",i);
+                TH1D * residuals = fResiduals.MakeHisto<TH1D>(i,name);
+                fResidualsPE.FillHisto(i,residualsPE);
+                fTimesNotOffset.FillHisto(i,timesNotOffset);
+                residuals->Fit("gaus");
+                residualsPE->Fit("gaus");
+                residuals->Write();
+                timesNotOffset->Fit("gaus");
+                TF1 * f = residuals->GetFunction("gaus");
+                TF1 * fPE = residualsPE->GetFunction("gaus");
+                TF1 * fNotOffset = timesNotOffset->GetFunction("gaus");
                 assert(f);
                 double mu = f->GetParameter(1);
                 double si = f->GetParError(1);
                 double muPE = fPE->GetParameter(1);
                 double siPE = fPE->GetParError(1);
                 double muNotOffset = fNotOffset->GetParameter(1);
-                TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
-                double dist = (PMT_pos-led.position).Mag();
+                TVector3 PMT_pos(fPMTInfo.x_pos[i],fPMTInfo.y_pos[i],fPMTInfo.z_pos[i]);
+                double dist = (PMT_pos-fLED.position).Mag();
                 double siNotOffset = fNotOffset->GetParError(1);
                 //converting distance to bins 2500mm dist cut and 100 bins
-                int binNumber = (int )(nBins*dist/distance);
+                int binNumber = (int )(fNBins*dist/fDistance);
                 printf("PMT Number: %d Hit offset: %f distance:%f  bin Number %d\n",i,mu,dist,binNumber);
                 cout << "mu: "<<muNotOffset<<" si: "<<siNotOffset<<endl;
                 time_summary_offset->SetBinContent(binNumber,mu);
@@ -490,99 +458,78 @@ void plot_offset(TNtuple * ntuple, double distance, int fibre_nr, int sub_nr, do
     time_histo_PE->SetXTitle("ns");
     time_histo->Write();
     time_histo_PE->Write();
+    delete residualsPE;
+    delete timesNotOffset;
+}
 
+void plot_offset(HitReader & reader, double distance, int fibre_nr, int sub_nr, double AVOffset)
+{
+    OffsetAnalysis offset(distance,fibre_nr,sub_nr,AVOffset);
+    HitLoop loop(reader);
+    loop.Book(&offset);
+    loop.Run();
 }
 
-//Method to iterate over all the fibres in the NTuple get hit histograms for distance bins and fit these to guassians drawing a histogram with mean offset and error
-void plotAverageHitOffset(TNtuple * ntuple, double distance){
-    RAT::DU::Utility::Get()->BeginOfRun();
-    unsigned int nBins = 100;
-    TH1D * distanceMap[nBins];
-    PMTInfo pmt_info = GetPMTpositions();
-    //cout << "Getting Group Velocity"<<endl;
-    RAT::DU::GroupVelocity  gv = RAT::DU::Utility::Get()->GetGroupVelocity();
-    //cout << "Getting LightPath Calculator"<<endl;
-    RAT::DU::LightPathCalculator lp = RAT::DU::Utility::Get()->GetLightPathCalculator();
-    lp.SetELLIEReflect(true);
+
+AverageHitOffsetAnalysis::AverageHitOffsetAnalysis(double distance)
+    : fDistance(distance), fNBins(100), fPMTInfo(GetPMTpositions()),
+      fGV(RAT::DU::Utility::Get()->GetGroupVelocity()), fLP(RAT::DU::Utility::Get()->GetLightPathCalculator()),
+      fDistanceHistos(fNBins,50,-10,10)
+{
+    SetTimeWindow(0.,50.);
+    SetDistWindow(0.,distance);
+    fLP.SetELLIEReflect(true);
+    fLP.CacheRefractiveIndices(fLP.WavelengthToEnergy(506.787e-6));
     cout << "Set up light path calculator"<<endl;
     // effective refractive index:
     // need to get this from the database but is in data now ... hardcoded, i.e. improve!!
-    TH1D * time_histo = new TH1D("time_histo_AllPMTS","time_histo_AllPMTS", 101,-10.05,10.05);
-    time_histo->SetXTitle("Offset (ns)");
-    // Loop over ntuple
-    cout << "Setting distance maps up" << endl;
-    for (unsigned int i = 0 ; i < nBins ; ++i ) distanceMap[i] = 0;
-    unsigned int nev = ntuple->GetEntries();
-    //cout << nev << endl;
-    for (unsigned int i = 0 ; i < nev ; ++i){
-        //if (i%1000 == 0 ) cout << "Got entry: "<<i<<endl;
-        ntuple->GetEntry(i);
-        double dist = (double)ntuple->GetArgs()[4]; 
-        int    lcn    = (int)ntuple->GetArgs()[2];
-        double time   = (double)ntuple->GetArgs()[3]; 
-        if(time > 0. && time < 50. && dist < distance  ){
-            int    fibre  = (int)ntuple->GetArgs()[0];
-            int sub = (int) ntuple->GetArgs()[1];
-            //Getting bin number from distance 
-            int binNum = (int)((dist/distance)*nBins);
-            if ( distanceMap[binNum] == NULL ){
-                //cout << "Setting up histo"<<endl;
-                char name[128];
-                char nameAV[128];
-                char nameWater[128];
-                char nameScint[128];
-                sprintf(name,"binNum %d",binNum);
-                distanceMap[binNum] = new TH1D(name,name,50,-10,10);
-                distanceMap[binNum]->SetXTitle("offset (ns)");
-            }
-            //cout << "Getting pmt Position"<<endl;
-            TVector3 PMT_pos(pmt_info.x_pos[lcn],pmt_info.y_pos[lcn],pmt_info.z_pos[lcn]);
-            TVector3 PMT_dir(pmt_info.x_dir[lcn],pmt_info.y_dir[lcn],pmt_info.z_dir[lcn]);
-            //cout << "Getting fibbre information" <<endl;
-            LEDInfo   led    = GetLEDInfoFromFibreNr(fibre, sub);
-            //PhysicsNr tof = TimeOfFlight(led.position, PMT_pos, n_h2o, 1.);
-            double localityVal = 10.0;
-            double energy = lp.WavelengthToEnergy(506.787e-6);
-            //cout << "Calculating by distance"<<endl;
-            lp.CalcByPosition(led.position, PMT_pos, energy, localityVal);
-            double distInWater = lp.GetDistInWater();
-            double distInInnerAV = lp.GetDistInInnerAV();
-            double distInAV = lp.GetDistInAV();
-            TVector3 directionOfEntry = lp.GetIncidentVecOnPMT();
-            double angleOfEntry = directionOfEntry.Angle(PMT_dir);
-            angleOfEntry = angleOfEntry*TMath::RadToDeg();
-            //cout << "Calculating Time of Flight bin Num: "<<binNum<<endl;
-            double timeOfFlight = gv.CalcByDistance(distInInnerAV,distInAV,distInWater,energy);
-
-
-            //ADD THIS FOR PMT TRANSITION TIME
-            timeOfFlight += gv.PMTBucketTime(angleOfEntry);
-
-
+    fTimeHisto = new TH1D("time_histo_AllPMTS","time_histo_AllPMTS", 101,-10.05,10.05);
+    fTimeHisto->SetXTitle("Offset (ns)");
+}
 
-            distanceMap[binNum]->Fill(time-timeOfFlight);
+void AverageHitOffsetAnalysis::Fill(const HitRow & hit)
+{
+    if(hit.time > 0. && hit.time < 50. && hit.dist < fDistance  ){
+        int lcn = hit.lcn;
+        //Getting bin number from distance 
+        int binNum = (int)((hit.dist/fDistance)*fNBins);
+        pair<int,int> fibre = make_pair(hit.fibre_nr,hit.fibre_sub);
+        map<pair<int,int>,FibreTimeOfFlight>::iterator tof = fTOF.find(fibre);
+        if ( tof == fTOF.end() ) {
+            const LEDInfo & led = GetLEDInfoFromFibreNr(hit.fibre_nr, hit.fibre_sub);
+            tof = fTOF.insert(make_pair(fibre,FibreTimeOfFlight(led.position,fPMTInfo,fGV,fLP,0.))).first;
         }
+        // includes the PMT transition time, worked out once per fibre and PMT
+        double timeOfFlight = tof->second.GetTimeOfFlight(lcn);
+        fDistanceHistos.Fill(binNum,hit.time-timeOfFlight);
     }
+}
+
+void AverageHitOffsetAnalysis::Finish()
+{
     cout << "Finished getting entries now doing average histogram"<<endl;
-    TH1D * time_summary_offset_Average = new TH1D("hitTimeAsFunctionOfDistanceforAllFibres","average hit time offset with Distance all Fibres",nBins,0.0,distance);
+    TH1D * time_summary_offset_Average = new TH1D("hitTimeAsFunctionOfDistanceforAllFibres","average hit time offset with Distance all Fibres",fNBins,0.0,fDistance);
     time_summary_offset_Average->SetXTitle("Distance from fibre (mm)");
     time_summary_offset_Average->SetYTitle("Hit Time (ns)");
     cout << "Set up histogram"<<endl;
     //time_summary_offset_Average->Print("ALL");
-    for (unsigned int i = 0 ; i < nBins ; ++i ) {
-        if (distanceMap[i] != NULL ) {
+    // the distance bins are only fitted, each is refilled into this
+    TH1D * distanceHisto = fDistanceHistos.MakeScratch("binNum");
+    for (unsigned int i = 0 ; i < fNBins ; ++i ) {
+        if (fDistanceHistos.Has(i) ) {
             // if at least 30 entries, calculate mean and rms
-            if (distanceMap[i]->GetEntries() > 30) {
+            if (fDistanceHistos.GetEntries(i) > 30) {
                 cout << "Fitting histogram"<<endl;
-                distanceMap[i]->Fit("gaus");
-                TF1 * f = distanceMap[i]->GetFunction("gaus");
+                fDistanceHistos.FillHisto(i,distanceHisto);
+                distanceHisto->Fit("gaus");
+                TF1 * f = distanceHisto->GetFunction("gaus");
                 assert(f);
                 double mu = f->GetParameter(1);
                 double si = f->GetParameter(2);
                 cout << "Setting bin error and values "<<i<<"   mu   "<<mu<<" si  "<<si<<endl;
                 time_summary_offset_Average->SetBinContent(i+1,mu);
                 time_summary_offset_Average->SetBinError(i+1,si);
-                time_histo->Fill(mu,1.0/(si*si));
+                fTimeHisto->Fill(mu,1.0/(si*si));
 
             }	
         }
@@ -590,121 +537,152 @@ void plotAverageHitOffset(TNtuple * ntuple, double distance){
     //time_summary_offset_Average->Print("ALL");
     cout << "Writing out histogram"<<endl;
     //time_summary_offset_Average->SetDirectory(gDirectory->pwd());
-    time_histo->Fit("gaus");
-    time_histo->Write();
+    fTimeHisto->Fit("gaus");
+    fTimeHisto->Write();
     time_summary_offset_Average->Write();
+    delete distanceHisto;
+}
+
+
+//Method to iterate over all the fibres in the NTuple get hit histograms for distance bins and fit these to guassians drawing a histogram with mean offset and error
+void plotAverageHitOffset(HitReader & reader, double distance){
+    RAT::DU::Utility::Get()->BeginOfRun();
+    AverageHitOffsetAnalysis average(distance);
+    HitLoop loop(reader);
+    loop.Book(&average);
+    loop.Run();
 }
 
 
+HitTimeMomentsAnalysis::HitTimeMomentsAnalysis(double distance, int fibre_nr, int num_pmts)
+    : fDistance(distance), fMoments(num_pmts,kNumArrays)
+{
+    // hits of both sub fibres are used
+    SetFibre(fibre_nr);
+    SetTimeWindow(0.,50.);
+    SetDistWindow(0.,distance);
+}
 
+void HitTimeMomentsAnalysis::Fill(const HitRow & hit)
+{
+    if ( hit.dist < fDistance && hit.time > 0. && hit.time < 50. && hit.lcn < fMoments.GetNumPMTs() ) {
+        // running (Welford) moments, as for the bucketed hits of the fits
+        double & n    = fMoments[kNumHits][hit.lcn];
+        double & mean = fMoments[kMean][hit.lcn];
+        n += 1;
+        double delta = hit.time - mean;
+        mean += delta/n;
+        fMoments[kM2][hit.lcn] += delta*(hit.time - mean);
+    }
+}
 
+bool HitTimeMomentsAnalysis::GetHitTime(int lcn, double & mean, double & error) const
+{
+    double n = fMoments[kNumHits][lcn];
+    if ( n < 2 ) return false;
+    mean  = fMoments[kMean][lcn];
+    error = sqrt(fMoments[kM2][lcn]/(n-1)/n);
+    return true;
+}
 
-void plotAVFlightDifference(TNtuple * ntuple1, TNtuple * ntuple2 ,double distance, int fibre_nr, int sub_nr)
+void compareOffsets(const vector<string> & ntuple_filenames, const vector<double> & offsets, PMTInfo & pmt_info,
+                    double distance, int fibre_nr, int sub_nr, int numThreads)
 {
-    int nBins = 200;
-    LEDInfo   led    = GetLEDInfoFromFibreNr(fibre_nr, sub_nr);
-    PMTInfo pmt_info = GetPMTpositions();
-    // effective refractive index:
-    // need to get this from the database but is in data now ... hardcoded, i.e. improve!!
-    // Loop over ntuple
-    //Stores Difference of Ntuples
-    TH1I * histo_map[10000];
-    //Stores the values of hit times from both ntuples
-    TH1I * histo_map1[10000];
-    TH1I * histo_map2[10000];
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_map1[i] = NULL;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) histo_map2[i] = NULL;
-    unsigned int nev = ntuple1->GetEntries();
-    unsigned int nev2 = ntuple2->GetEntries();
-    //Cutting off excess entries
-    if(nev2<nev) nev=nev2;
-    for (unsigned int i = 0 ; i < nev ; ++i) {
-        ntuple1->GetEntry(i);
-        double dist = (double)ntuple1->GetArgs()[4]; 
-        double dist2 = (double)ntuple2->GetArgs()[4]; 
-        if ( dist < distance ) {
-            //cout << "GOt Entry "<<i<<endl;
-            int    lcn    = (int)ntuple1->GetArgs()[2];
-            double time   = (double)ntuple1->GetArgs()[3]; 
-            int    fibre  = (int)ntuple1->GetArgs()[0];
-            double peTime = (double)ntuple1->GetArgs()[5];
-            //cout << "Got Args"<<endl;
-            if ( histo_map1[lcn] == NULL ){
-                char name[128];
-                sprintf(name,"Newpmt%i",lcn);
-                histo_map1[lcn] = new TH1I(name,name,51,0,50);
-                histo_map1[lcn]->SetXTitle("time (ns)");
+    assert(ntuple_filenames.size() == offsets.size());
+    assert(ntuple_filenames.size() > 1);
+    int nFiles   = ntuple_filenames.size();
+    int nPMTs    = pmt_info.x_pos.size();
+    int nBins    = 200;
+    // fibre positions from the database are looked up before the threads start
+    const LEDInfo & led = GetLEDInfoFromFibreNr(fibre_nr, sub_nr);
+    vector<HitTimeMomentsAnalysis> moments(nFiles,HitTimeMomentsAnalysis(distance,fibre_nr,nPMTs));
+    vector<char> done(nFiles,0);
+    // one file per thread, each with its own file, reader and loop, filling its own moments
+    TDirectory * directory = gDirectory;
+    if ( numThreads > 1 ) ROOT::EnableThreadSafety();
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (int k = next++ ; k < nFiles ; k = next++) {
+            TFile file(ntuple_filenames[k].c_str(),"READ");
+            if ( !file.IsOpen() ) {
+                cerr << "AVLocPlot::compareOffsets : could not open " << ntuple_filenames[k] << endl;
+                continue;
             }
-           // cout << "Set UP histo map" <<endl;
-            if ( fibre == fibre_nr && time > 0. && time < 50. ) {
-                histo_map1[lcn]->Fill(time);
+            HitReader reader(&file,pmt_info);
+            if ( !reader.IsValid() ) {
+                cerr << "AVLocPlot::compareOffsets : no hits in " << ntuple_filenames[k] << endl;
+                continue;
             }
+            HitLoop loop(reader);
+            loop.Book(&moments[k]);
+            loop.Run();
+            done[k] = 1;
         }
+    };
+    vector<thread> threads;
+    for (int t = 1 ; t < min(numThreads,nFiles) ; ++t) threads.push_back(thread(worker));
+    worker();
+    for (unsigned int t = 0 ; t < threads.size() ; ++t) threads[t].join();
+    directory->cd();
+    if ( !done[0] ) {
+        cerr << "AVLocPlot::compareOffsets : the reference file " << ntuple_filenames[0] << " could not be read" << endl;
+        return;
     }
 
-    nev = ntuple2->GetEntries();
-    for (unsigned int i = 0 ; i < nev ; ++i) {
-        ntuple2->GetEntry(i);
-        double dist = (double)ntuple2->GetArgs()[4]; 
-        if ( dist < distance ) {
-            //cout << "GOt Entry "<<i<<endl;
-            int    lcn    = (int)ntuple2->GetArgs()[2];
-            double time   = (double)ntuple2->GetArgs()[3]; 
-            int    fibre  = (int)ntuple2->GetArgs()[0];
-            double peTime = (double)ntuple2->GetArgs()[5];
-            //cout << "Got Args"<<endl;
-            if ( histo_map2[lcn] == NULL ){
-                char name[128];
-                sprintf(name,"2ndpmt%i",lcn);
-                histo_map2[lcn] = new TH1I(name,name,51,0,50);
-                histo_map2[lcn]->SetXTitle("time (ns)");
-            }
-           // cout << "Set UP histo map" <<endl;
-            if ( fibre == fibre_nr && time > 0. && time < 50. ) {
-                histo_map2[lcn]->Fill(time);
-            }
-        }
+    // time shift of each PMT and file w.r.t. the first file, for PMTs with more than 30 hits in both
+    TH2D * time_shift = new TH2D("time_shift","hit time shift w.r.t. the first offset",
+            nPMTs,-0.5,nPMTs-0.5,nFiles,-0.5,nFiles-0.5);
+    TH2D * time_shift_distance = new TH2D("time_shift_distance","average hit time shift with distance",
+            nBins,0.0,distance,nFiles,-0.5,nFiles-0.5);
+    time_shift->SetXTitle("LCN");
+    time_shift->SetYTitle("AV offset (mm)");
+    time_shift_distance->SetXTitle("Distance (mm)");
+    time_shift_distance->SetYTitle("AV offset (mm)");
+    for (int k = 0 ; k < nFiles ; ++k) {
+        char label[32];
+        snprintf(label,sizeof(label),"%.1f",offsets[k]);
+        time_shift->GetYaxis()->SetBinLabel(k+1,label);
+        time_shift_distance->GetYaxis()->SetBinLabel(k+1,label);
     }
-    cout << "Got the ntuples"<<endl;
-    // save histograms to file (needs to open!)
-    char title[128];
-    TH1D * time_summary_offset  = new TH1D("time_summaryDifferenceBetween unshifted and shifted","average hit time offset with Distance",
-            nBins,0.0,distance);
-    time_summary_offset->SetXTitle("Distance (mm)");
-    time_summary_offset->SetYTitle("Hit Time No Offset - Hit Time offset (ns)");
-    //Subtracting the histograms
-    for(unsigned int i=0; i<10000; i++){ 
-        if(histo_map1[i]==NULL || histo_map2[i]==NULL){
-            histo_map1[i]=NULL;
-            histo_map2[i]=NULL;
-            continue;
+    TGraphErrors * shift_vs_offset = new TGraphErrors(nFiles);
+    shift_vs_offset->SetName("time_shift_vs_offset");
+    shift_vs_offset->SetTitle("average hit time shift w.r.t. the first offset;AV offset (mm);time shift (ns)");
+    for (int k = 0 ; k < nFiles ; ++k) {
+        vector<double> sumW(nBins,0.), sumWShift(nBins,0.);
+        double totalW = 0, totalWShift = 0;
+        for (int i = 0 ; done[k] && i < nPMTs ; ++i) {
+            if ( moments[0].GetNumHits(i) <= 30 || moments[k].GetNumHits(i) <= 30 ) continue;
+            TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
+            double dist = (PMT_pos-led.position).Mag();
+            double mean0, error0, mean, error;
+            moments[0].GetHitTime(i,mean0,error0);
+            moments[k].GetHitTime(i,mean,error);
+            double shift = mean - mean0;
+            double shiftError = sqrt(error*error + error0*error0);
+            time_shift->SetBinContent(i+1,k+1,shift);
+            time_shift->SetBinError(i+1,k+1,shiftError);
+            if ( shiftError <= 0. ) continue;
+            double w = 1./(shiftError*shiftError);
+            int bin = (int)(nBins*dist/distance);
+            if ( bin >= 0 && bin < nBins ) {
+                sumW[bin] += w;
+                sumWShift[bin] += w*shift;
+            }
+            totalW += w;
+            totalWShift += w*shift;
         }
-        histo_map1[i]->Add(histo_map2[i],-1);
-    }
-    cout << "Added the PMT Histograms"<<endl;
-    for (unsigned int i = 0 ; i < 10000 ; ++i ) {
-        if (histo_map[i] != NULL ) {
-            cout << "Not NULL"<<endl;
-            // if at least 30 entries, calculate mean and rms
-            if (histo_map1[i]->GetEntries() > 30) {
-                cout << "Fitting histogram for pmt; "<<i << endl;
-                histo_map1[i]->Fit("gaus");
-                cout << "Fitted histogram for pmt; "<<i << endl;
-                TF1 * f = histo_map1[i]->GetFunction("gaus");
-                assert(f);
-                double mu = f->GetParameter(1);
-                double si = f->GetParameter(2);
-                TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
-                double dist = (PMT_pos-led.position).Mag();
-                //converting distance to bins 2500mm dist cut and 100 bins
-                int binNumber = (int )(nBins*dist/distance);
-                printf("bin Number %d\n",binNumber);
-                time_summary_offset->SetBinContent(binNumber,mu);
-                time_summary_offset->SetBinError(binNumber,si);
-            }	
+        for (int bin = 0 ; bin < nBins ; ++bin) {
+            if ( sumW[bin] <= 0. ) continue;
+            time_shift_distance->SetBinContent(bin+1,k+1,sumWShift[bin]/sumW[bin]);
+            time_shift_distance->SetBinError(bin+1,k+1,1./sqrt(sumW[bin]));
         }
+        shift_vs_offset->SetPoint(k,offsets[k],totalW > 0. ? totalWShift/totalW : 0.);
+        shift_vs_offset->SetPointError(k,0.,totalW > 0. ? 1./sqrt(totalW) : 0.);
+        cout << "AV offset " << offsets[k] << " mm: mean hit time shift "
+             << (totalW > 0. ? totalWShift/totalW : 0.) << " ns" << endl;
     }
-    cout << "Writing out offset histograms now" << endl;
-    time_summary_offset->Write();
+    cout << "Writing out offset comparison" << endl;
+    time_shift->Write();
+    time_shift_distance->Write();
+    shift_vs_offset->Write();
 }
-
@@ -31,68 +31,62 @@ bool ProcessEventBasic(RAT::DS::Entry * rDS)
   return true;
 }
 
-// process event and fill the avproc ntuple
-bool ProcessEventNtuple(RAT::DS::Entry * rDS, TNtuple * ntuple, 
-			LEDInfo & led_info, PMTInfo & pmt_info)
+NtupleProcessor::NtupleProcessor()
 {
-  double GTTriggerDelay = RAT::DB::Get()->GetLink("DAQ")->GetD("gtriggerdelay");	
-  for( int iEV = 0; iEV < rDS->GetEVCount(); ++iEV) {
-    RAT::DS::EV& rEV = rDS->GetEV(iEV);
+  fGTTriggerDelay = RAT::DB::Get()->GetLink("DAQ")->GetD("gtriggerdelay");
+}
+
+NtupleProcessor::NtupleProcessor(double GTTriggerDelay)
+  : fGTTriggerDelay(GTTriggerDelay)
+{
+}
+
+// process event and fill the avloc hits
+bool NtupleProcessor::ProcessEvent(RAT::DS::Entry & rDS, HitBuffer & hits) const
+{
+  //printf("Trigger Delay %f\n",fGTTriggerDelay);
+  double EVoffset = 500 - fGTTriggerDelay- 100; 
+  EVoffset = 0;
+  for( int iEV = 0; iEV < rDS.GetEVCount(); ++iEV) {
+    RAT::DS::EV& rEV = rDS.GetEV(iEV);
     RAT::DS::CalPMTs& pmtList  = rEV.GetCalPMTs();
     for( int ipmt = 0; ipmt < pmtList.GetCount(); ipmt++) {
-      int PMTID = pmtList.GetPMT(ipmt).GetID();
-      TVector3 dist(pmt_info.x_pos[PMTID],pmt_info.y_pos[PMTID],pmt_info.z_pos[PMTID]);
-      //printf("pmt position %f %f %f\n",dist.X(),dist.Y(),dist.Z());
-      //printf("led X:%f ledy:%f ledz:%f\n",led_info.position.X(),led_info.position.Y(),led_info.position.Z());
-      dist -= led_info.position;
-      //printf("difference %f %f %f\n",dist.X(),dist.Y(),dist.Z());
-      //printf("Trigger Delay %f\n",GTTriggerDelay);
-      double EVoffset = 500 - GTTriggerDelay- 100; 
-      EVoffset = 0;
-      //cout << "HIT TAC: "<<pmtList.GetPMT(ipmt).GetTime()<<endl;
+      const RAT::DS::PMTCal& pmt = pmtList.GetPMT(ipmt);
+      //cout << "HIT TAC: "<<pmt.GetTime()<<endl;
       //printf("Universal time %f Universal Time Days %u Universal Time Seconds %u  Clock Ticks:%llu EVOffset %f\n",rEV.GetUniversalTime().GetNanoSeconds(),rEV.GetUniversalTime().GetDays(),rEV.GetUniversalTime().GetSeconds(),rEV.GetClockCount50(),EVoffset);
-      Double_t PMTTime = pmtList.GetPMT(ipmt).GetTime()-EVoffset;
+      Double_t PMTTime = pmt.GetTime()-EVoffset;
       //cout << "PMT TIME: "<<PMTTime<<endl;
       if(PMTTime>-400){
-          ntuple->Fill(led_info.nr,led_info.sub,PMTID,PMTTime,dist.Mag());
+          hits.Fill(pmt.GetID(),PMTTime);
       }
     }
   }
   return true;
 }
 
-// process event and fill the avproc ntuple
-bool ProcessEventNtupleMC(RAT::DS::Entry * rDS, TNtuple * ntuple, 
-			LEDInfo & led_info, PMTInfo & pmt_info)
+// process event and fill the avloc hits
+bool NtupleProcessor::ProcessEventMC(RAT::DS::Entry & rDS, HitBuffer & hits) const
 {
-  double GTTriggerDelay = RAT::DB::Get()->GetLink("DAQ")->GetD("gtriggerdelay");	
-  int detectorEventCount = rDS->GetEVCount(); 
-  RAT::DS::MC mc = rDS->GetMC();
+  int detectorEventCount = rDS.GetEVCount(); 
   if(detectorEventCount > 1){
       cout << "More than one detector event in tellie flash cutting" << endl;
       return true;
   };
   for( int iEV = 0; iEV < detectorEventCount; ++iEV) {
-    RAT::DS::EV& rEV = rDS->GetEV(iEV);
+    RAT::DS::EV& rEV = rDS.GetEV(iEV);
     RAT::DS::CalPMTs& pmtList  = rEV.GetCalPMTs();
+    // the offset to the MC trigger time is the same for all hits of the event
+    double gtTime = rDS.GetMCEV(iEV).GetGTTime();
+    double EVoffset = 500 - fGTTriggerDelay - gtTime; 
+    //cout << "EVoffset: "<<EVoffset<<endl;
     for( int ipmt = 0; ipmt < pmtList.GetCount(); ++ipmt) {
-      int PMTID = pmtList.GetPMT(ipmt).GetID();
-      TVector3 dist(pmt_info.x_pos[PMTID],pmt_info.y_pos[PMTID],pmt_info.z_pos[PMTID]);
-      //printf("pmt position %f %f %f\n",dist.X(),dist.Y(),dist.Z());
-      //printf("led X:%f ledy:%f ledz:%f\n",led_info.position.X(),led_info.position.Y(),led_info.position.Z());
-      dist -= led_info.position;
-      //printf("difference %f %f %f\n",dist.X(),dist.Y(),dist.Z());
-      RAT::DS::MCEV  mcEV = rDS->GetMCEV(iEV);
-      double gtTime = mcEV.GetGTTime();
-      //printf("Trigger Delay %f\n",GTTriggerDelay);
-      double EVoffset = 500 - GTTriggerDelay - gtTime; 
-      //cout << "EVoffset: "<<EVoffset<<endl;
+      const RAT::DS::PMTCal& pmt = pmtList.GetPMT(ipmt);
       //printf("Universal time %f Universal Time Days %u Universal Time Seconds %u  Clock Ticks:%llu EVOffset %f\n",rEV.GetUniversalTime().GetNanoSeconds(),rEV.GetUniversalTime().GetDays(),rEV.GetUniversalTime().GetSeconds(),rEV.GetClockCount50(),EVoffset);
-      Double_t PMTTime = pmtList.GetPMT(ipmt).GetTime()-EVoffset;
-      //RAT::DS::MCPMT mcPMT = GetMCPMT(PMTID,mc);
+      Double_t PMTTime = pmt.GetTime()-EVoffset;
+      //RAT::DS::MCPMT mcPMT = GetMCPMT(pmt.GetID(),rDS.GetMC());
       //int numPE = mcPMT.GetMCPECount();
       //if(numPE>1) continue;
-      ntuple->Fill(led_info.nr,led_info.sub,PMTID,PMTTime,dist.Mag());
+      hits.Fill(pmt.GetID(),PMTTime);
     }
   }
   return true;
@@ -0,0 +1,90 @@
+//
+// Stage timers and counters for AV location
+//
+#include "include/AVLocStats.h"
+
+#ifdef AVLOC_STATS
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// registered entries, never destroyed so entries can still be updated during exit
+static mutex & GetStatsMutex()
+{
+  static mutex * m = new mutex;
+  return *m;
+}
+
+static vector<StatsEntry*> & GetStatsEntries()
+{
+  static vector<StatsEntry*> * entries = new vector<StatsEntry*>;
+  return *entries;
+}
+
+StatsEntry::StatsEntry(const char * name, bool timer)
+  : fName(name), fCount(0), fNanoseconds(0), fTimer(timer)
+{
+  lock_guard<mutex> lock(GetStatsMutex());
+  GetStatsEntries().push_back(this);
+}
+
+struct StatsSum {
+  bool   timer;
+  long   count;
+  double seconds;
+};
+
+// entries with the same name summed
+static map<string,StatsSum> SumStats()
+{
+  map<string,StatsSum> sums;
+  lock_guard<mutex> lock(GetStatsMutex());
+  const vector<StatsEntry*> & entries = GetStatsEntries();
+  for (unsigned int i = 0 ; i < entries.size() ; ++i) {
+    StatsSum & sum = sums[entries[i]->GetName()];
+    sum.timer    = sum.timer || entries[i]->IsTimer();
+    sum.count   += entries[i]->GetCount();
+    sum.seconds += 1E-9*entries[i]->GetNanoseconds();
+  }
+  return sums;
+}
+
+void PrintStats()
+{
+  map<string,StatsSum> sums = SumStats();
+  cout << "AVLocStats : stage timers and counters" << endl;
+  for (map<string,StatsSum>::const_iterator it = sums.begin() ; it != sums.end() ; ++it) {
+    if ( it->second.timer ) {
+      printf("  %-36s %12ld calls %12.3f s\n",it->first.c_str(),it->second.count,it->second.seconds);
+    }
+    else {
+      printf("  %-36s %12ld\n",it->first.c_str(),it->second.count);
+    }
+  }
+}
+
+bool WriteStats(const string & filename)
+{
+  ofstream out(filename.c_str());
+  if ( !out ) {
+    cerr << "AVLocStats::WriteStats : could not open " << filename << endl;
+    return false;
+  }
+  map<string,StatsSum> sums = SumStats();
+  out << "# name\tcount\tseconds" << endl;
+  for (map<string,StatsSum>::const_iterator it = sums.begin() ; it != sums.end() ; ++it) {
+    out << it->first << "\t" << it->second.count << "\t";
+    if ( it->second.timer ) out << it->second.seconds;
+    else                    out << "-";
+    out << endl;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,176 @@
+//
+// Tabulated time of flight for AV location fits
+//
+#include <assert.h>
+#include <cmath>
+#include <iostream>
+
+#include <TMath.h>
+#include <TTree.h>
+#include <TVector3.h>
+
+#include "include/AVLocPathCache.h"
+#include "include/AVLocStats.h"
+#include "include/AVLocTOFTable.h"
+
+using namespace std;
+
+double CalcTimeOfFlight(LEDInfo & led, PMTInfo & pmt_info, int lcn, double AVOffset,
+			const RAT::DU::LightPathCalculator & lp, RAT::DU::GroupVelocity & gv,
+			double * dTdOffset, const GroupVelocityTable * vgroup)
+{
+  TVector3 PMT_pos(pmt_info.x_pos[lcn],pmt_info.y_pos[lcn],pmt_info.z_pos[lcn]);
+  TVector3 PMT_dir(pmt_info.x_dir[lcn],pmt_info.y_dir[lcn],pmt_info.z_dir[lcn]);
+  double localityVal = 10;
+  double energy = lp.WavelengthToEnergy(506.787e-6);
+  CachedPath path = CalcPath(led.position, PMT_pos, PMT_dir, lp, energy, localityVal, AVOffset);
+  return PathTimeOfFlight(path, gv, energy, dTdOffset, vgroup);
+}
+
+TOFTable BuildTOFTable(LEDInfo & led, PMTInfo & pmt_info, double distance,
+		       double offset_min, double offset_max, int n_offsets,
+		       const RAT::DU::LightPathCalculator & lp, RAT::DU::GroupVelocity & gv,
+		       const GroupVelocityTable * vgroup)
+{
+  assert(n_offsets > 1);
+  assert(offset_max > offset_min);
+  AVLOC_TIMER("BuildTOFTable");
+  TOFTable table;
+  table.fibre_nr    = led.nr;
+  table.fibre_sub   = led.sub;
+  table.offset_min  = offset_min;
+  table.offset_step = (offset_max-offset_min)/(n_offsets-1);
+  table.n_offsets   = n_offsets;
+  table.spectrum    = vgroup ? 1 : 0;
+  int numPMTS = pmt_info.x_pos.size();
+  table.row.assign(numPMTS,-1);
+  // with a path cache directory the paths of each grid point are read from and kept there,
+  // the group velocities are applied afterwards so both models share the same paths
+  double energy = lp.WavelengthToEnergy(506.787e-6);
+  // the paths start from the refractive indices cached in the calculator, a caller
+  // which cached another energy (or none) gets them cached in a copy
+  RAT::DU::LightPathCalculator cached;
+  const RAT::DU::LightPathCalculator * table_lp = &lp;
+  if ( lp.GetRICacheEnergy() != energy ) {
+    cached = lp;
+    cached.CacheRefractiveIndices(energy);
+    table_lp = &cached;
+  }
+  vector<PathBlock> blocks;
+  if ( !GetPathCacheDir().empty() ) {
+    PathCache cache(pmt_info,*table_lp,energy,10);
+    for (int k = 0 ; k < n_offsets ; ++k) blocks.push_back(cache.GetBlock(led.position,offset_min + k*table.offset_step));
+  }
+  for (int i = 0 ; i < numPMTS ; ++i) {
+    TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
+    if ( (PMT_pos-led.position).Mag() >= distance ) continue;
+    table.row[i] = table.lcn.size();
+    table.lcn.push_back(i);
+    for (int k = 0 ; k < n_offsets ; ++k) {
+      double offset = offset_min + k*table.offset_step;
+      if ( blocks.empty() ) table.tof.push_back(CalcTimeOfFlight(led,pmt_info,i,offset,*table_lp,gv,NULL,vgroup));
+      else                  table.tof.push_back(PathTimeOfFlight(blocks[k].Get(i),gv,energy,NULL,vgroup));
+    }
+  }
+  return table;
+}
+
+double InterpolateTOF(const TOFTable & table, int lcn, double AVOffset, double * dTdOffset)
+{
+  int row = lcn < (int)table.row.size() ? table.row[lcn] : -1;
+  if ( row < 0 ) {
+    cerr << "AVLocTOFTable::InterpolateTOF : LCN " << lcn << " not tabulated" << endl;
+    if ( dTdOffset ) *dTdOffset = 0.;
+    return 0.;
+  }
+  // linear interpolation, extrapolating from the outer intervals outside the grid
+  double x = (AVOffset-table.offset_min)/table.offset_step;
+  int k = (int)floor(x);
+  if      ( k < 0 )                   k = 0;
+  else if ( k > table.n_offsets - 2 ) k = table.n_offsets - 2;
+  const float * t = &table.tof[row*table.n_offsets];
+  if ( dTdOffset ) *dTdOffset = (t[k+1]-t[k])/table.offset_step;
+  return t[k] + (x-k)*(t[k+1]-t[k]);
+}
+
+void WriteTOFTable(TFile * file, TOFTable & table)
+{
+  file->cd();
+  TTree * tree = (TTree*)file->Get("toftable");
+  vector<int>   * lcn = &table.lcn;
+  vector<float> * tof = &table.tof;
+  if ( tree == NULL ) {
+    tree = new TTree("toftable","time of flight per fibre, LCN and AV offset");
+    tree->Branch("fibre_nr",&table.fibre_nr,"fibre_nr/I");
+    tree->Branch("fibre_sub",&table.fibre_sub,"fibre_sub/I");
+    tree->Branch("offset_min",&table.offset_min,"offset_min/D");
+    tree->Branch("offset_step",&table.offset_step,"offset_step/D");
+    tree->Branch("n_offsets",&table.n_offsets,"n_offsets/I");
+    tree->Branch("spectrum",&table.spectrum,"spectrum/I");
+    tree->Branch("lcn",&lcn);
+    tree->Branch("tof",&tof);
+  }
+  else {
+    // tables without the spectrum flag are read back as single wavelength tables
+    if ( tree->GetBranch("spectrum") == NULL && table.spectrum != 0 ) {
+      cerr << "AVLocTOFTable::WriteTOFTable : table file has no spectrum flag, not adding spectrum averaged table" << endl;
+      return;
+    }
+    tree->SetBranchAddress("fibre_nr",&table.fibre_nr);
+    tree->SetBranchAddress("fibre_sub",&table.fibre_sub);
+    tree->SetBranchAddress("offset_min",&table.offset_min);
+    tree->SetBranchAddress("offset_step",&table.offset_step);
+    tree->SetBranchAddress("n_offsets",&table.n_offsets);
+    if ( tree->GetBranch("spectrum") ) tree->SetBranchAddress("spectrum",&table.spectrum);
+    tree->SetBranchAddress("lcn",&lcn);
+    tree->SetBranchAddress("tof",&tof);
+  }
+  tree->Fill();
+  tree->Write("",TObject::kOverwrite);
+  tree->ResetBranchAddresses();
+}
+
+bool ReadTOFTable(TFile * file, int fibre_nr, int fibre_sub,
+		  double offset_min, double offset_max, int n_offsets, TOFTable & table,
+		  int spectrum)
+{
+  TTree * tree = (TTree*)file->Get("toftable");
+  if ( tree == NULL ) return false;
+  TOFTable entry;
+  vector<int>   * lcn = NULL;
+  vector<float> * tof = NULL;
+  tree->SetBranchAddress("fibre_nr",&entry.fibre_nr);
+  tree->SetBranchAddress("fibre_sub",&entry.fibre_sub);
+  tree->SetBranchAddress("offset_min",&entry.offset_min);
+  tree->SetBranchAddress("offset_step",&entry.offset_step);
+  tree->SetBranchAddress("n_offsets",&entry.n_offsets);
+  // files written before the spectrum flag only hold single wavelength tables
+  entry.spectrum = 0;
+  if ( tree->GetBranch("spectrum") ) tree->SetBranchAddress("spectrum",&entry.spectrum);
+  tree->SetBranchAddress("lcn",&lcn);
+  tree->SetBranchAddress("tof",&tof);
+  double offset_step = (offset_max-offset_min)/(n_offsets-1);
+  bool found = false;
+  for (Long64_t i = 0 ; i < tree->GetEntries() && !found ; ++i) {
+    tree->GetEntry(i);
+    if ( entry.fibre_nr != fibre_nr || entry.fibre_sub != fibre_sub || entry.spectrum != spectrum ) continue;
+    if ( entry.n_offsets != n_offsets ||
+	 !TMath::AreEqualAbs(entry.offset_min,offset_min,1E-6) ||
+	 !TMath::AreEqualAbs(entry.offset_step,offset_step,1E-6) ) continue;
+    found = true;
+  }
+  if ( found ) {
+    table = entry;
+    table.lcn = *lcn;
+    table.tof = *tof;
+    // rebuild the LCN -> row lookup
+    int maxLCN = 0;
+    for (unsigned int i = 0 ; i < table.lcn.size() ; ++i) maxLCN = max(maxLCN,table.lcn[i]);
+    table.row.assign(maxLCN+1,-1);
+    for (unsigned int i = 0 ; i < table.lcn.size() ; ++i) table.row[table.lcn[i]] = i;
+  }
+  tree->ResetBranchAddresses();
+  delete lcn;
+  delete tof;
+  return found;
+}
@@ -4,6 +4,7 @@
 //
 #include <assert.h>
 #include <iostream>
+#include <mutex>
 
 #include <TFile.h>
 #include <TNtuple.h>
@@ -16,16 +17,40 @@
 #include <RAT/DB.hh>
 
 #include "include/AVLocTools.h"
+#include "include/AVLocGeometry.h"
+static LEDInfo * LoadLEDInfo(string fibre_name);
+
+// branches of the "ds" entry which NtupleProcessor never reads, the MC truth
+// (particles, tracks, MC PMTs and photoelectrons) being by far the largest.
+// Patterns which are not in a file are skipped, only the MC event (GT time)
+// and the calibrated PMTs have to stay on
+static const char * kUnusedBranches[] = {
+  "mc", "mc.*", "evs.uncalPMTs*", "evs.partialCalPMTs*", "evs.fitResults*",
+  "evs.classifierResults*", "evs.digitiser*", "calib*", "headerInfo*", NULL
+};
+
 // function to load a root file
-void LoadRootFile(string filename, TTree **tree, RAT::DS::Entry **rDS, RAT::DS::Run **rRun)
+void LoadRootFile(string filename, TTree **tree, RAT::DS::Entry **rDS, RAT::DS::Run **rRun,
+		  bool hitsOnly, Long64_t cacheSize)
 {
   TFile *file = new TFile(filename.data());
   (*tree) = (TTree*)file->Get( "T" );
   TTree *runTree = (TTree*)file->Get("runT");
   assert(runTree);
   *rDS = new RAT::DS::Entry();
+  if ( hitsOnly ) {
+    for (int i = 0 ; kUnusedBranches[i] != NULL ; ++i) {
+      UInt_t found = 0;
+      (*tree)->SetBranchStatus(kUnusedBranches[i],0,&found);
+    }
+  }
   (*tree)->SetBranchAddress( "ds", &(*rDS) );
   assert(rDS);
+  // the cache learns the active branches from the first entries
+  if ( cacheSize > 0 ) {
+    (*tree)->SetCacheSize(cacheSize);
+    (*tree)->SetCacheLearnEntries(10);
+  }
   *rRun = new RAT::DS::Run();
   assert(rRun);
   runTree->SetBranchAddress( "run", &(*rRun) );
@@ -49,47 +74,11 @@ void LoadDataBase(string logname)
 }
 
 PMTInfo GetPMTpositions(void) {
-  cout << "Loading PMT positions" << endl;
-  //const double offset = 56.7; // difference front PMT and bucket in mm
-  const double offset = 0.0;
-  RAT::DB* db = RAT::DB::Get();
-  assert(db);
-  char* ratroot = getenv("RATROOT");
-  if (ratroot == static_cast<char*>(NULL)) {
-      cerr << "Environment variable $RATROOT must be set" << endl;
-      assert(ratroot);
-  }
-  string rat     = string(ratroot);
-    string pmtfile = rat;
-  pmtfile += "/data/pmt/airfill2.ratdb";
-  db->LoadFile(pmtfile);
-  RAT::DBLinkPtr pmtInfo = db->GetLink("PMTINFO");
-  assert(pmtInfo);
-  PMTInfo pmt_info;
-  cout << "Getting Arrays" << endl;
-  pmt_info.x_pos = pmtInfo->GetDArray("x");
-  pmt_info.y_pos = pmtInfo->GetDArray("y");
-  pmt_info.z_pos = pmtInfo->GetDArray("z");
-  cout << "Got Position arrays" << endl;
-  pmt_info.x_dir = pmtInfo->GetDArray("v");
-  pmt_info.y_dir = pmtInfo->GetDArray("u");
-  pmt_info.z_dir = pmtInfo->GetDArray("w");
-  cout << "Obtained ARRAYS" << endl;
-  for ( unsigned int i = 0 ; i < pmt_info.x_dir.size() ; ++i ) {
-    TVector3 pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
-    TVector3 dir(pmt_info.x_dir[i],pmt_info.y_dir[i],pmt_info.z_dir[i]);
-    //cerr << pos.Mag() << " -> "; 
-    pos += dir.Unit()*offset;
-    pmt_info.x_pos[i] = pos.X();
-    pmt_info.y_pos[i] = pos.Y();
-    pmt_info.z_pos[i] = pos.Z();
-    //cerr << pos.Mag() << endl;
-  }
-  return pmt_info;
-} 
+  return GetPMTpositions(GetPMTGeometry());
+}
 
 // function to extract relevant LED info (uses part of filename and assumes db loaded)
-LEDInfo GetLEDInfoFromFileName(string filename)
+const LEDInfo & GetLEDInfoFromFileName(string filename)
 { 
   string shortname  = filename.substr(filename.find_last_of('/')+1);
   std::cout << "shortname " << shortname << std::endl;
@@ -98,79 +87,102 @@ LEDInfo GetLEDInfoFromFileName(string filename)
   return GetLEDInfoFromFibreName(fibre_name);
 }
 
-
-LEDInfo GetLEDInfoFromFibreNr(int fibre_nr, int subnr) 
+const LEDInfo & GetLEDInfoFromFibreNr(int fibre_nr, int subnr) 
 {
-  string fibre_name = "FT";
-  char   nr[8];
-  sprintf(nr,"%03i",fibre_nr);
-  fibre_name += nr;
+  // fibre registry, indexed by 2*fibre_nr+subnr
+  static const int max_fibres = 1000; // fibre names have three digits
+  static LEDInfo * registry[2*max_fibres] = {NULL};
+  static mutex registry_mutex;
+  assert (fibre_nr >= 0 && fibre_nr < max_fibres);
   assert (subnr == 0 || subnr == 1);
-  subnr == 0 ? fibre_name += 'A' : fibre_name += 'B';
-  return GetLEDInfoFromFibreName(fibre_name);
+  lock_guard<mutex> lock(registry_mutex);
+  LEDInfo *& led_info = registry[2*fibre_nr+subnr];
+  if ( led_info == NULL ) {
+    string fibre_name = "FT";
+    char   nr[8];
+    sprintf(nr,"%03i",fibre_nr);
+    fibre_name += nr;
+    subnr == 0 ? fibre_name += 'A' : fibre_name += 'B';
+    led_info = LoadLEDInfo(fibre_name);
+  }
+  return *led_info;
 }
 
-LEDInfo GetLEDInfoFromFibreName(string fibre_name) 
+const LEDInfo & GetLEDInfoFromFibreName(string fibre_name) 
 {
+  string nr = fibre_name.substr(2,3);
+  char letter = fibre_name[5];
+  if ( letter != 'A' && letter != 'B' ) {
+    cerr << "Unknown sub fibre: " << letter << " in " << fibre_name << endl;
+  }
+  return GetLEDInfoFromFibreNr(atoi(nr.data()),letter == 'B' ? 1 : 0);
+}
+
+// wavelength spectrum of the TELLIE LEDs, read from the database once
+static TH1D * GetLEDSpectrum()
+{
+  static TH1D * spectrum = NULL;
+  static mutex spectrum_mutex;
+  lock_guard<mutex> lock(spectrum_mutex);
+  if ( spectrum ) return spectrum;
   RAT::DB * db = RAT::DB::Get();
   assert(db);
-  LEDInfo led_info;
-  led_info.name = fibre_name;
-  
-  // get number
-  //std::cout << led_info.name << std::endl;
-  string nr = led_info.name.substr(2,3);
-  led_info.nr = atoi(nr.data());
-  char letter = led_info.name[5];
-  //std::cout << letter << std::endl;
-  if      ( letter == 'A' ) { led_info.sub = 0; }
-  else if ( letter == 'B' ) { led_info.sub = 1; }
-  else { cerr << "Unknown sub fibre: " << letter << " in " << led_info.name << endl; }
-
-  // get position  
-  RAT::DBLinkPtr led_db = db->GetLink("FIBRE",led_info.name.data());
-  assert(led_db);
-  led_info.position.SetX(led_db->GetD("x"));
-  led_info.position.SetY(led_db->GetD("y"));
-  led_info.position.SetZ(led_db->GetD("z"));
-  led_info.direction.SetX(led_db->GetD("u"));
-  led_info.direction.SetY(led_db->GetD("v"));
-  led_info.direction.SetZ(led_db->GetD("w"));
-
-  // get wavelength spectrum
   vector<Float_t> amp = db->GetLink("ELLIEWAVE","TELLIE503")->GetFArrayFromD("dist_wl_intensity");
   vector<Float_t> wl  = db->GetLink("ELLIEWAVE","TELLIE503")->GetFArrayFromD("dist_wl");
   assert(wl.size() == amp.size() );
-  char title[128];
-  sprintf(title,"%s (%.2f,%.2f,%.2f)",led_info.name.data(),
-	  led_info.position.X(),led_info.position.Y(),led_info.position.Z());
   int nbins = wl.size();
   float min = wl.front();
   float max = wl.back();
   assert ( max > min );
   assert ( nbins != 0 );
   double bw  = (max-min)/(float)nbins;
-  try{
-      delete gROOT->FindObject("hLEDData");
-      led_info.spectrum = new TH1D("hLEDData",title,nbins,min-0.5*bw,max+0.5*bw);
-  }
-  catch(int e){
-      led_info.spectrum = new TH1D("hLEDData",title,nbins,min-0.5*bw,max+0.5*bw);
-  }
-  led_info.spectrum->SetXTitle("wavelength (nm)");
+  delete gROOT->FindObject("hLEDData");
+  spectrum = new TH1D("hLEDData","TELLIE503",nbins,min-0.5*bw,max+0.5*bw);
+  // shared by all fibres, so keep it out of whichever file is open
+  spectrum->SetDirectory(0);
+  spectrum->SetXTitle("wavelength (nm)");
   for (unsigned int i = 0 ; i < wl.size() ; ++i) {
-    led_info.spectrum->SetBinContent(i+1,amp[i]);
+    spectrum->SetBinContent(i+1,amp[i]);
   }
+  return spectrum;
+}
+
+// look up a fibre in the database, only called once per fibre by GetLEDInfoFromFibreNr
+static LEDInfo * LoadLEDInfo(string fibre_name)
+{
+  RAT::DB * db = RAT::DB::Get();
+  assert(db);
+  LEDInfo * led_info = new LEDInfo;
+  led_info->name = fibre_name;
+  
+  // get number
+  string nr = led_info->name.substr(2,3);
+  led_info->nr = atoi(nr.data());
+  char letter = led_info->name[5];
+  led_info->sub = letter == 'B' ? 1 : 0;
+
+  // get position  
+  RAT::DBLinkPtr led_db = db->GetLink("FIBRE",led_info->name.data());
+  assert(led_db);
+  led_info->position.SetX(led_db->GetD("x"));
+  led_info->position.SetY(led_db->GetD("y"));
+  led_info->position.SetZ(led_db->GetD("z"));
+  led_info->direction.SetX(led_db->GetD("u"));
+  led_info->direction.SetY(led_db->GetD("v"));
+  led_info->direction.SetZ(led_db->GetD("w"));
+
+  // get wavelength spectrum
+  led_info->spectrum = GetLEDSpectrum();
 
   // report 
   /*
-  cout << "LED: " << led_info.name;
-  cout << " (" << led_info.nr << " - " << led_info.sub  << ") @ (";
-  cout << led_info.position.X() << ",";
-  cout << led_info.position.Y() << ",";
-  cout << led_info.position.Z() << ")";
-  cout << "; wavelength is (" << led_info.spectrum->GetMean() << " +/- ";
-  cout << led_info.spectrum->GetRMS() << " nm)" << endl;
+  cout << "LED: " << led_info->name;
+  cout << " (" << led_info->nr << " - " << led_info->sub  << ") @ (";
+  cout << led_info->position.X() << ",";
+  cout << led_info->position.Y() << ",";
+  cout << led_info->position.Z() << ")";
+  cout << "; wavelength is (" << led_info->spectrum->GetMean() << " +/- ";
+  cout << led_info->spectrum->GetRMS() << " nm)" << endl;
   */
 
   return led_info;
@@ -230,44 +242,72 @@ double get_value(TGraph * g, double x)
 }
 
 // function to convert LED spectrum convoluted with the group velocity in water 
-// into an average and an error
+// into an average and an error, together with the average inverse group velocities
 // for the weighted average calculation in one loop, see:
 // http://en.wikipedia.org/wiki/Mean_square_weighted_deviation
-PhysicsNr GroupVelocity(string fibre_name) 
+static GroupVelocityTable * BuildGroupVelocityTable()
 {
-  LEDInfo   led_info = GetLEDInfoFromFibreName(fibre_name);
-  int nbins  = led_info.spectrum->GetNbinsX();
+  TH1D * spectrum = GetLEDSpectrum();
+  int nbins  = spectrum->GetNbinsX();
   double sumw  = 0.; // sum_i (w_i)
   double sum   = 0.; // sum_i (w_i * x_i)
   double sumsq = 0.; // sum_i (w_i * x_i^2)
+  double sum_inv_scint = 0.;
+  double sum_inv_av    = 0.;
+  double sum_inv_water = 0.;
   //Unsure of of 10^-4 scaling factor  required for calc by distance method as 400nm->3.103125 * 1e-6 units of energy
   double hc = 0.197*6.28318530718*10e-4;
   //const double f = h/e*c*1E-6*1E9; //  eV*nm = 1E-6 MeV * 1E9 nm
-  //const RAT::DU::GroupVelocity& vel =  RAT::DU::Utility::Get()->GetGroupVelocity();
+  const RAT::DU::GroupVelocity & vel = RAT::DU::Utility::Get()->GetGroupVelocity();
   for ( int i=1 ; i <= nbins ; ++i ){
-    double wi = led_info.spectrum->GetBinContent(i);
-    double energy = hc/led_info.spectrum->GetBinCenter(i);
-    //printf("wavlength:%f energy:%f\n", led_info.spectrum->GetBinCenter(i),energy);
-    //cout << "energy: "<< energy << endl;
-    const double time = RAT::DU::Utility::Get()->GetGroupVelocity().CalcByDistance(0.0,0.0,1.0,energy);
+    double wi = spectrum->GetBinContent(i);
+    double energy = hc/spectrum->GetBinCenter(i);
+    //printf("wavlength:%f energy:%f\n", spectrum->GetBinCenter(i),energy);
+    // time for 1 mm in each medium
+    const double time = vel.CalcByDistance(0.0,0.0,1.0,energy);
     //cout.precision(15);
     //cout << "time: " << time << endl;
     double xi = 1.0/time;
     sumw  += wi;
     sum   += wi*xi;
     sumsq += wi*xi*xi;
+    sum_inv_water += wi*time;
+    sum_inv_scint += wi*vel.CalcByDistance(1.0,0.0,0.0,energy);
+    sum_inv_av    += wi*vel.CalcByDistance(0.0,1.0,0.0,energy);
   }
-  PhysicsNr vgroup;
+  GroupVelocityTable * table = new GroupVelocityTable;
   if ( sumw == 0. ) {
     cerr << "AVLocTools::GroupVelocity : sum of weights is zero" << endl;
-    vgroup.value = 0.;
-    vgroup.error = 0.;
+    table->vgroup.value = 0.;
+    table->vgroup.error = 0.;
+    table->inv_scint = 0.;
+    table->inv_av    = 0.;
+    table->inv_water = 0.;
   }
   else {
-    vgroup.value = sum/sumw;
-    vgroup.error = (sumsq*sumw-sum*sum)/(sumw*sumw);
+    table->vgroup.value = sum/sumw;
+    table->vgroup.error = (sumsq*sumw-sum*sum)/(sumw*sumw);
+    table->inv_scint = sum_inv_scint/sumw;
+    table->inv_av    = sum_inv_av/sumw;
+    table->inv_water = sum_inv_water/sumw;
   }
-  return vgroup;
+  return table;
+}
+
+const GroupVelocityTable & GetGroupVelocityTable()
+{
+  static GroupVelocityTable * table = NULL;
+  static mutex table_mutex;
+  lock_guard<mutex> lock(table_mutex);
+  if ( table == NULL ) table = BuildGroupVelocityTable();
+  return *table;
+}
+
+PhysicsNr GroupVelocity(string fibre_name) 
+{
+  // checks the fibre name and makes sure the spectrum is loaded
+  GetLEDInfoFromFibreName(fibre_name);
+  return GetGroupVelocityTable().vgroup;
 }
 
 PhysicsNr TimeOfFlight(TVector3 inject, TVector3 detect, PhysicsNr n_h2o, double offset) {
@@ -0,0 +1,73 @@
+//
+// Reusable per fibre state for AV location fits and plots
+//
+#include <algorithm>
+
+#include <TH1D.h>
+
+#include "include/AVLocWorkspace.h"
+
+using namespace std;
+
+PMTArrays::PMTArrays(int numPMTs, int numArrays)
+  : fNumPMTs(0), fNumArrays(0)
+{
+  Resize(numPMTs,numArrays);
+}
+
+void PMTArrays::Resize(int numPMTs, int numArrays)
+{
+  assert(numPMTs >= 0 && numArrays >= 0);
+  if ( numPMTs != fNumPMTs || numArrays != fNumArrays ) {
+    fNumPMTs   = numPMTs;
+    fNumArrays = numArrays;
+    fData.assign((size_t)numPMTs*numArrays,0.);
+  }
+  else Reset();
+}
+
+void PMTArrays::Reset()
+{
+  fill(fData.begin(),fData.end(),0.);
+}
+
+PMTHistograms::PMTHistograms(int size, int n_bins, double x_min, double x_max)
+  : fNBins(n_bins), fXMin(x_min), fXMax(x_max), fRow(size,-1)
+{
+  assert(n_bins > 0 && x_max > x_min);
+}
+
+void PMTHistograms::AddRow(int index)
+{
+  fRow[index] = fIndices.size();
+  fIndices.push_back(index);
+  fCounts.resize(fCounts.size()+fNBins+2,0.);
+  fEntries.push_back(0.);
+}
+
+void PMTHistograms::FillHisto(int index, TH1 * histo) const
+{
+  assert(histo->GetNbinsX() == fNBins);
+  histo->Reset();
+  if ( fRow[index] < 0 ) return;
+  const double * counts = &fCounts[fRow[index]*(fNBins+2)];
+  for (int bin = 0 ; bin < fNBins+2 ; ++bin) {
+    if ( counts[bin] ) histo->SetBinContent(bin,counts[bin]);
+  }
+  histo->SetEntries(fEntries[fRow[index]]);
+}
+
+TH1D * PMTHistograms::MakeScratch(const char * name) const
+{
+  TH1D * histo = new TH1D(name,name,fNBins,fXMin,fXMax);
+  histo->SetDirectory(0);
+  return histo;
+}
+
+void PMTHistograms::Reset()
+{
+  for (unsigned int i = 0 ; i < fIndices.size() ; ++i) fRow[fIndices[i]] = -1;
+  fIndices.clear();
+  fCounts.clear();
+  fEntries.clear();
+}
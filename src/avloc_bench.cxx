@@ -0,0 +1,462 @@
+//
+// Benchmarks of the avloc hot paths
+//
+// The default set runs on synthetic PMTs, fibres and hits and needs no
+// RAT data files; -r adds the benchmarks which need the RAT database
+// (light path calculator, LED lookup, analytic time of flight).
+// Each benchmark is repeated and the fastest repetition is reported, on
+// the screen and as one tab separated line per benchmark in the results file.
+// Fast paths are also checked against the code they replace, a failed check
+// is printed and makes the exit status non zero
+//
+#include <assert.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <TF1.h>
+#include <TFile.h>
+#include <TH1D.h>
+#include <TMath.h>
+#include <TRandom3.h>
+#include <TSystem.h>
+#include <TVector2.h>
+#include <TVector3.h>
+
+#include <RAT/DB.hh>
+#include <RAT/DU/Utility.hh>
+#include <RAT/DU/GroupVelocity.hh>
+#include <RAT/DU/LightPathCalculator.hh>
+
+#include "include/AVLocTools.h"
+#include "include/AVLocFit.h"
+#include "include/AVLocGeometry.h"
+#include "include/AVLocHits.h"
+#include "include/AVLocLightPath.h"
+#include "include/AVLocPlot.h"
+#include "include/AVLocNtuple.h"
+#include "include/AVLocTOFTable.h"
+
+using namespace std;
+
+// synthetic detector, roughly SNO+ sized
+const int    kNumPMTs   = 9000;
+const double kRadiusPSUP = 8400.;  // mm
+const double kRadiusAV   = 6000.;  // mm
+const double kVGroup     = 218.;   // mm/ns
+const double kDistCut    = 1500.;  // mm
+
+struct BenchResult {
+  string name;
+  long   calls;
+  int    repeats;
+  double seconds;  // fastest repetition
+};
+
+// run func repeats times, func does calls operations per run
+template <class Func>
+BenchResult RunBenchmark(const string & name, long calls, int repeats, Func func)
+{
+  BenchResult result;
+  result.name    = name;
+  result.calls   = calls;
+  result.repeats = repeats;
+  result.seconds = -1;
+  for (int r = 0 ; r < repeats ; ++r) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    func();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    if ( result.seconds < 0 || seconds < result.seconds ) result.seconds = seconds;
+  }
+  printf("%-32s %10ld calls %10.4f s %12.1f ns/call\n",name.c_str(),calls,result.seconds,
+	 1E9*result.seconds/calls);
+  return result;
+}
+
+// PMTs evenly spread over the PSUP, facing the centre
+PMTInfo SyntheticPMTs()
+{
+  PMTInfo pmt_info;
+  const double golden = TMath::Pi()*(3.-sqrt(5.));
+  for (int i = 0 ; i < kNumPMTs ; ++i) {
+    double z   = 1.-2.*(i+0.5)/kNumPMTs;
+    double r   = sqrt(1.-z*z);
+    double phi = golden*i;
+    TVector3 unit(r*cos(phi),r*sin(phi),z);
+    pmt_info.x_pos.push_back(kRadiusPSUP*unit.X());
+    pmt_info.y_pos.push_back(kRadiusPSUP*unit.Y());
+    pmt_info.z_pos.push_back(kRadiusPSUP*unit.Z());
+    pmt_info.x_dir.push_back(-unit.X());
+    pmt_info.y_dir.push_back(-unit.Y());
+    pmt_info.z_dir.push_back(-unit.Z());
+  }
+  return pmt_info;
+}
+
+// fibre on the PSUP pointing at the centre
+LEDInfo SyntheticFibre(int nr)
+{
+  LEDInfo led;
+  char name[32];
+  sprintf(name,"FTB%03dA",nr);
+  led.name = name;
+  led.nr   = nr;
+  led.sub  = 0;
+  led.position.SetXYZ(0.,0.,kRadiusPSUP);
+  led.position.RotateY(0.3*nr);
+  led.direction = -led.position.Unit();
+  led.spectrum  = NULL;
+  return led;
+}
+
+// reflection off the near side of the AV, mirror image approximation
+double SyntheticTOF(const LEDInfo & led, const PMTInfo & pmt_info, int lcn, double AVOffset)
+{
+  TVector3 PMT_pos(pmt_info.x_pos[lcn],pmt_info.y_pos[lcn],pmt_info.z_pos[lcn]);
+  double d = (PMT_pos-led.position).Mag();
+  double h = 2.*(kRadiusPSUP-kRadiusAV-AVOffset);
+  return sqrt(d*d+h*h)/kVGroup;
+}
+
+// table of the synthetic model on the chisqFitter offset grid
+TOFTable SyntheticTable(const LEDInfo & led, const PMTInfo & pmt_info)
+{
+  TOFTable table;
+  table.fibre_nr    = led.nr;
+  table.fibre_sub   = led.sub;
+  table.offset_min  = -200.;
+  table.n_offsets   = 81;
+  table.offset_step = 400./(table.n_offsets-1);
+  table.spectrum    = 0;
+  table.row.assign(pmt_info.x_pos.size(),-1);
+  for (unsigned int i = 0 ; i < pmt_info.x_pos.size() ; ++i) {
+    TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
+    if ( (PMT_pos-led.position).Mag() >= kDistCut ) continue;
+    table.row[i] = table.lcn.size();
+    table.lcn.push_back(i);
+    for (int k = 0 ; k < table.n_offsets ; ++k) {
+      table.tof.push_back(SyntheticTOF(led,pmt_info,i,table.offset_min+k*table.offset_step));
+    }
+  }
+  return table;
+}
+
+// fit of the tabulated PMTs as set up by chisqFitter -t, with hit times for a true offset
+void SyntheticFit(const LEDInfo & led, PMTInfo & pmt_info, const TOFTable & table, double AVOffset,
+		  TRandom3 & random, FibreFit & fit)
+{
+  fit.fibre = led.nr;
+  fit.led   = led;
+  fit.pmtArrays.Resize(pmt_info.x_pos.size(),FibreFit::kNumArrays);
+  fit.weighted    = false;
+  fit.pmts        = &pmt_info;
+  fit.useTOFTable = true;
+  fit.tofTable    = table;
+  fit.newTable    = false;
+  fit.lp          = NULL;
+  fit.vgroup      = NULL;
+  fit.offsetMin   = table.offset_min;
+  fit.offsetMax   = table.offset_min+(table.n_offsets-1)*table.offset_step;
+  fit.value       = 0;
+  fit.error       = 0;
+  fit.status      = -1;
+  fit.warmStart   = false;
+  fit.merged      = false;
+  for (unsigned int i = 0 ; i < table.lcn.size() ; ++i) {
+    int lcn = table.lcn[i];
+    // 1.5 ns time spread, 100 hits per PMT
+    fit.numHits(lcn)   = 100;
+    fit.hitErrors(lcn) = 0.15;
+    fit.hitTimes(lcn)  = SyntheticTOF(led,pmt_info,lcn,AVOffset) + random.Gaus(0.,fit.hitErrors(lcn));
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  string results_filename = "avloc_bench.tsv";
+  int  repeats = 5;
+  bool useRAT  = false;
+  for (int i = 1 ; i < argc ; ++i) {
+    string arg = argv[i];
+    if ( arg == "-o" && i+1 < argc ) {
+      results_filename = argv[++i];
+    }
+    else if ( arg == "-n" && i+1 < argc ) {
+      repeats = atoi(argv[++i]);
+      if ( repeats < 1 ) repeats = 1;
+    }
+    else if ( arg == "-r" ) {
+      useRAT = true;
+    }
+    else {
+      cerr << "Usage: " << argv[0] << " [-o <results file>] [-n <repeats>] [-r]" << endl;
+      cerr << "  -o : tab separated results, one line per benchmark (default " << results_filename << ")" << endl;
+      cerr << "  -n : repetitions of each benchmark, the fastest is reported (default " << repeats << ")" << endl;
+      cerr << "  -r : also run the benchmarks which need the RAT database" << endl;
+      return 1;
+    }
+  }
+  vector<BenchResult> results;
+  PMTInfo pmt_info = SyntheticPMTs();
+  LEDInfo led      = SyntheticFibre(1);
+  TRandom3 random(4357);
+  // results are summed so the work cannot be optimised away
+  volatile double sink = 0;
+  int failures = 0;
+
+  // flat map projection
+  {
+    vector<TVector3> positions;
+    for (int i = 0 ; i < kNumPMTs ; ++i) positions.push_back(TVector3(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]));
+    results.push_back(RunBenchmark("IcosProject",kNumPMTs,repeats,[&](){
+	  double sum = 0;
+	  for (int i = 0 ; i < kNumPMTs ; ++i) sum += IcosProject(positions[i]).X();
+	  sink += sum;
+	}));
+  }
+
+  // time of flight to every PMT, the batch kernel of the chisqFitter pre-screen against the scalar TimeOfFlight
+  {
+    PMTGeometry geo;
+    geo.Allocate(kNumPMTs);
+    for (int i = 0 ; i < kNumPMTs ; ++i) {
+      geo.x_pos[i] = pmt_info.x_pos[i];
+      geo.y_pos[i] = pmt_info.y_pos[i];
+      geo.z_pos[i] = pmt_info.z_pos[i];
+    }
+    PhysicsNr n_h2o;
+    n_h2o.value = 299.792458/kVGroup;
+    n_h2o.error = 0.01*n_h2o.value;
+    const int numOffsets = 41;
+    vector<double> batch(kNumPMTs), scalar(kNumPMTs);
+    double maxDiff = 0;
+    for (int k = 0 ; k < numOffsets ; ++k) {
+      double offset = 0.97+0.06*k/(numOffsets-1);
+      TimeOfFlight(geo,led.position,n_h2o,offset,&batch[0]);
+      for (int i = 0 ; i < kNumPMTs ; ++i) {
+	TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
+	scalar[i] = TimeOfFlight(led.position,PMT_pos,n_h2o,offset).value;
+	maxDiff = max(maxDiff,fabs(batch[i]-scalar[i])/scalar[i]);
+      }
+    }
+    results.push_back(RunBenchmark("TimeOfFlight(batch)",(long)numOffsets*kNumPMTs,repeats,[&](){
+	  double sum = 0;
+	  for (int k = 0 ; k < numOffsets ; ++k) {
+	    TimeOfFlight(geo,led.position,n_h2o,0.97+0.06*k/(numOffsets-1),&batch[0]);
+	    sum += batch[k];
+	  }
+	  sink += sum;
+	}));
+    results.push_back(RunBenchmark("TimeOfFlight(scalar)",(long)numOffsets*kNumPMTs,repeats,[&](){
+	  double sum = 0;
+	  for (int k = 0 ; k < numOffsets ; ++k) {
+	    double offset = 0.97+0.06*k/(numOffsets-1);
+	    for (int i = 0 ; i < kNumPMTs ; ++i) {
+	      TVector3 PMT_pos(pmt_info.x_pos[i],pmt_info.y_pos[i],pmt_info.z_pos[i]);
+	      sum += TimeOfFlight(led.position,PMT_pos,n_h2o,offset).value;
+	    }
+	  }
+	  sink += sum;
+	}));
+    // the same arithmetic in another order, so only rounding may differ
+    bool agree = maxDiff < 1E-12;
+    cout << "  batch - scalar time of flight over " << kNumPMTs << " PMTs: " << maxDiff << " relative at most"
+	 << (agree ? "" : ", CHECK FAILED") << endl;
+    if ( !agree ) ++failures;
+  }
+
+  // tabulated time of flight, the trial function of chisqFitter -t
+  TOFTable table = SyntheticTable(led,pmt_info);
+  {
+    const long calls = 1000000;
+    results.push_back(RunBenchmark("trialFunction(table)",calls,repeats,[&](){
+	  double sum = 0, dTrial;
+	  for (long i = 0 ; i < calls ; ++i) {
+	    sum += InterpolateTOF(table,table.lcn[i%table.lcn.size()],-200.+400.*(i%1000)/1000.,&dTrial);
+	  }
+	  sink += sum;
+	}));
+  }
+
+  // single fibre fit on synthetic hits, tabulated model
+  {
+    FibreFit fit;
+    SyntheticFit(led,pmt_info,table,37.,random,fit);
+    results.push_back(RunBenchmark("fitFibre(table)",1,repeats,[&](){
+	  FitFibre(fit,false);
+	}));
+    results.push_back(RunBenchmark("fitFibre(table,gradient)",1,repeats,[&](){
+	  FitFibre(fit,true);
+	}));
+    cout << "  synthetic fit of " << table.lcn.size() << " PMTs: offset " << fit.value << " +/- " << fit.error
+	 << " mm (true 37 mm), Minuit status " << fit.status << endl;
+  }
+
+  // hit time per PMT from the buckets, the peak estimate of chisqFitter against the gaussian fit of -f
+  {
+    const int numPMTs = 1000;
+    HitBuckets buckets(kDistCut,15.,30.,51,0.,50.);
+    for (int lcn = 0 ; lcn < numPMTs ; ++lcn) {
+      double t0 = 20.+random.Uniform(3.);
+      // 200 hits with a 1.5 ns spread on a flat background of 5% in the time window
+      for (int h = 0 ; h < 200 ; ++h) {
+	double time = random.Uniform() < 0.05 ? random.Uniform(15.,30.) : random.Gaus(t0,1.5);
+	buckets.Add(1,0,lcn,time,0.);
+      }
+    }
+    const FibreHits & hits = buckets.GetFibres()[0];
+    vector<double> peak(numPMTs,0.), peakError(numPMTs,0.), gaus(numPMTs,0.), gausError(numPMTs,0.);
+    results.push_back(RunBenchmark("GetHitPeak",numPMTs,repeats,[&](){
+	  for (int lcn = 0 ; lcn < numPMTs ; ++lcn) GetHitPeak(hits,lcn,peak[lcn],peakError[lcn]);
+	}));
+    TH1D * histo = new TH1D("benchHisto","benchHisto",hits.n_bins,hits.time_min,hits.time_max);
+    histo->SetDirectory(0);
+    results.push_back(RunBenchmark("TH1D::Fit(gaus)",numPMTs,repeats,[&](){
+	  for (int lcn = 0 ; lcn < numPMTs ; ++lcn) {
+	    FillHitHisto(hits,lcn,histo);
+	    histo->Fit("gaus","Q","");
+	    TF1 * f = histo->GetFunction("gaus");
+	    gaus[lcn]      = f->GetParameter(1);
+	    gausError[lcn] = f->GetParError(1);
+	  }
+	}));
+    delete histo;
+    // both estimate the same peak from the same hits, so they differ by well under the fit error
+    double sumPull = 0, sumPull2 = 0;
+    for (int lcn = 0 ; lcn < numPMTs ; ++lcn) {
+      double pull = gausError[lcn] > 0 ? (peak[lcn]-gaus[lcn])/gausError[lcn] : 0.;
+      sumPull  += pull;
+      sumPull2 += pull*pull;
+    }
+    double meanPull = sumPull/numPMTs;
+    double rmsPull  = sqrt(max(sumPull2/numPMTs-meanPull*meanPull,0.));
+    bool agree = fabs(meanPull) < 0.2 && rmsPull < 1.;
+    cout << "  peak estimate - gaussian fit over " << numPMTs << " PMTs: " << meanPull << " +/- " << rmsPull
+	 << " fit errors" << (agree ? "" : ", CHECK FAILED") << endl;
+    if ( !agree ) ++failures;
+  }
+
+  // summary ntuple throughput
+  {
+    const long numHits = 2000000;
+    TString ntuple_filename = TString::Format("avloc_bench_%d.root",gSystem->GetPid());
+    vector<LEDInfo> fibres;
+    for (int f = 0 ; f < 4 ; ++f) fibres.push_back(SyntheticFibre(f+1));
+    results.push_back(RunBenchmark("HitWriter::Fill",numHits,repeats,[&](){
+	  TFile file(ntuple_filename,"RECREATE");
+	  HitWriter writer(&file);
+	  for (long i = 0 ; i < numHits ; ++i) {
+	    writer.Fill(fibres[(4*i)/numHits],(int)(i*7919%kNumPMTs),10.+(i%4000)*0.01);
+	  }
+	  writer.Write();
+	  file.Close();
+	}));
+    results.push_back(RunBenchmark("HitReader::GetEntry+GetDist",numHits,repeats,[&](){
+	  TFile file(ntuple_filename,"READ");
+	  HitReader reader(&file,pmt_info);
+	  double sum = 0;
+	  for (Long64_t i = 0 ; i < reader.GetEntries() ; ++i) {
+	    reader.GetEntry(i);
+	    sum += reader.GetTime() + reader.GetDist();
+	  }
+	  sink += sum;
+	}));
+    gSystem->Unlink(ntuple_filename);
+  }
+
+  if ( useRAT ) {
+    LoadDataBase("avloc_bench.log");
+    char* ratroot = getenv("RATROOT");
+    if (ratroot == static_cast<char*>(NULL)) {
+      cerr << "Environment variable $RATROOT must be set" << endl;
+      assert(ratroot);
+    }
+    string rat = string(ratroot);
+    RAT::DB * db = RAT::DB::Get();
+    assert(db);
+    db->Load(rat+"/data/geo/snoplus.geo");
+    db->Load(rat+"/data/pmt/airfill2.ratdb");
+    RAT::DU::Utility::Get()->BeginOfRun();
+    PMTInfo pmts = GetPMTpositions();
+    RAT::DU::GroupVelocity gv = RAT::DU::Utility::Get()->GetGroupVelocity();
+    RAT::DU::LightPathCalculator lp = RAT::DU::Utility::Get()->GetLightPathCalculator();
+    // as in chisqFitter, the queries start from the refractive indices cached here
+    lp.CacheRefractiveIndices(lp.WavelengthToEnergy(506.787e-6));
+
+    {
+      const long calls = 100000;
+      results.push_back(RunBenchmark("GetLEDInfoFromFibreNr",calls,repeats,[&](){
+	    double sum = 0;
+	    for (long i = 0 ; i < calls ; ++i) sum += GetLEDInfoFromFibreNr(1+i%95,0).position.Z();
+	    sink += sum;
+	  }));
+    }
+    LEDInfo rat_led = GetLEDInfoFromFibreNr(44,0);
+    vector<int> nearPMTs;
+    for (unsigned int i = 0 ; i < pmts.x_pos.size() ; ++i) {
+      TVector3 PMT_pos(pmts.x_pos[i],pmts.y_pos[i],pmts.z_pos[i]);
+      if ( (PMT_pos-rat_led.position).Mag() < kDistCut ) nearPMTs.push_back(i);
+    }
+    if ( nearPMTs.empty() ) {
+      cerr << "avloc_bench : no PMTs within " << kDistCut << " mm of fibre " << rat_led.name << endl;
+      return 1;
+    }
+    double energy = lp.WavelengthToEnergy(506.787e-6);
+    const long calls = 10000;
+    for (int reflect = 0 ; reflect < 2 ; ++reflect) {
+      lp.SetELLIEReflect(reflect == 1);
+      results.push_back(RunBenchmark(reflect ? "CalcByPosition(reflect)" : "CalcByPosition",calls,repeats,[&](){
+	    double sum = 0;
+	    for (long i = 0 ; i < calls ; ++i) {
+	      int lcn = nearPMTs[i%nearPMTs.size()];
+	      TVector3 PMT_pos(pmts.x_pos[lcn],pmts.y_pos[lcn],pmts.z_pos[lcn]);
+	      lp.CalcByPosition(rat_led.position,PMT_pos,energy,10.);
+	      sum += lp.GetDistInWater();
+	    }
+	    sink += sum;
+	  }));
+    }
+    // analytic time of flight, the trial function of chisqFitter without -t
+    lp.SetELLIEReflect(true);
+    {
+      AVLocLightPath avlp(lp);
+      results.push_back(RunBenchmark("AVLocLightPath",calls,repeats,[&](){
+	    double sum = 0;
+	    for (long i = 0 ; i < calls ; ++i) {
+	      int lcn = nearPMTs[i%nearPMTs.size()];
+	      TVector3 PMT_pos(pmts.x_pos[lcn],pmts.y_pos[lcn],pmts.z_pos[lcn]);
+	      sum += avlp.Query(rat_led.position,PMT_pos,energy,10.,0.).distInWater;
+	    }
+	    sink += sum;
+	  }));
+    }
+    results.push_back(RunBenchmark("trialFunction(analytic)",calls,repeats,[&](){
+	  double sum = 0, dTrial;
+	  for (long i = 0 ; i < calls ; ++i) {
+	    sum += CalcTimeOfFlight(rat_led,pmts,nearPMTs[i%nearPMTs.size()],-200.+400.*(i%1000)/1000.,lp,gv,&dTrial);
+	  }
+	  sink += sum;
+	}));
+  }
+
+  ofstream out(results_filename.c_str());
+  if ( !out ) {
+    cerr << "Could not open file " << results_filename << endl;
+    return 1;
+  }
+  out << "# benchmark\tcalls\trepeats\tseconds\tns_per_call" << endl;
+  for (unsigned int i = 0 ; i < results.size() ; ++i) {
+    out << results[i].name << "\t" << results[i].calls << "\t" << results[i].repeats << "\t"
+	<< results[i].seconds << "\t" << 1E9*results[i].seconds/results[i].calls << endl;
+  }
+  cout << "Results written to " << results_filename << endl;
+  if ( failures ) {
+    cerr << "avloc_bench : " << failures << " check(s) failed" << endl;
+    return 1;
+  }
+  return 0;
+}
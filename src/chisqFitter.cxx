@@ -2,9 +2,12 @@
 #include <RAT/DB.hh>
 #include <TMath.h>
 #include <TFile.h>
+#include <TROOT.h>
+#include <TRandom3.h>
 //#include <TNTuple.h>
 #include <TVector3.h>
-#include <TMinuit.h>
+#include <Math/Functor.h>
+#include <Minuit2/Minuit2Minimizer.h>
 #include <RAT/DU/Utility.hh>
 #include <RAT/DU/GroupVelocity.hh>
 #include <RAT/DB.hh>
@@ -13,62 +16,373 @@
 #include <stdio.h>
 #include <TF1.h>
 #include <sstream>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <TGraph.h>
+#include <TMatrixDSym.h>
+#include <TTree.h>
 #include <RAT/DU/GroupVelocity.hh>
 #include <RAT/DU/LightPathCalculator.hh>
+#include "include/AVLocTOFTable.h"
+#include "include/AVLocFit.h"
+#include "include/AVLocHits.h"
+#include "include/AVLocNtuple.h"
+#include "include/AVLocProc.h"
+#include "include/AVLocGeometry.h"
+#include "include/AVLocPathCache.h"
+#include "include/AVLocStats.h"
+#include "include/AVLocWorkspace.h"
 using namespace std;
 int fibre_nr;
 int sub_nr;
 //Distance cut for the PMTS
 double distCut = 1500.;
+//Time cuts for the hits, see timeCuts for how these were chosen
+double lowerTime = 15;
+double upperTime = 30;
 //Systematic errors from LightPathCalculator
 //First term 20mm/c due to locality value 
 //Second Term due to 
 //PMT and LED info being loaded in from db
-LEDInfo led;     
 PMTInfo pmts;  
-TNtuple * ntuple;
-TVector3  LEDPos;
-TVector3  PMTPos;
-RAT::DU::LightPathCalculator lp;
-RAT::DU::GroupVelocity gv;
 double vg;
-//Number of times pmt is hit
-double * numHits;
-//Average hit time for each PMT 
-double * hitTimes;
-//Errors on each hit hime
-double * hitErrors;
-TH1D ** hitHistos;
 //Number of pmts
 int numPMTS;
 //fibreNumbers being fired from
 vector<double> fibreNumbers;
 vector<double> offsets;
 vector<double> offsetErrors;
-//fibreNumber iterator
-int fibreNum;
-double trialFunction(int,int,double);
-void timeCuts(int);
+//Use tabulated time of flight instead of the ray trace if a table file is given
+bool useTOFTable = false;
+//AV offset grid for the table, covers the fit limits
+double tableOffsetMin = -200;
+double tableOffsetMax = 200;
+int tableNumOffsets = 81;
+//Give Minuit the derivative of the chisq instead of letting it use finite differences
+bool useGradient = false;
+//Fit a gaussian to every PMT time histogram instead of using the truncated mean peak estimate, for validation
+bool fitHistos = false;
+//Use the group velocities averaged over the LED spectrum instead of those at a single wavelength
+bool useSpectrum = false;
+//Drop the hit PMTs whose peak is more than this (ns) outside the times the batch TimeOfFlight predicts
+//over the table offset range, a pre-screen before the light path fit, 0 keeps all hit PMTs
+double screenMargin = 3;
+//Fit the AV centre to all fibres at once instead of one offset per fibre
+bool fitCentre = false;
+//Range of each coordinate of the AV centre, the table range is widened so it covers the projections
+double centreOffsetMin = -200;
+double centreOffsetMax = 200;
+//Grid spacing of the coarse scan for the AV centre fit (mm)
+double centreScanStep = 50;
+//Number of bootstrap replicas of the hit PMTs to refit for the offset uncertainties, 0 for none
+int numBootstrap = 0;
+//Seed of the bootstrap, each fibre draws from its own generator seeded with this and the fibre number
+unsigned int bootstrapSeed = 4357;
+//Online mode: RAT files (wildcards allowed) to stream events from instead of reading the ntuple
+vector<string> onlinePatterns;
+//Refit all fibres every this many events in the online mode
+int onlineEvents = 1000;
+//Keep looking for new RAT files for this many seconds after the last one before finishing
+double onlineWait = 0;
+//Fibre sharding: this job fits fibre i of the ntuple if i%numShards==shard
+int shard = 0;
+int numShards = 1;
+//Partial result file written by this job (buckets and fits, see writePartial)
+string partialOutput;
+//Partial results to merge instead of reading the ntuple
+vector<string> partialInputs;
 
+void setupFit(FibreFit & fit, const FibreHits & hits, const RAT::DU::LightPathCalculator & lp,
+              const RAT::DU::GroupVelocity & gv, TFile * table_file);
+void timeCuts(FibreFit & fit, const FibreHits & hits);
+int screenHitTimes(FibreFit & fit);
+void prepareTable(FibreFit & fit);
+int numNewTables(const vector<FibreFit> & fits);
+void reportTable(const TOFTable & table, const LEDInfo & led);
+void fitFibre(FibreFit & fit);
+void fitUnlessMerged(FibreFit & fit);
+void bootstrapFibre(FibreFit & fit);
+bool readPartials(vector<FibreHits> & fibreHits, vector<FibreFit> & partialFits, vector<int> & numFiles);
+void writePartial(const string & filename, const vector<FibreHits> & fibreHits, const vector<FibreFit> & fits);
+int runOnline(const string & ntuple_filename, TFile * plot_file, TFile * table_file,
+              const RAT::DU::LightPathCalculator & lp, const RAT::DU::GroupVelocity & gv, int numThreads);
 
-//Minuit unction to minimise
-void funcn(Int_t & npar, Double_t * deriv, Double_t& f, Double_t * par, Int_t flag){
-    double chisq=0;
-    for(int i=0; i<numPMTS; i++){
-        if(numHits[i]==0){
-            continue;
+
+//Run func on each fibre in the list, numThreads fibres at a time
+//progress: if given, the main thread reports the number of fibres done after each fibre it did itself
+void forEachFibre(vector<FibreFit> & fits, int numThreads, void (*func)(FibreFit &), const char * progress = NULL){
+    atomic<unsigned int> next(0);
+    atomic<unsigned int> done(0);
+    auto worker = [&fits,&next,&done,func,progress](bool report){
+        for(unsigned int i = next++; i<fits.size(); i = next++){
+            func(fits[i]);
+            unsigned int numDone = ++done;
+            if(report && progress){
+                cout << progress << ": " << numDone << "/" << fits.size() << " fibres" << endl;
+            }
+        }
+    };
+    vector<thread> threads;
+    for(int i=1; i<numThreads; i++){
+        threads.push_back(thread(worker,false));
+    }
+    worker(true);
+    for(unsigned int i=0; i<threads.size(); i++){
+        threads[i].join();
+    }
+}
+
+//Chisq of all fibres for an AV centre, each fibre sees the projection of the centre on its direction
+//(the same projection the per fibre offsets are combined with)
+//dChisq: if given, filled with the gradient w.r.t. the centre
+double centreChisq(vector<FibreFit> & fits, const double * par, double * dChisq = NULL){
+    TVector3 centre(par[0],par[1],par[2]);
+    double chisq = 0;
+    if(dChisq){
+        dChisq[0] = dChisq[1] = dChisq[2] = 0;
+    }
+    for(unsigned int i=0; i<fits.size(); i++){
+        TVector3 dir = fits[i].led.direction.Unit();
+        double offset = centre.Dot(dir);
+        double dOffset = 0;
+        chisq += fits[i].chisq(&offset,dChisq ? &dOffset : NULL);
+        if(dChisq){
+            dChisq[0] += dOffset*dir.X();
+            dChisq[1] += dOffset*dir.Y();
+            dChisq[2] += dOffset*dir.Z();
+        }
+    }
+    return chisq;
+}
+
+//Coarse scan of the AV centre on a cubic grid covering the centre range, the grid points are shared out between threads
+TVector3 scanCentre(vector<FibreFit> & fits, double step, int numThreads, double & bestChisq){
+    int numSteps = (int)floor((centreOffsetMax-centreOffsetMin)/step+0.5)+1;
+    int numPoints = numSteps*numSteps*numSteps;
+    vector<double> threadChisq(numThreads,-1);
+    vector<TVector3> threadCentre(numThreads);
+    atomic<int> next(0);
+    auto worker = [&](int t){
+        for(int i = next++; i<numPoints; i = next++){
+            double par[3] = {centreOffsetMin+step*(i%numSteps),
+                             centreOffsetMin+step*((i/numSteps)%numSteps),
+                             centreOffsetMin+step*(i/(numSteps*numSteps))};
+            double chisq = centreChisq(fits,par);
+            if(threadChisq[t]<0 || chisq<threadChisq[t]){
+                threadChisq[t] = chisq;
+                threadCentre[t].SetXYZ(par[0],par[1],par[2]);
+            }
         }
+    };
+    vector<thread> threads;
+    for(int t=1; t<numThreads; t++){
+        threads.push_back(thread(worker,t));
+    }
+    worker(0);
+    for(unsigned int t=0; t<threads.size(); t++){
+        threads[t].join();
+    }
+    TVector3 best = threadCentre[0];
+    bestChisq = threadChisq[0];
+    for(int t=1; t<numThreads; t++){
+        if(threadChisq[t]>=0 && threadChisq[t]<bestChisq){
+            bestChisq = threadChisq[t];
+            best = threadCentre[t];
+        }
+    }
+    cout << "Coarse scan of " << numPoints << " AV centres: best (" << best.X() << "," << best.Y() << "," << best.Z()
+         << ") with chisq " << bestChisq << endl;
+    return best;
+}
 
-        double trial = trialFunction(fibreNum,i,par[0]);
-        chisq+=((trial-hitTimes[i])/hitErrors[i])*((trial-hitTimes[i])/hitErrors[i]);
+//Fit the AV centre to all fibres in one chisq, starting Minuit from the best point of the coarse scan
+void fitAVCentre(vector<FibreFit> & fits, int numThreads, TVector3 & centre, TVector3 & error, int & status){
+    AVLOC_TIMER("fitAVCentre");
+    double scanChisq;
+    TVector3 start = scanCentre(fits,centreScanStep,numThreads,scanChisq);
+    ROOT::Minuit2::Minuit2Minimizer min(ROOT::Minuit2::kMigrad);
+    ROOT::Math::Functor chisq([&fits](const double * par){ return centreChisq(fits,par); },3);
+    ROOT::Math::GradFunctor chisqGrad([&fits](const double * par){ return centreChisq(fits,par); },
+                                      [&fits](const double * par, unsigned int coord){ double d[3]; centreChisq(fits,par,d); return d[coord]; },3);
+    if(useGradient){
+        min.SetFunction(chisqGrad);
     }
-    f = chisq;
+    else{
+        min.SetFunction(chisq);
+    }
+    min.SetErrorDef(1.0);
+    min.SetPrintLevel(0);
+    const char * names[3] = {"AV centre x","AV centre y","AV centre z"};
+    for(int k=0; k<3; k++){
+        min.SetLimitedVariable(k,names[k],start[k],0.5*centreScanStep,centreOffsetMin,centreOffsetMax);
+    }
+    min.Minimize();
+    status = min.Status();
+    centre.SetXYZ(min.X()[0],min.X()[1],min.X()[2]);
+    error.SetXYZ(min.Errors()[0],min.Errors()[1],min.Errors()[2]);
+    cout << "Refined AV centre chisq " << min.MinValue() << " (coarse scan " << scanChisq << "), Minuit status " << status << endl;
+}
+
+//Fits which ran into either limit of the offset range are left out of the combined offset
+//Minuit stops just inside a limit, so values within fitLimitTolerance (mm) of it count as at the limit
+const double fitLimitTolerance = 0.1;
+bool atFitLimit(double value){
+    return TMath::AreEqualAbs(value,tableOffsetMin,fitLimitTolerance) || TMath::AreEqualAbs(value,tableOffsetMax,fitLimitTolerance);
+}
+
+//Combine the offsets along the fibre directions into the AV offset vector, weighted by 1/error^2
+//covariance: if given, filled with the covariance of the combined vector for independent fibre offsets
+TVector3 combineOffsets(const vector<TVector3> & directions, const vector<double> & values, const vector<double> & errors,
+                        TMatrixDSym * covariance = NULL){
+    TVector3 totalOffsetVector(0,0,0);
+    double oneOverSumErrorSquared = 0;
+    double sumDirDir[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+    for(unsigned int i=0; i<directions.size(); i++){
+        if(atFitLimit(values[i])){
+            continue;
+        }
+        TVector3 dir = directions[i].Unit();
+        oneOverSumErrorSquared += 1.0/(errors[i]*errors[i]);
+        totalOffsetVector+=dir*(values[i]/(errors[i]*errors[i]));
+        for(int j=0; j<3; j++){
+            for(int k=0; k<3; k++){
+                sumDirDir[j][k] += dir[j]*dir[k]/(errors[i]*errors[i]);
+            }
+        }
+    }
+    totalOffsetVector *= 1.0/oneOverSumErrorSquared;
+    if(covariance){
+        for(int j=0; j<3; j++){
+            for(int k=0; k<3; k++){
+                (*covariance)(j,k) = sumDirDir[j][k]/(oneOverSumErrorSquared*oneOverSumErrorSquared);
+            }
+        }
+    }
+    return totalOffsetVector;
 }
 
 int main(int argc, char ** argv){
-    stringstream ss;
+    if ( argc < 3 ) {
+        cerr << "Usage: " << argv[0] << " <ntuple filename> <output filename for plots> [-t <time of flight table filename>] [-g] [-j <threads>] [-f] [-T <ns>] [-s] [-c] [-b <replicas> [-r <seed>]] [-p <path cache directory>] [-i <RAT files> [-e <events>] [-w <seconds>]] [-S <shard>/<shards>] [-P <partial file>] [-M <partial file>]" << endl;
+        cerr << "  -t : read (or tabulate) the time of flight from this file instead of ray tracing every call" << endl;
+        cerr << "  -g : give Minuit the analytic derivative with respect to the AV offset" << endl;
+        cerr << "  -j : number of fibres to fit in parallel (default 1)" << endl;
+        cerr << "  -f : fit a gaussian to each PMT time histogram instead of the +-2 sigma peak estimate (slow, prints how they differ)" << endl;
+        cerr << "  -T : drop hit PMTs whose peak is this far outside the reflection times over the offset range (default " << screenMargin << " ns, 0 for none)" << endl;
+        cerr << "  -s : use group velocities averaged over the LED spectrum instead of those at 506.787 nm" << endl;
+        cerr << "  -c : fit the AV centre (x,y,z) to all fibres at once instead of one offset per fibre (needs -t)" << endl;
+        cerr << "  -b : refit this many bootstrap replicas of the hit PMTs of each fibre for the offset uncertainties" << endl;
+        cerr << "  -r : seed for the bootstrap (default " << bootstrapSeed << ")" << endl;
+        cerr << "  -p : keep the light paths for new time of flight tables here (default avloc_paths next to the ntuple, \"\" for none)" << endl;
+        cerr << "  -i : online mode, stream events from these RAT files (may be repeated, wildcards are expanded on every look)," << endl;
+        cerr << "       the hits are added to the ntuple instead of being read from it" << endl;
+        cerr << "  -e : refit all fibres every this many events in the online mode (default " << onlineEvents << ")" << endl;
+        cerr << "  -w : keep looking for new RAT files for this many seconds after the last one (default 0)" << endl;
+        cerr << "  -S : fit only every <shards>th fibre of the ntuple starting from fibre <shard> (counting from 0)" << endl;
+        cerr << "  -P : write the bucketed hits and fit results of this job to a partial result file" << endl;
+        cerr << "  -M : merge partial result files (may be repeated) instead of reading the ntuple, fibres found in" << endl;
+        cerr << "       one file only keep their fit, fibres split over files are refitted from the merged hits" << endl;
+        return 1;
+    }
+    string table_filename;
+    string path_cache_dir = GetPathCacheDirName(argv[1]);
+    int numThreads = 1;
+    for(int i=3; i<argc; i++){
+        string option = argv[i];
+        if(option == "-t" && i+1<argc){
+            table_filename = argv[++i];
+        }
+        else if(option == "-g"){
+            useGradient = true;
+        }
+        else if(option == "-f"){
+            fitHistos = true;
+        }
+        else if(option == "-T" && i+1<argc){
+            screenMargin = atof(argv[++i]);
+        }
+        else if(option == "-s"){
+            useSpectrum = true;
+        }
+        else if(option == "-c"){
+            fitCentre = true;
+        }
+        else if(option == "-b" && i+1<argc){
+            numBootstrap = atoi(argv[++i]);
+            if(numBootstrap<0) numBootstrap = 0;
+        }
+        else if(option == "-r" && i+1<argc){
+            bootstrapSeed = strtoul(argv[++i],NULL,10);
+        }
+        else if(option == "-p" && i+1<argc){
+            path_cache_dir = argv[++i];
+        }
+        else if(option == "-i" && i+1<argc){
+            onlinePatterns.push_back(argv[++i]);
+        }
+        else if(option == "-e" && i+1<argc){
+            onlineEvents = atoi(argv[++i]);
+            if(onlineEvents<1) onlineEvents = 1;
+        }
+        else if(option == "-w" && i+1<argc){
+            onlineWait = atof(argv[++i]);
+        }
+        else if(option == "-S" && i+1<argc){
+            if(sscanf(argv[++i],"%d/%d",&shard,&numShards)!=2 || numShards<1 || shard<0 || shard>=numShards){
+                cerr << "Option -S needs <shard>/<shards> with 0 <= shard < shards" << endl;
+                return 1;
+            }
+        }
+        else if(option == "-P" && i+1<argc){
+            partialOutput = argv[++i];
+        }
+        else if(option == "-M" && i+1<argc){
+            partialInputs.push_back(argv[++i]);
+        }
+        else if(option == "-j" && i+1<argc){
+            numThreads = atoi(argv[++i]);
+            if(numThreads<1) numThreads = 1;
+        }
+        else{
+            cerr << "Unknown option " << option << endl;
+            return 1;
+        }
+    }
+    if(fitCentre){
+        if(table_filename.empty()){
+            cerr << "Option -c needs a time of flight table (-t)" << endl;
+            return 1;
+        }
+        if(!onlinePatterns.empty()){
+            cerr << "Option -c can not be used in the online mode (-i)" << endl;
+            return 1;
+        }
+        //Each coordinate of the centre stays in the offset range, but its projection on a fibre direction
+        //reaches sqrt(3) times that. The table is widened to cover it with the same step, so the fit never
+        //uses TOFs extrapolated past the ends of the table
+        double step = (tableOffsetMax-tableOffsetMin)/(tableNumOffsets-1);
+        centreOffsetMin = tableOffsetMin;
+        centreOffsetMax = tableOffsetMax;
+        tableOffsetMin = step*floor(sqrt(3.)*tableOffsetMin/step);
+        tableOffsetMax = step*ceil(sqrt(3.)*tableOffsetMax/step);
+        tableNumOffsets = (int)floor((tableOffsetMax-tableOffsetMin)/step+0.5)+1;
+    }
+    if(numThreads>1){
+        ROOT::EnableThreadSafety();
+    }
     //Obtaining the fibres and sub fibre we want to fire from
-    LoadDataBase("fitter.log");    
+    {
+        AVLOC_TIMER("RATDB loading");
+        LoadDataBase("fitter.log");
+    }
     RAT::DB* db = RAT::DB::Get();
     char* ratroot = getenv("RATROOT");
     if (ratroot == static_cast<char*>(NULL)) {
@@ -80,125 +394,314 @@ int main(int argc, char ** argv){
     pmtfile += "/data/pmt/airfill2.ratdb";
     string geofile = rat;
     geofile += "/data/geo/snoplus.geo";
-    db->Load(pmtfile);
-    db->Load(geofile);
-    RAT::DU::Utility::Get()->BeginOfRun();
+    {
+        AVLOC_TIMER("RATDB loading");
+        db->Load(pmtfile);
+        db->Load(geofile);
+        RAT::DU::Utility::Get()->BeginOfRun();
+    }
     
-    pmts = GetPMTpositions();
+    pmts = GetPMTpositions(GetPMTGeometry(GetPMTGeometryCacheName(argv[1])));
+    SetPathCacheDir(path_cache_dir);
     numPMTS = pmts.x_pos.size();
-    gv = RAT::DU::Utility::Get()->GetGroupVelocity();
-    lp = RAT::DU::Utility::Get()->GetLightPathCalculator();
+    RAT::DU::GroupVelocity gv = RAT::DU::Utility::Get()->GetGroupVelocity();
+    RAT::DU::LightPathCalculator lp = RAT::DU::Utility::Get()->GetLightPathCalculator();
     lp.SetELLIEReflect(true);
+    //The queries on the shared calculator start from the refractive indices it has cached
+    lp.CacheRefractiveIndices(lp.WavelengthToEnergy(506.787e-6));
     //Loading up root file
     string ntuple_filename = argv[1];
     string plot_filename = argv[2];
-    TFile * ntuple_file = new TFile(ntuple_filename.data(),"READ");
-    if ( !ntuple_file->IsOpen() ) {
-        cerr << "Could not open file " << ntuple_filename << endl;
-        return 0;
-    }
-
     TFile * plot_file = new TFile(plot_filename.data(),"RECREATE");
     if ( !plot_file->IsOpen() ) {
         cerr << "Could not open file " << plot_filename << endl;
         return 0;
     }
+    //Time of flight tables are read from (or added to) this file
+    TFile * table_file = NULL;
+    if ( !table_filename.empty() ) {
+        table_file = new TFile(table_filename.data(),"UPDATE");
+        if ( !table_file->IsOpen() ) {
+            cerr << "Could not open file " << table_filename << endl;
+            return 0;
+        }
+        useTOFTable = true;
+    }
+    if(!onlinePatterns.empty()){
+        return runOnline(ntuple_filename,plot_file,table_file,lp,gv,numThreads);
+    }
    // Histogram to store fit values for offset and errors
   TH1D * offsetAndErrors = new TH1D("offsetAndErrors","offsetAndErrors",100,0,100);
-  ntuple = (TNtuple*)ntuple_file->Get("avloctuple");
-    //Obtaining the number of fibres
-    ntuple->GetEntry(0);
-   fibreNumbers.push_back((int)ntuple->GetArgs()[0]);
-    int events = ntuple->GetEntries();
-    for(int i=1; i<events; i++){
-        ntuple->GetEntry(i);
-        int  fibre  = (int)ntuple->GetArgs()[0];
-        bool inArray = false;
-        for(int j=0; j<fibreNumbers.size(); j++){
-           if(fibre==fibreNumbers[j])
-               inArray = true;
-        }
-        if(!inArray)
-            fibreNumbers.push_back(fibre);
+    vector<FibreHits> fibreHits;
+    //Fits found in the partial results and the number of partial results holding each fibre
+    vector<FibreFit> partialFits;
+    vector<int> numFiles;
+    if(!partialInputs.empty()){
+        if(!readPartials(fibreHits,partialFits,numFiles)){
+            return 1;
+        }
     }
-    for(unsigned int i=0; i<fibreNumbers.size(); i++){
+    else{
+        TFile * ntuple_file = new TFile(ntuple_filename.data(),"READ");
+        if ( !ntuple_file->IsOpen() ) {
+            cerr << "Could not open file " << ntuple_filename << endl;
+            return 0;
+        }
+        HitReader reader(ntuple_file,pmts);
+        if ( !reader.IsValid() ) {
+            return 0;
+        }
+        if(numShards>1){
+            //Only this job's fibres are read, using the ntuple index
+            vector<int> allFibres = reader.GetFibreNrs();
+            if(allFibres.empty()){
+                cerr << "Fibre sharding needs an ntuple with the avlocfibres tree" << endl;
+                return 1;
+            }
+            vector<int> shardFibres;
+            for(unsigned int i=shard; i<allFibres.size(); i+=numShards){
+                shardFibres.push_back(allFibres[i]);
+            }
+            fibreHits = BucketHits(reader,distCut,lowerTime,upperTime,51,0,50,shardFibres);
+        }
+        else{
+            //Bucketing the hits for all fibres in one pass over the ntuple
+            fibreHits = BucketHits(reader,distCut,lowerTime,upperTime,51,0,50);
+        }
+    }
+    for(unsigned int i=0; i<fibreHits.size(); i++){
+        fibreNumbers.push_back(fibreHits[i].fibre_nr);
         cout << "Fibres: "<<fibreNumbers[i]<<endl;
     }
     //THIS RETURNS NAN NEED TO FIX POSSIBLY OTHER BUGS IN CODE WHERE THIS USED AS WELL
-    //Allocating hit time means, errors, and num Hits;
-    int numBadFits = 0;
+    //Setting up the fit for each fibre, reading the ntuple and table file is done here as ROOT I/O is not shared between threads
+    vector<FibreFit> fits(fibreNumbers.size());
     for(unsigned int i=0; i<fibreNumbers.size(); i++){
-        fibreNum = fibreNumbers[i];
-        numHits = (double *) malloc(sizeof(double)*numPMTS);
-        hitTimes = (double *) malloc(sizeof(double)*numPMTS);
-        hitErrors = (double *) malloc(sizeof(double)*numPMTS);
-        hitHistos = (TH1D**)malloc(sizeof(TH1D*)*numPMTS); for(int j=0; j<numPMTS; j++){
-            numHits[j] = 0;
-            hitTimes[j] = 0;
-            hitErrors[j] = 0;
-            //delete hitHistos[i];
-            //hitHistos[i]=0;
-            char name[20];
-            sprintf(name,"pmt%d",j);
-            hitHistos[j] = new TH1D(name,name,51,0,50);
-        }
-        timeCuts(fibreNum);
-        TMinuit min(1);
-        min.SetFCN(funcn);
-        min.SetErrorDef(1.0);
-        min.SetPrintLevel(0);
-        string fibreNum;
-        ss << fibreNumbers[i];
-        ss >> fibreNum;
-        ss.clear();
-        string fibreRad = "fibre "+fibreNum;
-        string fibreRadOffset = fibreRad+" Offset";
-        double limLower = -200;
-        double limUpper = 200;
-        min.DefineParameter(0,fibreRadOffset.c_str(),0,50,limLower,limUpper);
-        int status = min.Migrad();
-        double value;
-        double error;
-        min.GetParameter(0,value,error);
-        if(TMath::AreEqualRel(value,limLower,0.1) || TMath::AreEqualRel(value,limLower,0.1)){
-            cout<<"Fibre number "<<fibreNum<< "has reached the limit and will not be included in calculation of AV position"<<endl;
-            offsetAndErrors->SetBinContent(fibreNumbers[i],value);
-            offsetAndErrors->SetBinError(fibreNumbers[i],error);
-            offsets.push_back(0);
-            offsetErrors.push_back(1.0);
-            numBadFits++;
+        setupFit(fits[i],fibreHits[i],lp,gv,table_file);
+    }
+    //Fibres from a single partial result keep their fit, unless they are refitted for the bootstrap or the centre fit
+    for(unsigned int i=0; i<fits.size() && numBootstrap==0 && !fitCentre; i++){
+        if(numFiles.empty() || numFiles[i]!=1){
+            continue;
         }
-        else{
-            offsetAndErrors->SetBinContent(fibreNumbers[i],value);
-            offsetAndErrors->SetBinError(fibreNumbers[i],error);
-            offsets.push_back(value);
-            offsetErrors.push_back(error);
+        for(unsigned int j=0; j<partialFits.size(); j++){
+            if(partialFits[j].led.nr==fits[i].led.nr && partialFits[j].led.sub==fits[i].led.sub){
+                fits[i].value = partialFits[j].value;
+                fits[i].error = partialFits[j].error;
+                fits[i].status = partialFits[j].status;
+                fits[i].merged = true;
+                fits[i].newTable = false;
+            }
         }
-        for(int k=0; k<numPMTS; k++){
-            delete hitHistos[k];
-            hitHistos[k] = 0;
+    }
+    forEachFibre(fits,numThreads,prepareTable,numNewTables(fits) ? "Tabulating the time of flight" : NULL);
+    for(unsigned int i=0; i<fits.size(); i++){
+        if(fits[i].newTable){
+            reportTable(fits[i].tofTable,fits[i].led);
+            WriteTOFTable(table_file,fits[i].tofTable);
         }
-        free(numHits);
-        free(hitTimes);
-        free(hitErrors);
     }
-    TVector3 totalOffsetVector(0,0,0);
-    double oneOverSumErrorSquared = 0;
-    for(int i=0; i<fibreNumbers.size(); i++){
-        led = GetLEDInfoFromFibreNr(fibreNumbers[i],0);
-        oneOverSumErrorSquared += 1.0/(offsetErrors[i]*offsetErrors[i]);
-        totalOffsetVector+=(led.direction.Unit())*(offsets[i]/(offsetErrors[i]*offsetErrors[i]));
+    if(fitCentre){
+        if(!partialOutput.empty()){
+            writePartial(partialOutput,fibreHits,vector<FibreFit>());
+        }
+        TVector3 centre, error;
+        int status;
+        fitAVCentre(fits,numThreads,centre,error,status);
+        cout << "AV centre from all fibres is : (" << centre.X() << " +/- " << error.X() << ","
+             << centre.Y() << " +/- " << error.Y() << "," << centre.Z() << " +/- " << error.Z() << ")" << endl;
+        TH1D * avCentre = new TH1D("avCentre","AV centre fitted to all fibres (x,y,z)",3,-0.5,2.5);
+        avCentre->SetYTitle("offset (mm)");
+        for(int k=0; k<3; k++){
+            avCentre->SetBinContent(k+1,centre[k]);
+            avCentre->SetBinError(k+1,error[k]);
+        }
+        plot_file->cd();
+        avCentre->Write();
+        plot_file->Close();
+        if ( table_file ) table_file->Close();
+        PrintStats();
+        return 0;
+    }
+    forEachFibre(fits,numThreads,fitUnlessMerged);
+    if(!partialOutput.empty()){
+        writePartial(partialOutput,fibreHits,fits);
+    }
+    for(unsigned int i=0; i<fits.size(); i++){
+        FibreFit & fit = fits[i];
+        double value = fit.value;
+        double error = fit.error;
+        if(atFitLimit(value)){
+            cout<<"Fibre number "<<fit.fibre<< "has reached the limit and will not be included in calculation of AV position"<<endl;
+        }
+        offsetAndErrors->SetBinContent(fibreNumbers[i],value);
+        offsetAndErrors->SetBinError(fibreNumbers[i],error);
+        offsets.push_back(value);
+        offsetErrors.push_back(error);
+    }
+    vector<TVector3> directions;
+    for(unsigned int i=0; i<fits.size(); i++){
+        directions.push_back(fits[i].led.direction);
     }
-    //Subtracting num bad fits with error 1
-    totalOffsetVector *= 1.0/(oneOverSumErrorSquared-numBadFits);
+    TMatrixDSym covariance(3);
+    TVector3 totalOffsetVector = combineOffsets(directions,offsets,offsetErrors,&covariance);
     cout << "Average AV offset over all fibres is : ("<<totalOffsetVector.X()<<","<<totalOffsetVector.Y()<<","<<totalOffsetVector.Z()<<")"<<endl;
+    cout << "Errors from the covariance : (" << sqrt(covariance(0,0)) << "," << sqrt(covariance(1,1)) << "," << sqrt(covariance(2,2)) << ")" << endl;
+    plot_file->cd();
+    covariance.Write("offset_covariance");
+    if(numBootstrap>0){
+        //Fibres are resampled on separate threads, each refits all its replicas reusing the same buffers
+        forEachFibre(fits,numThreads,bootstrapFibre);
+        for(unsigned int i=0; i<fits.size(); i++){
+            FibreFit & fit = fits[i];
+            char name[64];
+            sprintf(name,"bootstrap_fibre%d",fit.fibre);
+            //A failed fit or one at the limit has no usable error, bin those over the table range
+            double lower = tableOffsetMin;
+            double upper = tableOffsetMax;
+            if(fit.status!=-1 && fit.error>0 && !atFitLimit(fit.value)){
+                lower = fit.value-10*fit.error;
+                upper = fit.value+10*fit.error;
+            }
+            TH1D * bootHisto = new TH1D(name,name,100,lower,upper);
+            bootHisto->SetXTitle("offset (mm)");
+            for(int r=0; r<numBootstrap; r++){
+                bootHisto->Fill(fit.bootValues[r]);
+            }
+            cout << "Fibre " << fit.fibre << ": offset " << fit.value << " +/- " << fit.error << " (Minuit), bootstrap rms "
+                 << bootHisto->GetRMS() << endl;
+            bootHisto->Write();
+        }
+        //Combined offset vector of each replica
+        TH1D * bootVector[3];
+        const char * names[3] = {"bootstrap_offset_x","bootstrap_offset_y","bootstrap_offset_z"};
+        for(int k=0; k<3; k++){
+            bootVector[k] = new TH1D(names[k],names[k],100,totalOffsetVector[k]-50,totalOffsetVector[k]+50);
+            bootVector[k]->SetXTitle("offset (mm)");
+        }
+        vector<double> values(fits.size()), errors(fits.size());
+        for(int r=0; r<numBootstrap; r++){
+            for(unsigned int i=0; i<fits.size(); i++){
+                values[i] = fits[i].bootValues[r];
+                errors[i] = fits[i].bootErrors[r];
+            }
+            TVector3 replica = combineOffsets(directions,values,errors);
+            for(int k=0; k<3; k++){
+                bootVector[k]->Fill(replica[k]);
+            }
+        }
+        cout << "Bootstrap rms of the AV offset over " << numBootstrap << " replicas : (" << bootVector[0]->GetRMS() << ","
+             << bootVector[1]->GetRMS() << "," << bootVector[2]->GetRMS() << ")" << endl;
+        for(int k=0; k<3; k++){
+            bootVector[k]->Write();
+        }
+    }
     offsetAndErrors->Write();
     plot_file->Close();
+    if ( table_file ) table_file->Close();
+    PrintStats();
     return 0;
 }
 
-//Method to perform the time and distance cuts and fill up the hitTimes and hitError arrays with the data to be fitted to
-void timeCuts(int fibreNumber){
+//Set up the fit of a fibre and fill it with the bucketed hits, the table is read from the table file
+//if it is there, otherwise it is left to prepareTable
+void setupFit(FibreFit & fit, const FibreHits & hits, const RAT::DU::LightPathCalculator & lp,
+              const RAT::DU::GroupVelocity & gv, TFile * table_file){
+    fit.fibre = hits.fibre_nr;
+    fit.led = GetLEDInfoFromFibreNr(fit.fibre,hits.fibre_sub);
+    fit.pmtArrays.Resize(numPMTS,FibreFit::kNumArrays);
+    fit.weighted = false;
+    fit.pmts = &pmts;
+    fit.useTOFTable = useTOFTable;
+    fit.lp = &lp;
+    fit.gv = gv;
+    fit.vgroup = useSpectrum ? &GetGroupVelocityTable() : NULL;
+    fit.offsetMin = tableOffsetMin;
+    fit.offsetMax = tableOffsetMax;
+    fit.value = 0;
+    fit.error = 0;
+    fit.status = -1;
+    fit.warmStart = false;
+    fit.merged = false;
+    timeCuts(fit,hits);
+    fit.newTable = useTOFTable && !ReadTOFTable(table_file,fit.led.nr,fit.led.sub,tableOffsetMin,tableOffsetMax,tableNumOffsets,fit.tofTable,useSpectrum ? 1 : 0);
+}
+
+//Tabulate the time of flight for a fibre which was not in the table file, can run on any thread
+void prepareTable(FibreFit & fit){
+    AVLOC_TIMER("prepareTable");
+    if(fit.newTable){
+        //small margin on the distance cut so rounding in the ntuple distance never drops a PMT from the table
+        fit.tofTable = BuildTOFTable(fit.led,pmts,distCut+50.,tableOffsetMin,tableOffsetMax,tableNumOffsets,*fit.lp,fit.gv,fit.vgroup);
+    }
+}
+
+//Number of fibres prepareTable has to tabulate
+int numNewTables(const vector<FibreFit> & fits){
+    int num = 0;
+    for(unsigned int i=0; i<fits.size(); i++){
+        if(fits[i].newTable){
+            num++;
+        }
+    }
+    return num;
+}
+
+//Size of a new table, on the main thread once the tables are built
+void reportTable(const TOFTable & table, const LEDInfo & led){
+    cout << "BuildTOFTable: tabulated " << table.lcn.size() << " PMTs x " << table.n_offsets
+         << " offsets for " << led.name << endl;
+}
+
+//Fit the AV offset for one fibre with the options of this job, can run on any thread
+void fitFibre(FibreFit & fit){
+    FitFibre(fit,useGradient);
+}
+
+//fitFibre for fibres which were not fitted already by the job writing their partial result
+void fitUnlessMerged(FibreFit & fit){
+    if(!fit.merged){
+        fitFibre(fit);
+    }
+}
+
+//Refit the fibre for bootstrap replicas of its hit PMTs, each replica draws as many PMTs as were hit,
+//with replacement, and weights each PMT in the chisq by the number of times it was drawn
+void bootstrapFibre(FibreFit & fit){
+    double value = fit.value;
+    double error = fit.error;
+    int status = fit.status;
+    vector<int> hitPMTs;
+    for(int i=0; i<numPMTS; i++){
+        if(fit.numHits(i)!=0){
+            hitPMTs.push_back(i);
+        }
+    }
+    TRandom3 random(bootstrapSeed+fit.fibre);
+    fit.bootValues.resize(numBootstrap);
+    fit.bootErrors.resize(numBootstrap);
+    fit.weighted = true;
+    for(int r=0; r<numBootstrap; r++){
+        for(unsigned int i=0; i<hitPMTs.size(); i++){
+            fit.weights(hitPMTs[i]) = 0;
+        }
+        for(unsigned int i=0; i<hitPMTs.size(); i++){
+            fit.weights(hitPMTs[random.Integer(hitPMTs.size())]) += 1;
+        }
+        fitFibre(fit);
+        fit.bootValues[r] = fit.value;
+        fit.bootErrors[r] = fit.error;
+    }
+    fit.weighted = false;
+    fit.value = value;
+    fit.error = error;
+    fit.status = status;
+}
+
+//Method to fill up the hitTimes and hitError arrays with the data to be fitted to
+//The time and distance cuts are applied by BucketHits
+void timeCuts(FibreFit & fit, const FibreHits & hits){
+    AVLOC_TIMER("timeCuts");
     //Calculating time cut limits Using fibre FT003A and PMT LCN 2755
     //Upper time is pmt just below dist cut seperation 2086mm
     //double upperTime = trialFunction(14,6459,5500);
@@ -217,65 +720,360 @@ void timeCuts(int fibreNumber){
     //double lowerTime = 2*(rPSUP-rAV-500)/vg;
     //Have to divide by 2 to get hypotenuse as dist cut double, but also have a factor of 2 for light to av and light reflected off AV factors cancel
     //double upperTime = distCut/(vg*sin(xAngle));
-    double lowerTime = 15;
-    double upperTime = 30;
-    int events = ntuple->GetEntries();
-    for(int i=0; i<events; i++){
-        ntuple->GetEntry(i);
-        int  fibre  = (int)ntuple->GetArgs()[0];
-        int    sub  = (int)ntuple->GetArgs()[1];
-        int    lcn  = (int)ntuple->GetArgs()[2];
-        double time = (double)ntuple->GetArgs()[3];
-        double dis  = (double)ntuple->GetArgs()[4]; 
-        //Fibre number cut
-        if(fibre == fibreNumber){
-            //Distance cuts
-            if(dis < distCut){
-                //Time Cuts
-                if(lowerTime<time && time<upperTime){
-                    numHits[lcn]++;
-                    hitHistos[lcn]->Fill(time);
-                }
-            }
-        }
+    for(int i=0; i<numPMTS; i++){
+        fit.numHits(i) = GetNumHits(hits,i);
+    }
+    //Difference between the gaussian fits and the peak estimates when validating, also in units of the fit error
+    double sumDiff = 0;
+    double sumPull = 0;
+    double sumPull2 = 0;
+    int numDiff = 0;
+    //One histogram outside of any directory is refilled for each PMT that is fitted
+    TH1D * hitHisto = NULL;
+    if(fitHistos){
+        hitHisto = new TH1D("hitHisto","hitHisto",hits.n_bins,hits.time_min,hits.time_max);
+        hitHisto->SetDirectory(0);
     }
     for(int i=0; i<numPMTS; i++){
-        if(numHits[i]<=30){
-            numHits[i]=0;
+        if(fit.numHits(i)<=30){
+            fit.numHits(i)=0;
+        }
+        else if(!fitHistos){
+            GetHitPeak(hits,i,fit.hitTimes(i),fit.hitErrors(i));
         }
         else{
-            hitHistos[i]->Fit("gaus","Q","");
-            TF1 * f = hitHistos[i]->GetFunction("gaus");
-            hitTimes[i]=f->GetParameter(1);
-            hitErrors[i]=f->GetParError(1);
+            FillHitHisto(hits,i,hitHisto);
+            hitHisto->Fit("gaus","Q","");
+            TF1 * f = hitHisto->GetFunction("gaus");
+            fit.hitTimes(i)=f->GetParameter(1);
+            fit.hitErrors(i)=f->GetParError(1);
+            double peak, error;
+            GetHitPeak(hits,i,peak,error);
+            double diff = fit.hitTimes(i)-peak;
+            double pull = fit.hitErrors(i)>0 ? diff/fit.hitErrors(i) : 0;
+            sumDiff += diff;
+            sumPull += pull;
+            sumPull2 += pull*pull;
+            numDiff++;
+        }
+    }
+    delete hitHisto;
+    if(numDiff>0){
+        double meanPull = sumPull/numDiff;
+        cout << "Fibre " << fit.fibre << ": gaussian fit - peak estimate averaged over " << numDiff << " PMTs is " << sumDiff/numDiff
+             << " ns, " << meanPull << " +/- " << sqrt(max(sumPull2/numDiff-meanPull*meanPull,0.)) << " fit errors" << endl;
+    }
+    if(screenMargin>0){
+        int numDropped = screenHitTimes(fit);
+        if(numDropped>0){
+            cout << "Fibre " << fit.fibre << ": dropped " << numDropped << " PMTs more than " << screenMargin
+                 << " ns outside the reflection times" << endl;
         }
     }
 
 };
 
-double trialFunction(int fibreNumber, int LCN,double AVOffset ){
-    led = GetLEDInfoFromFibreNr(fibreNumber,0);
-    PMTPos =  TVector3(pmts.x_pos[LCN],pmts.y_pos[LCN],pmts.z_pos[LCN]);
-    TVector3 PMT_dir(pmts.x_dir[LCN],pmts.y_dir[LCN],pmts.z_dir[LCN]);
-    lp.SetAVOffset(AVOffset);
-    double localityVal = 10;
-    double energy = lp.WavelengthToEnergy(506.787e-6);
-    //double energy = 0.00000243658;
-    lp.CalcByPosition(led.position, PMTPos, energy, localityVal);
-    double distInWater = lp.GetDistInWater();
-    double distInScint = lp.GetDistInInnerAV();
-    double distInAV = lp.GetDistInAV();
-    double timeOfFlight = gv.CalcByDistance(distInScint,distInAV,distInWater,energy);
-    //Adding time spent in pmt
-    TVector3 entryDir = lp.GetIncidentVecOnPMT();
-    double angleOfEntry = entryDir.Angle(PMT_dir)*TMath::RadToDeg();
-    timeOfFlight += gv.PMTBucketTime(angleOfEntry);
-    return timeOfFlight;
-};
+//Pre-screen of the hit times with the batch TimeOfFlight: the fibre is moved along its position by the
+//table offset limits as in the light path calculator and PMTs whose peak is outside the times at the
+//limits by more than screenMargin are dropped, no offset in the fit range can explain them
+//returns the number of PMTs dropped
+int screenHitTimes(FibreFit & fit){
+    AVLOC_TIMER("screenHitTimes");
+    const PMTGeometry & geo = GetPMTGeometry();
+    assert(geo.n_pmts==numPMTS);
+    //The model needs the group refractive index of the water
+    PhysicsNr vgroup = GetGroupVelocityTable().vgroup;
+    PhysicsNr n_h2o;
+    n_h2o.value = 299.792458/vgroup.value;
+    n_h2o.error = n_h2o.value*vgroup.error/vgroup.value;
+    double radius = fit.led.position.Mag();
+    vector<double> tofMin(numPMTS), tofMax(numPMTS);
+    TimeOfFlight(geo,fit.led.position*((radius+tableOffsetMin)/radius),n_h2o,1.,&tofMin[0]);
+    TimeOfFlight(geo,fit.led.position*((radius+tableOffsetMax)/radius),n_h2o,1.,&tofMax[0]);
+    int numDropped = 0;
+    for(int i=0; i<numPMTS; i++){
+        if(fit.numHits(i)==0){
+            continue;
+        }
+        double lower = min(tofMin[i],tofMax[i])-screenMargin;
+        double upper = max(tofMin[i],tofMax[i])+screenMargin;
+        if(fit.hitTimes(i)<lower || fit.hitTimes(i)>upper){
+            fit.numHits(i)=0;
+            numDropped++;
+        }
+    }
+    return numDropped;
+}
 
+//RAT files matching the online patterns, in name order
+vector<string> onlineFiles(){
+    vector<string> files;
+    for(unsigned int i=0; i<onlinePatterns.size(); i++){
+        glob_t matches;
+        if(glob(onlinePatterns[i].c_str(),0,NULL,&matches)==0){
+            for(size_t k=0; k<matches.gl_pathc; k++){
+                files.push_back(matches.gl_pathv[k]);
+            }
+        }
+        globfree(&matches);
+    }
+    sort(files.begin(),files.end());
+    files.erase(unique(files.begin(),files.end()),files.end());
+    return files;
+}
 
+//RAT files are only complete once they are closed, so while waiting for new files
+//the ones changed within the last few seconds are left for the next look
+bool fileSettled(const string & filename){
+    struct stat info;
+    if(stat(filename.c_str(),&info)!=0){
+        return false;
+    }
+    return onlineWait<=0 || difftime(time(NULL),info.st_mtime)>=2;
+}
 
+//Fit a fibre from the previous minimum, fibres without PMTs passing the cuts are not fitted (status -1)
+void fitOnlineFibre(FibreFit & fit){
+    int numHitPMTs = 0;
+    for(int i=0; i<numPMTS; i++){
+        if(fit.numHits(i)!=0){
+            numHitPMTs++;
+        }
+    }
+    if(numHitPMTs==0){
+        fit.status = -1;
+        return;
+    }
+    fitFibre(fit);
+    fit.warmStart = true;
+}
 
+//Refit all fibres with the hits so far, fibres seen for the first time are set up and get their tables
+//numFitted: filled with the number of fibres in the combined offset
+TVector3 refreshOnline(vector<FibreFit> & fits, const HitBuckets & buckets, const RAT::DU::LightPathCalculator & lp,
+                       const RAT::DU::GroupVelocity & gv, TFile * table_file, int numThreads, int & numFitted){
+    AVLOC_TIMER("refreshOnline");
+    const vector<FibreHits> & fibreHits = buckets.GetFibres();
+    unsigned int numOld = fits.size();
+    fits.resize(fibreHits.size());
+    for(unsigned int i=0; i<fits.size(); i++){
+        if(i<numOld){
+            timeCuts(fits[i],fibreHits[i]);
+        }
+        else{
+            setupFit(fits[i],fibreHits[i],lp,gv,table_file);
+        }
+    }
+    forEachFibre(fits,numThreads,prepareTable,numNewTables(fits) ? "Tabulating the time of flight" : NULL);
+    for(unsigned int i=numOld; i<fits.size(); i++){
+        if(fits[i].newTable){
+            reportTable(fits[i].tofTable,fits[i].led);
+            WriteTOFTable(table_file,fits[i].tofTable);
+            fits[i].newTable = false;
+        }
+    }
+    forEachFibre(fits,numThreads,fitOnlineFibre);
+    //Only the directions and results of the fitted fibres are collected, not copies of their fits
+    vector<TVector3> directions;
+    vector<double> values, errors;
+    for(unsigned int i=0; i<fits.size(); i++){
+        if(fits[i].status!=-1){
+            directions.push_back(fits[i].led.direction);
+            values.push_back(fits[i].value);
+            errors.push_back(fits[i].error);
+        }
+    }
+    numFitted = directions.size();
+    if(directions.empty()){
+        return TVector3(0,0,0);
+    }
+    return combineOffsets(directions,values,errors);
+}
 
+//Online mode: events from the RAT files are bucketed as they are read and all fibres are refitted
+//every onlineEvents events, starting from the previous minimum. The hits are added to the ntuple,
+//so the batch fit can be rerun later without processing the RAT files again
+int runOnline(const string & ntuple_filename, TFile * plot_file, TFile * table_file,
+              const RAT::DU::LightPathCalculator & lp, const RAT::DU::GroupVelocity & gv, int numThreads){
+    TFile * ntuple_file = new TFile(ntuple_filename.data(),"UPDATE");
+    if ( !ntuple_file->IsOpen() ) {
+        cerr << "Could not open file " << ntuple_filename << endl;
+        return 0;
+    }
+    HitWriter * writer = new HitWriter(ntuple_file);
+    if ( !writer->IsOpen() ) {
+        delete writer;
+        ntuple_file->Close();
+        return 0;
+    }
+    NtupleProcessor processor;
+    HitBuckets buckets(distCut,lowerTime,upperTime,51,0,50);
+    vector<FibreFit> fits;
+    set<string> processed;
+    long numEvents = 0;
+    long eventsAtFit = 0;
+    //Combined offset after each refit
+    TGraph * onlineOffset[3];
+    const char * names[3] = {"online_offset_x","online_offset_y","online_offset_z"};
+    for(int k=0; k<3; k++){
+        onlineOffset[k] = new TGraph();
+        onlineOffset[k]->SetName(names[k]);
+    }
+    auto refresh = [&](){
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int numFitted = 0;
+        TVector3 offset = refreshOnline(fits,buckets,lp,gv,table_file,numThreads,numFitted);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        eventsAtFit = numEvents;
+        if(numFitted==0){
+            cout << "Online fit after " << numEvents << " events: no fibre has enough hits yet" << endl;
+            return;
+        }
+        cout << "Online fit after " << numEvents << " events (" << numFitted << " fibres, " << seconds << " s) : AV offset ("
+             << offset.X() << "," << offset.Y() << "," << offset.Z() << ")" << endl;
+        for(int k=0; k<3; k++){
+            onlineOffset[k]->SetPoint(onlineOffset[k]->GetN(),numEvents,offset[k]);
+        }
+    };
+    chrono::steady_clock::time_point lastFile = chrono::steady_clock::now();
+    while(true){
+        vector<string> files = onlineFiles();
+        bool found = false;
+        for(unsigned int i=0; i<files.size(); i++){
+            if(processed.count(files[i]) || !fileSettled(files[i])){
+                continue;
+            }
+            processed.insert(files[i]);
+            found = true;
+            LEDInfo led = GetLEDInfoFromFileName(files[i]);
+            RAT::DS::Entry * rDS  = NULL;
+            RAT::DS::Run  * rRun = NULL;
+            TTree         * tree = NULL;
+            LoadRootFile(files[i],&tree,&rDS,&rRun,true,64*1024*1024);
+            HitBuffer fileHits;
+            for(Long64_t iEvent=0; iEvent<tree->GetEntries(); iEvent++){
+                tree->GetEntry(iEvent);
+                HitBuffer eventHits;
+                processor.ProcessEventMC(*rDS,eventHits);
+                buckets.Add(led,eventHits,pmts);
+                fileHits.lcn.insert(fileHits.lcn.end(),eventHits.lcn.begin(),eventHits.lcn.end());
+                fileHits.time.insert(fileHits.time.end(),eventHits.time.begin(),eventHits.time.end());
+                AVLOC_COUNT("events processed");
+                if(++numEvents-eventsAtFit>=onlineEvents){
+                    refresh();
+                }
+            }
+            TFile * file = tree->GetCurrentFile();
+            file->Close();
+            delete file;
+            delete rDS;
+            delete rRun;
+            cout << files[i] << ": " << fileHits.lcn.size() << " hits" << endl;
+            writer->Fill(led,fileHits);
+        }
+        if(found){
+            lastFile = chrono::steady_clock::now();
+            continue;
+        }
+        if(chrono::duration<double>(chrono::steady_clock::now()-lastFile).count()>=onlineWait){
+            break;
+        }
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+    if(numEvents>eventsAtFit || onlineOffset[0]->GetN()==0){
+        refresh();
+    }
+    writer->Write();
+    delete writer;
+    ntuple_file->Close();
+    TH1D * offsetAndErrors = new TH1D("offsetAndErrors","offsetAndErrors",100,0,100);
+    for(unsigned int i=0; i<fits.size(); i++){
+        if(fits[i].status!=-1){
+            offsetAndErrors->SetBinContent(fits[i].fibre,fits[i].value);
+            offsetAndErrors->SetBinError(fits[i].fibre,fits[i].error);
+        }
+    }
+    plot_file->cd();
+    offsetAndErrors->Write();
+    for(int k=0; k<3; k++){
+        onlineOffset[k]->Write();
+    }
+    plot_file->Close();
+    if ( table_file ) table_file->Close();
+    PrintStats();
+    return 0;
+}
 
+//Partial result of a fibre sharded job: the buckets of its fibres ("avlocbuckets", see WriteFibreHits)
+//and, if the offsets were fitted, one "avlocfits" entry per fibre
+void writePartial(const string & filename, const vector<FibreHits> & fibreHits, const vector<FibreFit> & fits){
+    TFile * file = new TFile(filename.data(),"RECREATE");
+    if ( !file->IsOpen() ) {
+        cerr << "Could not open file " << filename << endl;
+        return;
+    }
+    WriteFibreHits(file,fibreHits);
+    int nr, sub, status;
+    double value, error;
+    TTree * tree = new TTree("avlocfits","AV offset fitted per fibre");
+    tree->Branch("fibre_nr",&nr,"fibre_nr/I");
+    tree->Branch("fibre_sub",&sub,"fibre_sub/I");
+    tree->Branch("value",&value,"value/D");
+    tree->Branch("error",&error,"error/D");
+    tree->Branch("status",&status,"status/I");
+    for(unsigned int i=0; i<fits.size(); i++){
+        nr = fits[i].led.nr;
+        sub = fits[i].led.sub;
+        value = fits[i].value;
+        error = fits[i].error;
+        status = fits[i].status;
+        tree->Fill();
+    }
+    tree->Write();
+    file->Close();
+    delete file;
+    cout << "Wrote partial result for " << fibreHits.size() << " fibres to " << filename << endl;
+}
 
+//Merge the buckets of all partial results, numFiles counts the files holding each merged fibre
+//partialFits: the fits found in the files, only led.nr, led.sub, value, error and status are set
+bool readPartials(vector<FibreHits> & fibreHits, vector<FibreFit> & partialFits, vector<int> & numFiles){
+    for(unsigned int f=0; f<partialInputs.size(); f++){
+        TFile * file = new TFile(partialInputs[f].data(),"READ");
+        if ( !file->IsOpen() ) {
+            cerr << "Could not open file " << partialInputs[f] << endl;
+            return false;
+        }
+        vector<FibreHits> fileHits;
+        if(!ReadFibreHits(file,fileHits) || !MergeFibreHits(fibreHits,fileHits)){
+            cerr << "Could not merge the partial result " << partialInputs[f] << endl;
+            return false;
+        }
+        numFiles.resize(fibreHits.size(),0);
+        for(unsigned int i=0; i<fileHits.size(); i++){
+            for(unsigned int j=0; j<fibreHits.size(); j++){
+                if(fibreHits[j].fibre_nr==fileHits[i].fibre_nr && fibreHits[j].fibre_sub==fileHits[i].fibre_sub){
+                    numFiles[j]++;
+                }
+            }
+        }
+        TTree * tree = (TTree*)file->Get("avlocfits");
+        if(tree){
+            FibreFit fit;
+            tree->SetBranchAddress("fibre_nr",&fit.led.nr);
+            tree->SetBranchAddress("fibre_sub",&fit.led.sub);
+            tree->SetBranchAddress("value",&fit.value);
+            tree->SetBranchAddress("error",&fit.error);
+            tree->SetBranchAddress("status",&fit.status);
+            for(Long64_t i=0; i<tree->GetEntries(); i++){
+                tree->GetEntry(i);
+                partialFits.push_back(fit);
+            }
+            tree->ResetBranchAddresses();
+        }
+        cout << "Merged " << fileHits.size() << " fibres from " << partialInputs[f] << endl;
+        file->Close();
+        delete file;
+    }
+    return true;
+}
@@ -5,12 +5,23 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <fstream>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <glob.h>
 
 #include <TBenchmark.h>
 #include <TApplication.h>
 #include <TCanvas.h>
+#include <TEnv.h>
 #include <TGraph.h>
 #include <TFile.h>
+#include <TROOT.h>
 #include <TTree.h>
 
 #include <RAT/DB.hh>
@@ -21,38 +32,146 @@
 
 #include "include/AVLocTools.h"
 #include "include/AVLocProc.h"
+#include "include/AVLocNtuple.h"
+#include "include/AVLocStats.h"
 
 using namespace std;
 
-int main(int argc,char **argv)
+// One input file, processed by a worker thread and written by the main thread
+struct FileJob {
+  string    filename;
+  LEDInfo   led_info;
+  HitBuffer hits;
+  bool      done;
+  bool      ok;
+};
+
+// order of the jobs in the output, hits of one fibre are kept together for the index
+bool CompareFibre(const FileJob & a, const FileJob & b)
 {
-  TBenchmark benchmark;
-  benchmark.Start("MAKENTUPLE");
-  string filename;
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[0] << " <filename>" << endl;
-    return 1;
+  if ( a.led_info.nr != b.led_info.nr ) return a.led_info.nr < b.led_info.nr;
+  return a.led_info.sub < b.led_info.sub;
+}
+
+// add filename to the list, expanding wildcards
+void AddInputFiles(string pattern, vector<string> & filenames)
+{
+  glob_t matches;
+  if ( glob(pattern.c_str(),0,NULL,&matches) == 0 ) {
+    for (size_t i = 0 ; i < matches.gl_pathc ; ++i) filenames.push_back(matches.gl_pathv[i]);
   }
-  else{
-    filename = argv[1];
+  else {
+    filenames.push_back(pattern);
   }
+  globfree(&matches);
+}
+
+// fill the hit buffer from all events in a RAT file, safe to call from any thread
+// hitsOnly and cacheSize as in LoadRootFile
+bool ProcessFile(FileJob & job, const NtupleProcessor & processor, bool hitsOnly, Long64_t cacheSize)
+{
   RAT::DS::Entry * rDS  = NULL;
   RAT::DS::Run  * rRun = NULL;
   TTree         * tree = NULL;
-  LoadRootFile(filename,&tree,&rDS,&rRun);
+  LoadRootFile(job.filename,&tree,&rDS,&rRun,hitsOnly,cacheSize);
   assert(rDS);
   assert(rRun);
   assert(tree);  
-  LoadDataBase("make_ntuple.log");
-  LEDInfo led_info = GetLEDInfoFromFileName(filename);
-  //cout << "FILENAME IS: "<<filename<<endl;
-  unsigned first = filename.find("/");
-  unsigned last = filename.find(".");
-  string filenameNew = filename.substr(first+1,last-first-1);
+  bool ok = true;
+  for( int iEvent = 0; iEvent < tree->GetEntries() && ok ; ++iEvent) {
+    {
+      AVLOC_TIMER("tree->GetEntry");
+      tree->GetEntry(iEvent);
+    }
+    AVLOC_TIMER("ProcessEventMC");
+    ok = processor.ProcessEventMC(*rDS,job.hits);
+    AVLOC_COUNT("events processed");
+  }
+  TFile * file = tree->GetCurrentFile();
+  AVLOC_COUNT_N("RAT file bytes read",file->GetBytesRead());
+  file->Close();
+  delete file;
+  delete rDS;
+  delete rRun;
+  return ok;
+}
+
+int main(int argc,char **argv)
+{
+  TBenchmark benchmark;
+  benchmark.Start("MAKENTUPLE");
+  vector<string> filenames;
+  string output_name;
+  int numThreads = 1;
+  bool hitsOnly = true;
+  Long64_t cacheSize = 64*1024*1024;
+  bool prefetch = false;
+  for (int i = 1 ; i < argc ; ++i) {
+    string arg = argv[i];
+    if ( arg == "-j" && i+1 < argc ) {
+      numThreads = atoi(argv[++i]);
+      if ( numThreads < 1 ) numThreads = 1;
+    }
+    else if ( arg == "-a" ) {
+      hitsOnly = false;
+    }
+    else if ( arg == "-c" && i+1 < argc ) {
+      cacheSize = atol(argv[++i])*1024*1024;
+      if ( cacheSize < 0 ) cacheSize = 0;
+    }
+    else if ( arg == "-p" ) {
+      prefetch = true;
+    }
+    else if ( arg == "-o" && i+1 < argc ) {
+      output_name = argv[++i];
+    }
+    else if ( arg == "-l" && i+1 < argc ) {
+      ifstream list(argv[++i]);
+      string line;
+      while ( list >> line ) AddInputFiles(line,filenames);
+    }
+    else {
+      AddInputFiles(arg,filenames);
+    }
+  }
+  if ( filenames.empty() ) {
+    cerr << "Usage: " << argv[0] << " [-j <threads>] [-o <output name>] [-l <file list>] [-a] [-c <MB>] [-p] <filename> [<filename> ...]" << endl;
+    cerr << "  filenames may contain wildcards, all hits go to summary_ntuple<output name>.root" << endl;
+    cerr << "  default output name is taken from the first file" << endl;
+    cerr << "  -a : read the full RAT entry instead of the calibrated hits and MC event only" << endl;
+    cerr << "  -c : TTreeCache size for the RAT files in MB (default 64, 0 for the ROOT default)" << endl;
+    cerr << "  -p : prefetch the next baskets asynchronously" << endl;
+    return 1;
+  }
+  {
+    AVLOC_TIMER("RATDB loading");
+    LoadDataBase("make_ntuple.log");
+  }
+  // LED lookups use the database, so are done here rather than on the workers
+  vector<FileJob> jobs(filenames.size());
+  for (unsigned int i = 0 ; i < filenames.size() ; ++i) {
+    jobs[i].filename = filenames[i];
+    jobs[i].led_info = GetLEDInfoFromFileName(filenames[i]);
+    jobs[i].done     = false;
+    jobs[i].ok       = false;
+  }
+  stable_sort(jobs.begin(),jobs.end(),CompareFibre);
+  if ( output_name.empty() ) {
+    string filename = filenames[0];
+    //cout << "FILENAME IS: "<<filename<<endl;
+    unsigned first = filename.find("/");
+    unsigned last = filename.find(".");
+    output_name = filename.substr(first+1,last-first-1);
+  }
   TFile * ntuple_file = NULL;
-  TNtuple * ntuple = GetNtuple(&ntuple_file,filenameNew);
+  HitWriter * hits = GetHitWriter(&ntuple_file,output_name);
   assert(ntuple_file);
-  assert(ntuple);
+  assert(hits);
+  if ( !hits->IsOpen() ) {
+    delete hits;
+    ntuple_file->Close();
+    return 1;
+  }
 
   // get dispersion graph and change x values from MeV to nm
   // y values are presumable the speed in mm/ns
@@ -84,34 +203,88 @@ int main(int argc,char **argv)
   pmtfile += "/data/pmt/airfill2.ratdb";
   RAT::DB * db = RAT::DB::Get();
   assert(db);
-  db->LoadFile(pmtfile);
-  RAT::DBLinkPtr pmtInfo = db->GetLink("PMTINFO");
-  assert(pmtInfo);
-  PMTInfo pmt_info;
-  pmt_info.x_pos = pmtInfo->GetDArray("x");
-  pmt_info.y_pos = pmtInfo->GetDArray("y");
-  pmt_info.z_pos = pmtInfo->GetDArray("z");
   string geofile = rat;
   geofile += "/data/geo/snoplus.geo";
-  db->Load(geofile);
-  //RAT::DB::Get()->LoadDefaults();
-  db->Load(pmtfile);
-  RAT::DU::Utility::Get()->BeginOfRun();
+  {
+    AVLOC_TIMER("RATDB loading");
+    db->Load(geofile);
+    //RAT::DB::Get()->LoadDefaults();
+    db->Load(pmtfile);
+    RAT::DU::Utility::Get()->BeginOfRun();
+  }
   
-  for( int iEvent = 0; iEvent < tree->GetEntries() ; ++iEvent) {
-    tree->GetEntry(iEvent);
-    if ( !ProcessEventNtupleMC(rDS,ntuple,led_info,pmt_info) ) return 1; 
+  NtupleProcessor processor;
+
+  // workers fill one hit buffer per file, the main thread writes them out in
+  // fibre order as they finish so the output does not depend on the number of threads
+  // there is at least one worker next to the main thread, also with one thread, and both use ROOT I/O
+  ROOT::EnableThreadSafety();
+  // read by every TFile opened afterwards, so set once before the workers start
+  if ( prefetch ) gEnv->SetValue("TFile.AsyncPrefetching",1);
+  atomic<unsigned int> next(0);
+  mutex done_mutex;
+  condition_variable done_cond;
+  // a worker only starts a file if fewer than numThreads files before it are still to be
+  // written, so one slow file does not keep the buffers of all later files in memory
+  unsigned int written = 0;
+  auto worker = [&](){
+    for (unsigned int i = next++ ; i < jobs.size() ; i = next++) {
+      {
+	unique_lock<mutex> lock(done_mutex);
+	while ( i >= written + (unsigned int)numThreads ) done_cond.wait(lock);
+      }
+      bool ok = ProcessFile(jobs[i],processor,hitsOnly,cacheSize);
+      lock_guard<mutex> lock(done_mutex);
+      jobs[i].ok   = ok;
+      jobs[i].done = true;
+      done_cond.notify_all();
+    }
+  };
+  vector<thread> threads;
+  for (int i = 0 ; i < min(numThreads,(int)jobs.size()) ; ++i) threads.push_back(thread(worker));
+  bool ok = true;
+  for (unsigned int i = 0 ; i < jobs.size() ; ++i) {
+    {
+      unique_lock<mutex> lock(done_mutex);
+      while ( !jobs[i].done ) done_cond.wait(lock);
+    }
+    if ( !jobs[i].ok ) {
+      cerr << "Failed to process " << jobs[i].filename << endl;
+      ok = false;
+    }
+    cout << jobs[i].filename << ": " << jobs[i].hits.lcn.size() << " hits" << endl;
+    {
+      AVLOC_TIMER("HitWriter::Fill");
+      hits->Fill(jobs[i].led_info,jobs[i].hits);
+    }
+    AVLOC_COUNT_N("hits filled",jobs[i].hits.lcn.size());
+    jobs[i].hits.Clear();
+    {
+      lock_guard<mutex> lock(done_mutex);
+      written = i+1;
+    }
+    done_cond.notify_all();
   }
+  for (unsigned int i = 0 ; i < threads.size() ; ++i) threads[i].join();
 
-  ntuple->Write();
+  hits->Write();
+  delete hits;
   ntuple_file->Close();
+  PrintStats();
+  if ( !ok ) return 1;
   
-  PhysicsNr vgroup = GroupVelocity(led_info.name );
-  cout << "vgroup = " << vgroup.value << " +/- " << vgroup.error << " ns/mm (" << (vgroup.error/vgroup.value)*1000. << " permille error)" << endl;
-  double test_time = 5000./vgroup.value; // time for 5 meters
-  cout << "For 5 m: " << test_time << " +/- " << (vgroup.error/vgroup.value)*test_time << " ns" << endl;
-  double n_ref = (c*1000./1E9)/vgroup.value;
-  cout << "The effective refractive index is therefore: " << n_ref << " +/-" << (vgroup.error/vgroup.value)*n_ref << " (compare to 1.33)" << endl;
+  set<string> fibres;
+  for (unsigned int i = 0 ; i < jobs.size() ; ++i) {
+    LEDInfo & led_info = jobs[i].led_info;
+    if ( !fibres.insert(led_info.name).second ) continue;
+    PhysicsNr vgroup = GroupVelocity(led_info.name );
+    cout << led_info.name << ":" << endl;
+    cout << "vgroup = " << vgroup.value << " +/- " << vgroup.error << " ns/mm (" << (vgroup.error/vgroup.value)*1000. << " permille error)" << endl;
+    double test_time = 5000./vgroup.value; // time for 5 meters
+    cout << "For 5 m: " << test_time << " +/- " << (vgroup.error/vgroup.value)*test_time << " ns" << endl;
+    double n_ref = (c*1000./1E9)/vgroup.value;
+    cout << "The effective refractive index is therefore: " << n_ref << " +/-" << (vgroup.error/vgroup.value)*n_ref << " (compare to 1.33)" << endl;
+  }
   
   benchmark.Stop("MAKENTUPLE");
   benchmark.Show("MAKENTUPLE");
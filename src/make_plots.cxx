@@ -4,6 +4,7 @@
 //
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <TBenchmark.h>
 #include <TFile.h>
@@ -17,6 +18,10 @@
 #include "include/AVLocTools.h"
 #include "include/AVLocProc.h"
 #include "include/AVLocPlot.h"
+#include "include/AVLocNtuple.h"
+#include "include/AVLocGeometry.h"
+#include "include/AVLocPathCache.h"
+#include "include/AVLocStats.h"
 
 using namespace std;
 
@@ -29,9 +34,39 @@ int main(int argc,char **argv)
   double distance;
   int fibre_nr;
   int sub_nr;
-  double AVOffset;
-  if ( argc != 7 ) {
-    cerr << "Usage: " << argv[0] << " <ntuple filename> <output filename for plots> <distance cut (mm)> <fibre nr> <sub_nr> <AVOffset (mm)>" << endl;
+  double AVOffset = 0;
+  int numThreads = 1;
+  // -c: compare ntuples simulated with different AV offsets, see compareOffsets
+  bool compare = argc > 1 && string(argv[1]) == "-c";
+  vector<string> ntuple_filenames;
+  vector<double> offsets;
+  if ( compare ) {
+    if ( argc < 9 ) {
+      cerr << "Usage: " << argv[0] << " -c <output filename for plots> <distance cut (mm)> <fibre nr> <sub_nr> <threads>"
+	   << " <AVOffset (mm)>:<ntuple filename> <AVOffset (mm)>:<ntuple filename> ..." << endl;
+      return 1;
+    }
+    plot_filename = argv[2];
+    distance      = atof(argv[3]);
+    fibre_nr      = atoi(argv[4]);
+    sub_nr        = atoi(argv[5]);
+    numThreads    = atoi(argv[6]);
+    for (int i = 7 ; i < argc ; ++i) {
+      string arg = argv[i];
+      size_t colon = arg.find(':');
+      if ( colon == string::npos ) {
+	cerr << "Expected <AVOffset (mm)>:<ntuple filename>, got " << arg << endl;
+	return 1;
+      }
+      offsets.push_back(atof(arg.substr(0,colon).c_str()));
+      ntuple_filenames.push_back(arg.substr(colon+1));
+    }
+    ntuple_filename = ntuple_filenames[0];
+  }
+  else if ( argc != 7 && argc != 8 ) {
+    cerr << "Usage: " << argv[0] << " <ntuple filename> <output filename for plots> <distance cut (mm)> <fibre nr> <sub_nr> <AVOffset (mm)> [threads]" << endl;
+    cerr << "       " << argv[0] << " -c <output filename for plots> <distance cut (mm)> <fibre nr> <sub_nr> <threads>"
+	 << " <AVOffset (mm)>:<ntuple filename> <AVOffset (mm)>:<ntuple filename> ..." << endl;
     return 1;
   }
   else {
@@ -41,8 +76,12 @@ int main(int argc,char **argv)
     fibre_nr        = atoi(argv[4]);
     sub_nr          = atoi(argv[5]);
     AVOffset        = atof(argv[6]);
+    if ( argc == 8 ) numThreads = atoi(argv[7]);
+  }
+  {
+    AVLOC_TIMER("RATDB loading");
+    LoadDataBase("make_plots.log");
   }
-  LoadDataBase("make_plots.log");
   char* ratroot = getenv("RATROOT");
   if (ratroot == static_cast<char*>(NULL)) {
     cerr << "Environment variable $RATROOT must be set" << endl;
@@ -53,45 +92,62 @@ int main(int argc,char **argv)
   pmtfile += "/data/pmt/airfill2.ratdb";
   RAT::DB * db = RAT::DB::Get();
   assert(db);
-  db->LoadFile(pmtfile);
-  RAT::DBLinkPtr pmtInfo = db->GetLink("PMTINFO");
-  assert(pmtInfo);
-  PMTInfo pmt_info;
-  pmt_info.x_pos = pmtInfo->GetDArray("x");
-  pmt_info.y_pos = pmtInfo->GetDArray("y");
-  pmt_info.z_pos = pmtInfo->GetDArray("z");
+  PMTInfo pmt_info = GetPMTpositions(GetPMTGeometry(GetPMTGeometryCacheName(ntuple_filename)));
+  SetPathCacheDir(GetPathCacheDirName(ntuple_filename));
   string geofile = rat;
   geofile += "/data/geo/snoplus.geo";
-  db->Load(geofile);
-  //RAT::DB::Get()->LoadDefaults();
-  db->Load(pmtfile);
-  RAT::DU::Utility::Get()->BeginOfRun();
+  {
+    AVLOC_TIMER("RATDB loading");
+    db->Load(geofile);
+    //RAT::DB::Get()->LoadDefaults();
+    db->Load(pmtfile);
+    RAT::DU::Utility::Get()->BeginOfRun();
+  }
   
+  // all ntuples are read in one pass with the database loaded once, the first offset is the reference
+  if ( compare ) {
+    TFile * plot_file = new TFile(plot_filename.data(),"RECREATE");
+    if ( !plot_file->IsOpen() ) {
+      cerr << "Could not open file " << plot_filename << endl;
+      return 0;
+    }
+    compareOffsets(ntuple_filenames,offsets,pmt_info,distance,fibre_nr,sub_nr,numThreads);
+    plot_file->Close();
+    PrintStats();
+    return 0;
+  }
+
   TFile * ntuple_file = new TFile(ntuple_filename.data(),"READ");
-  //TFile * ntuple_file2 = new TFile("totalHighStatsTuple.root","READ");
   if ( !ntuple_file->IsOpen() ) {
     cerr << "Could not open file " << ntuple_filename << endl;
     return 0;
   }
-  TNtuple * ntuple = (TNtuple*)ntuple_file->Get("avloctuple");
-  //TNtuple * ntupleOffset = (TNtuple*)ntuple_file2->Get("avloctuple");
-  assert(ntuple);
-  ntuple->Print();
+  HitReader reader(ntuple_file,pmt_info);
+  assert(reader.IsValid());
+  reader.GetTree()->Print();
 
   TFile * plot_file = new TFile(plot_filename.data(),"RECREATE");
   if ( !plot_file->IsOpen() ) {
     cerr << "Could not open file " << plot_filename << endl;
     return 0;
   }
-  TH2D * hflatmap = flatmap_ntuple(ntuple,distance,fibre_nr,sub_nr,0.,50.,true);
-  //time_histograms(ntuple,distance,fibre_nr,sub_nr);
-  plot_offset(ntuple,distance,fibre_nr,sub_nr, AVOffset);
-  //plotAVFlightDifference(ntuple, ntupleOffset ,distance, fibre_nr, sub_nr);
- // plotAverageHitOffset(ntuple,distance);
+  // all plots are filled in a single pass over the ntuple
+  HitLoop loop(reader,numThreads);
+  FlatmapAnalysis flatmap(distance,fibre_nr,sub_nr,0.,50.,true);
+  OffsetAnalysis  offset(distance,fibre_nr,sub_nr,AVOffset);
+  loop.Book(&flatmap);
+  //TimeHistogramsAnalysis histograms(distance,fibre_nr,sub_nr);
+  //loop.Book(&histograms);
+  loop.Book(&offset);
+ // AverageHitOffsetAnalysis average(distance);
+ // loop.Book(&average);
+  loop.Run();
   cout << "Made Histograms"<<endl;
+  TH2D * hflatmap = flatmap.GetFlatmap();
   hflatmap->Write();
   plot_file->Close();
   cout << "Closed the file"<<endl;
+  PrintStats();
   
   //benchmark.Stop("MAKEPLOTS");
   //benchmark.Show("MAKEPLOTS");